@@ -5,6 +5,7 @@
 #include "alarm.h"
 #include "minithread.h"
 #include "pqueue.h"
+#include "slab.h"
 
 typedef struct alarm* alarm_t;
 
@@ -17,6 +18,9 @@ struct alarm
 
 pqueue_t alarm_pqueue;
 
+static struct slab_cache alarm_cache =
+    SLAB_CACHE_INITIALIZER("alarm", sizeof(struct alarm), NULL);
+
 /* register an alarm to go off in "delay" milliseconds.  Returns a handle to
  * the alarm. Returns NULL on failure.
  */
@@ -24,7 +28,7 @@ alarm_id
 register_alarm(int delay, alarm_handler_t alarm, void *arg) {
     interrupt_level_t old_level;
     long t = time_ticks * PERIOD + delay; // Time
-    alarm_t a = (alarm_t) malloc (sizeof(struct alarm));
+    alarm_t a = (alarm_t) slab_alloc(&alarm_cache);
     if ( !a ) return NULL; // Failure to malloc
 
     a->func = alarm;
@@ -48,7 +52,7 @@ deregister_alarm(alarm_id alarm) {
 
     old_level = set_interrupt_level(DISABLED);
     if (pqueue_delete(alarm_pqueue, alarm) == 0) {
-        free(alarm); // Only frees if alarm is found
+        slab_free(&alarm_cache, alarm); // Only frees if alarm is found
         set_interrupt_level(old_level);
         return 0;
     }
@@ -78,7 +82,7 @@ void check_alarms() {
             pqueue_dequeue(alarm_pqueue, &a);
             alarm = (alarm_t) a;
             alarm->func(alarm->arg);
-            free(alarm); // Frees alarm after execution
+            slab_free(&alarm_cache, alarm); // Frees alarm after execution
         } else {
             break;
         }
@@ -0,0 +1,253 @@
+/*
+ * Packet capture into a lock-free ring, exported as pcap.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "defs.h"
+#include "minithread.h"
+#include "miniroute.h"
+#include "miniheader.h"
+#include "sim.h"
+#include "capture.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define LINKTYPE_RAW 101
+#define IP_UDP_HEADERS 28
+#define IP_PROTOCOL_UDP 17
+
+#define SLOT_BUSY (~0UL)
+
+/* offsets of the fields the filter looks at */
+#define PROTOCOL_OFFSET (sizeof(struct routing_header))
+#define SOURCE_PORT_OFFSET (PROTOCOL_OFFSET + 9)
+#define DESTINATION_PORT_OFFSET (PROTOCOL_OFFSET + 19)
+
+typedef struct capture_record {
+    volatile unsigned long seq; // Ticket + 1 once written, or SLOT_BUSY
+    struct timeval time;
+    int direction;
+    int len;
+    network_address_t peer;
+    char data[CAPTURE_SNAPLEN];
+} capture_record_t;
+
+/*
+ * Producers take a ticket from head, and the ticket picks the slot, which
+ * they mark busy while writing it. The ring wraps over records that have
+ * not been dumped. A producer that laps one still writing its slot gives
+ * its packet up rather than wait. A dump skips any slot whose sequence
+ * does not match its ticket before and after it is copied: one given up,
+ * being written, or overwritten during the copy.
+ */
+static capture_record_t ring[CAPTURE_RING_SIZE];
+static volatile unsigned long ring_head;
+static unsigned long ring_tail; // Only dumps touch it
+
+static capture_filter_t filter = { -1, -1, -1 };
+
+static volatile long captured;
+static volatile long dropped;
+
+volatile int capture_running = 0;
+
+void capture_start(capture_filter_t *f) {
+    capture_running = 0;
+    __sync_synchronize();
+    if (f != NULL) {
+        filter = *f;
+    } else {
+        filter.routing_type = -1;
+        filter.protocol = -1;
+        filter.port = -1;
+    }
+    __sync_synchronize(); // Publish the filter before turning capture on
+    capture_running = 1;
+}
+
+void capture_stop() {
+    capture_running = 0;
+}
+
+void capture_stats(long *c, long *d) {
+    if (c) *c = captured;
+    if (d) *d = dropped;
+}
+
+static int matches(char *data, int len) {
+    int port;
+
+    if (filter.routing_type != -1 &&
+        (len < 1 || data[0] != filter.routing_type))
+        return 0;
+    if (filter.protocol == -1 && filter.port == -1)
+        return 1;
+
+    if (len < DESTINATION_PORT_OFFSET + 2 || data[0] != ROUTING_DATA)
+        return 0;
+    if (filter.protocol != -1 && data[PROTOCOL_OFFSET] != filter.protocol)
+        return 0;
+    if (filter.port != -1) {
+        port = unpack_unsigned_short(data + SOURCE_PORT_OFFSET);
+        if (port != filter.port &&
+            unpack_unsigned_short(data + DESTINATION_PORT_OFFSET) != filter.port)
+            return 0;
+    }
+    return 1;
+}
+
+void capture_packet(int direction, network_address_t peer,
+                    struct iovec *iov, int iovcnt, int len) {
+    char data[CAPTURE_SNAPLEN];
+    capture_record_t *r;
+    unsigned long ticket;
+    unsigned long old;
+    int snap;
+    int off;
+    int n;
+    int i;
+
+    // The head of the packet, to filter it before taking a slot
+    for (off = 0, i = 0; i < iovcnt && off < CAPTURE_SNAPLEN; i++) {
+        n = iov[i].iov_len;
+        if (n > CAPTURE_SNAPLEN - off) n = CAPTURE_SNAPLEN - off;
+        memcpy(data + off, iov[i].iov_base, n);
+        off += n;
+    }
+    snap = off;
+    if (!matches(data, snap))
+        return;
+
+    ticket = __sync_fetch_and_add(&ring_head, 1);
+    __sync_fetch_and_add(&captured, 1);
+    r = &ring[ticket & (CAPTURE_RING_SIZE - 1)];
+    old = r->seq;
+    if (old == SLOT_BUSY || !__sync_bool_compare_and_swap(&r->seq, old, SLOT_BUSY))
+        return; // The dump counts it dropped
+
+    if (sim_enabled) {
+        r->time.tv_sec = time_ticks * PERIOD / 1000;
+        r->time.tv_usec = time_ticks * PERIOD % 1000 * 1000;
+    } else {
+        gettimeofday(&r->time, NULL);
+    }
+    r->direction = direction;
+    r->len = len;
+    network_address_copy(peer, r->peer);
+    memcpy(r->data, data, snap);
+
+    __sync_synchronize(); // Publish the record before marking it complete
+    r->seq = ticket + 1;
+}
+
+static unsigned short ip_checksum(unsigned char *hdr, int len) {
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < len; i += 2) {
+        sum += (hdr[i] << 8) | hdr[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum & 0xffff;
+}
+
+/*
+ * The IPv4 and UDP headers of a record, sender first
+ */
+static void ip_udp_headers(capture_record_t *r, network_address_t me,
+                           unsigned char *hdr) {
+    unsigned int *src = r->direction == CAPTURE_OUT ? me : r->peer;
+    unsigned int *dst = r->direction == CAPTURE_OUT ? r->peer : me;
+    int total = r->len + IP_UDP_HEADERS > 0xffff ? 0xffff
+                                                 : r->len + IP_UDP_HEADERS;
+    unsigned short sum;
+
+    memset(hdr, 0, IP_UDP_HEADERS);
+    hdr[0] = 0x45; // Version 4, 5 word header
+    hdr[2] = total >> 8;
+    hdr[3] = total & 0xff;
+    hdr[8] = 64; // Time to live
+    hdr[9] = IP_PROTOCOL_UDP;
+    memcpy(hdr + 12, &src[0], 4); // Addresses and ports are in network order
+    memcpy(hdr + 16, &dst[0], 4);
+    sum = ip_checksum(hdr, 20);
+    hdr[10] = sum >> 8;
+    hdr[11] = sum & 0xff;
+
+    memcpy(hdr + 20, &src[1], 2);
+    memcpy(hdr + 22, &dst[1], 2);
+    hdr[24] = (total - 20) >> 8;
+    hdr[25] = (total - 20) & 0xff;
+    // A zero UDP checksum means none
+}
+
+int capture_dump(char *filename) {
+    unsigned char hdr[IP_UDP_HEADERS];
+    capture_record_t r;
+    capture_record_t *slot;
+    network_address_t me;
+    unsigned int file_hdr[6];
+    unsigned int rec_hdr[4];
+    unsigned long head;
+    unsigned long t;
+    int written = 0;
+    int snap;
+    FILE *f;
+
+    f = fopen(filename, "wb");
+    if (f == NULL) return -1;
+
+    file_hdr[0] = PCAP_MAGIC;
+    file_hdr[1] = 2 | (4 << 16); // Version 2.4
+    file_hdr[2] = 0; // Timestamps are UTC
+    file_hdr[3] = 0;
+    file_hdr[4] = CAPTURE_SNAPLEN + IP_UDP_HEADERS;
+    file_hdr[5] = LINKTYPE_RAW;
+    if (fwrite(file_hdr, sizeof(file_hdr), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+
+    network_get_my_address(me);
+    head = ring_head;
+    if (head - ring_tail > CAPTURE_RING_SIZE) {
+        dropped += head - ring_tail - CAPTURE_RING_SIZE;
+        ring_tail = head - CAPTURE_RING_SIZE;
+    }
+
+    for (t = ring_tail; t != head; t++) {
+        slot = &ring[t & (CAPTURE_RING_SIZE - 1)];
+        if (slot->seq != t + 1) {
+            dropped++;
+            continue;
+        }
+        memcpy(&r, slot, sizeof(r));
+        __sync_synchronize();
+        if (slot->seq != t + 1) {
+            dropped++;
+            continue;
+        }
+
+        snap = r.len < CAPTURE_SNAPLEN ? r.len : CAPTURE_SNAPLEN;
+        ip_udp_headers(&r, me, hdr);
+        rec_hdr[0] = r.time.tv_sec;
+        rec_hdr[1] = r.time.tv_usec;
+        rec_hdr[2] = snap + IP_UDP_HEADERS;
+        rec_hdr[3] = r.len + IP_UDP_HEADERS;
+        if (fwrite(rec_hdr, sizeof(rec_hdr), 1, f) != 1 ||
+            fwrite(hdr, IP_UDP_HEADERS, 1, f) != 1 ||
+            (snap > 0 && fwrite(r.data, snap, 1, f) != 1)) {
+            fclose(f);
+            return -1;
+        }
+        written++;
+    }
+    ring_tail = head;
+
+    if (fclose(f) != 0) return -1;
+    return written;
+}
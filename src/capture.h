@@ -0,0 +1,79 @@
+/*
+ * Packet capture.
+ *
+ * While capture is running, every packet the network layer sends or
+ * receives that passes the filter is recorded with a timestamp, its
+ * direction, the peer's address, its length and its first
+ * CAPTURE_SNAPLEN bytes, which cover the routing header and a
+ * mini_header_reliable behind it. Records go into a ring that keeps the
+ * most recent CAPTURE_RING_SIZE packets. The senders and the device
+ * pollers fill it concurrently without locks: each takes a slot with an
+ * atomic increment, and marks it busy, then complete once written.
+ *
+ * capture_dump() drains the ring into a pcap file (microsecond
+ * timestamps, link type LINKTYPE_RAW, 101). Each packet is encapsulated
+ * in an IPv4 and a UDP header built from the two ends' addresses and UDP
+ * ports, sender first, so that standard tools show who sent what; the
+ * UDP payload is the PortOS packet as it was on the wire, starting with
+ * the struct routing_header of miniroute.h, then for data packets a
+ * mini_header or mini_header_reliable of miniheader.h and the data. All
+ * multi-byte header fields are in network byte order. The IPv4 and UDP
+ * lengths give the packet's full length even when it was cut short.
+ *
+ * In simulation mode timestamps are in virtual time.
+ */
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <sys/uio.h>
+#include "network.h"
+
+#define CAPTURE_RING_SIZE 4096 /* must be a power of 2 */
+#define CAPTURE_SNAPLEN 256 /* bytes kept of each packet */
+
+enum { CAPTURE_IN = 0, CAPTURE_OUT };
+
+/*
+ * Packets to capture. A field of -1 matches anything. The protocol and
+ * port only match data packets, the port being either end's miniport.
+ */
+typedef struct capture_filter {
+    int routing_type; /* enum routing_packet_type */
+    int protocol; /* PROTOCOL_MINIDATAGRAM or PROTOCOL_MINISTREAM */
+    int port;
+} capture_filter_t;
+
+/*
+ * Start capturing the packets that pass filter, or all packets if filter
+ * is NULL. May be called again to change the filter.
+ */
+extern void capture_start(capture_filter_t *filter);
+
+/*
+ * Stop capturing. Packets still in the ring are kept until the next dump.
+ */
+extern void capture_stop();
+
+/*
+ * Drain the ring into [filename] as a pcap file. Dumps must not run
+ * concurrently with each other.
+ * Returns the number of packets written, or -1 on failure.
+ */
+extern int capture_dump(char *filename);
+
+/*
+ * Packets captured, and those of them dropped (overwritten before they
+ * were dumped, or given up on a busy slot) since the program started.
+ */
+extern void capture_stats(long *captured, long *dropped);
+
+/*
+ * Record a packet of len bytes, given as iovcnt pieces, sent to or
+ * received from peer. Called by the network layer when capture_running.
+ */
+extern void capture_packet(int direction, network_address_t peer,
+                           struct iovec *iov, int iovcnt, int len);
+
+extern volatile int capture_running;
+
+#endif /*__CAPTURE_H__*/
@@ -0,0 +1,170 @@
+/*
+ * Host-side device polling with epoll.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "defs.h"
+#include "devpoll.h"
+
+#define MAX_EVENTS 64 // Ready descriptors handled per wakeup
+
+struct source {
+    int fd;
+    devpoll_handler_t handler;
+    void *arg;
+    struct source *next;
+};
+
+struct devpoll {
+    int epfd;
+    pthread_mutex_t lock; // Protects sources
+    struct source *sources;
+    long wakeups;
+    long events;
+};
+
+static devpoll_t system_poller = NULL;
+static pthread_once_t system_once = PTHREAD_ONCE_INIT;
+
+static void *poll_loop(void *arg) {
+    devpoll_t poller = (devpoll_t) arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct source *s;
+    int n;
+    int i;
+
+    for (;;) {
+        n = epoll_wait(poller->epfd, events, MAX_EVENTS, -1);
+        if (n <= 0) continue;
+
+        poller->wakeups++;
+        poller->events += n;
+        for (i = 0; i < n; i++) {
+            s = (struct source *) events[i].data.ptr;
+            s->handler(s->fd, s->arg);
+        }
+    }
+    return NULL;
+}
+
+devpoll_t devpoll_new() {
+    devpoll_t poller;
+    pthread_t thread;
+    sigset_t set;
+    sigset_t old_set;
+    int error;
+
+    poller = (devpoll_t) malloc(sizeof(struct devpoll));
+    if ( !poller ) return NULL;
+
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd == -1) {
+        free(poller);
+        return NULL;
+    }
+    pthread_mutex_init(&poller->lock, NULL);
+    poller->sources = NULL;
+    poller->wakeups = 0;
+    poller->events = 0;
+
+    // The thread inherits a mask that keeps interrupts on the main thread
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    error = pthread_create(&thread, NULL, poll_loop, poller);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (error) {
+        close(poller->epfd);
+        free(poller);
+        return NULL;
+    }
+    pthread_detach(thread);
+    return poller;
+}
+
+static void start_system_poller() {
+    system_poller = devpoll_new();
+}
+
+devpoll_t devpoll_system() {
+    pthread_once(&system_once, start_system_poller);
+    AbortOnCondition(system_poller == NULL, "devpoll_new");
+    return system_poller;
+}
+
+int devpoll_add(devpoll_t poller, int fd, devpoll_handler_t handler,
+                void *arg) {
+    struct epoll_event event;
+    struct source *s;
+
+    s = (struct source *) malloc(sizeof(struct source));
+    if ( !s ) return -1;
+
+    s->fd = fd;
+    s->handler = handler;
+    s->arg = arg;
+
+    event.events = EPOLLIN;
+    event.data.ptr = s;
+
+    pthread_mutex_lock(&poller->lock);
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        pthread_mutex_unlock(&poller->lock);
+        free(s);
+        return -1;
+    }
+    s->next = poller->sources;
+    poller->sources = s;
+    pthread_mutex_unlock(&poller->lock);
+    return 0;
+}
+
+/*
+ * Only the source's own handler removes it, and an fd is reported at most
+ * once per wakeup, so no other event of this wakeup refers to it.
+ */
+void devpoll_remove(devpoll_t poller, int fd) {
+    struct source **p;
+    struct source *s;
+
+    pthread_mutex_lock(&poller->lock);
+    for (p = &poller->sources; *p != NULL; p = &(*p)->next) {
+        if ((*p)->fd == fd) break;
+    }
+    s = *p;
+    if (s != NULL) {
+        *p = s->next;
+        epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    pthread_mutex_unlock(&poller->lock);
+    free(s);
+}
+
+int devpoll_timer(devpoll_t poller, long period, devpoll_handler_t handler,
+                  void *arg) {
+    struct itimerspec its;
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) return -1;
+
+    its.it_value.tv_sec = period / 1000000000;
+    its.it_value.tv_nsec = period % 1000000000;
+    its.it_interval = its.it_value;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+        devpoll_add(poller, fd, handler, arg) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void devpoll_stats(devpoll_t poller, long *wakeups, long *events) {
+    if (wakeups) *wakeups = poller->wakeups;
+    if (events) *events = poller->events;
+}
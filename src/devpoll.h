@@ -0,0 +1,64 @@
+/*
+ * devpoll.h:
+ *      Host-side device polling.
+ *
+ *      A poller is one pthread waiting in epoll on any number of file
+ *      descriptors: sockets, eventfds that another thread writes to, stdin,
+ *      timerfds. When a descriptor becomes readable its handler runs on the
+ *      poller thread, typically reading whatever is available and posting it
+ *      to an interrupt ring. All the handlers that are ready run for one
+ *      wakeup, so their events reach the virtual processor together.
+ *
+ *      The simulated devices share the system poller. Handlers run with all
+ *      signals blocked and must not call into minithreads. A handler that
+ *      posts to a full interrupt ring waits there for the virtual processor
+ *      to drain it, and the other descriptors on its poller wait with it,
+ *      so ring handlers should not block for long.
+ */
+#ifndef __DEVPOLL_H__
+#define __DEVPOLL_H__
+
+typedef struct devpoll *devpoll_t;
+
+/*
+ * Called on the poller thread when fd is readable. Descriptors are
+ * level-triggered, so a handler that leaves data unread is called again.
+ */
+typedef void (*devpoll_handler_t)(int fd, void *arg);
+
+/*
+ * The poller shared by the devices, started on first use.
+ */
+extern devpoll_t devpoll_system();
+
+/*
+ * Start a poller with a thread of its own. Returns NULL on failure.
+ */
+extern devpoll_t devpoll_new();
+
+/*
+ * Watch fd for input. Returns 0 on success, -1 on failure, e.g. for a
+ * regular file, which epoll cannot watch.
+ */
+extern int devpoll_add(devpoll_t poller, int fd, devpoll_handler_t handler,
+                       void *arg);
+
+/*
+ * Stop watching fd. May only be called by fd's own handler.
+ */
+extern void devpoll_remove(devpoll_t poller, int fd);
+
+/*
+ * Run handler every period nanoseconds. The handler is passed a timerfd
+ * and must read the 8 byte expiration count from it. Returns the timerfd,
+ * or -1 on failure.
+ */
+extern int devpoll_timer(devpoll_t poller, long period,
+                         devpoll_handler_t handler, void *arg);
+
+/*
+ * Wakeups of the poller thread and handler calls made for them.
+ */
+extern void devpoll_stats(devpoll_t poller, long *wakeups, long *events);
+
+#endif /*__DEVPOLL_H__*/
@@ -1,14 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "defs.h"
 #include "disk.h"
 #include "interrupts_private.h"
+#include "devpoll.h"
 #include "random.h"
+#include "sim.h"
 
 pthread_mutex_t disk_mutex;
 
+/* generator behind the crash, failure and reordering decisions */
+static random_state_t disk_random;
+
+typedef enum { DISK_OK, DISK_CRASHED } disk_state_t;
+
+/* state of the disk in simulation mode, where there is no disk controller */
+static disk_state_t sim_disk_state = DISK_OK;
+
+static void disk_sim_complete(void* arg);
+
 /* disk operation parameters */
 double crash_rate = 0.0;
 double failure_rate = 0.0;
@@ -30,6 +45,7 @@ void start_disk_poll(disk_t* disk); /* forward declaration */
 int disk_send_request(disk_t* disk, int blocknum, char* buffer,
         disk_request_type_t type){
     disk_queue_elem_t* saved_last=NULL;
+    uint64_t one = 1;
     disk_queue_elem_t* disk_request
         = (disk_queue_elem_t*) malloc(sizeof(disk_queue_elem_t));
 
@@ -60,8 +76,16 @@ int disk_send_request(disk_t* disk, int blocknum, char* buffer,
         disk->last=disk_request;
     }
 
+    /* in simulation mode the request completes at a modeled time */
+    if (sim_enabled) {
+        pthread_mutex_unlock(&disk_mutex);
+        if (sim_schedule(sim_disk_delay(), disk_sim_complete, disk) == -1)
+            return -1;
+        return 0;
+    }
+
     /* signal the task that simulates the disk */
-    if (sem_post(&disk->semaphore)){
+    if (write(disk->requests, &one, sizeof(one)) != sizeof(one)){
         kprintf("You have exceeded the maximum number of requests pending.\n");
 
         /* undo changes made to the request queue */
@@ -191,215 +215,251 @@ disk_write_block(disk_t* disk, int blocknum, char* buffer) {
 }
 
 
-/* handle read and write to disk. Watch the job queue and
-   submit the requests to the operating system one by one.
-   On completion, the user suplied function with the user
-   suplied parameter is called
-
-   The interrupt mechanism is used much like in the network
-   case. One such process per disk.
-
-   The argument is a disk_t with the disk description.
+/* Serve the request at the head of the disk queue. Returns the argument
+   for the completion interrupt, or NULL if the queue was empty. A
+   DISK_SHUTDOWN request also closes the disk.
  */
-void disk_poll(void* arg) {
-    enum { DISK_OK, DISK_CRASHED } disk_state;
-
-    disk_t* disk = (disk_t*) arg;
+static disk_interrupt_arg_t* disk_serve_request(disk_t* disk, disk_state_t* disk_state) {
     disk_layout_t layout;
 
     disk_interrupt_arg_t* disk_interrupt;
     disk_queue_elem_t* disk_request;
 
-    disk_state=DISK_OK;
+    int blocknum;
+    char* buffer;
+    disk_request_type_t type;
+    int offset;
 
-    for (;;){
-        int blocknum;
-        char* buffer;
-        disk_request_type_t type;
-        int offset;
+    /* get exclusive access to queue handling  and dequeue a request */
+    pthread_mutex_lock(&disk_mutex);
 
-        /* We use mutex to protect queue handling, as should
-           the code that inserts requests in the queue
+    layout = disk->layout; /* this is the layout used until the request is fulfilled */
+    /* this is safe since a disk can only grow */
+
+    if (disk->queue != NULL){
+        disk_interrupt = (disk_interrupt_arg_t*)
+            malloc(sizeof(disk_interrupt_arg_t));
+        assert( disk_interrupt != NULL);
+
+        disk_interrupt->disk = disk;
+        /* we look first at the first request in the queue
+           to see if it is special.
          */
+        disk_interrupt->request =
+            disk->queue->request;
 
-        /* wait for somebody to put something in the queue */
-        sem_wait(&disk->semaphore);
+        /* check if we shut down the disk */
+        if (disk->queue->request.type == DISK_SHUTDOWN){
+            if (DEBUG)
+                kprintf("Disk: Shutting down.\n");
 
-        if (DEBUG)
-            kprintf("Disk Controler: got a request.\n");
-
-        /* get exclusive access to queue handling  and dequeue a request */
-        pthread_mutex_lock(&disk_mutex);
-
-        layout = disk->layout; /* this is the layout used until the request is fulfilled */
-        /* this is safe since a disk can only grow */
-
-        if (disk->queue != NULL){
-            disk_interrupt = (disk_interrupt_arg_t*)
-                malloc(sizeof(disk_interrupt_arg_t));
-            assert( disk_interrupt != NULL);
-
-            disk_interrupt->disk = disk;
-            /* we look first at the first request in the queue
-               to see if it is special.
-             */
-            disk_interrupt->request =
-                disk->queue->request;
-
-            /* check if we shut down the disk */
-            if (disk->queue->request.type == DISK_SHUTDOWN){
-                if (DEBUG)
-                    kprintf("Disk: Shutting down.\n");
-
-                disk_interrupt->reply=DISK_REPLY_OK;
-                fclose(disk->file);
-                pthread_mutex_unlock(&disk_mutex);
-                sem_destroy(&disk->semaphore);
-                send_interrupt(DISK_INTERRUPT_TYPE, mini_disk_handler, (void*)disk_interrupt);
-                break; /* end the disk task */
-            }
+            disk_interrupt->reply=DISK_REPLY_OK;
+            fclose(disk->file);
+            pthread_mutex_unlock(&disk_mutex);
+            return disk_interrupt;
+        }
 
-            /* check if we got to reset the disk */
-            if (disk->queue->request.type == DISK_RESET){
-                disk_queue_elem_t* curr;
-                disk_queue_elem_t *next;
-
-                if (DEBUG)
-                    kprintf("Disk: Resetting.\n");
-
-                disk_interrupt->reply=DISK_REPLY_OK;
-                /* empty the queue */
-                curr=disk->queue;
-                while (curr!=NULL){
-                    next=curr->next;
-                    free(curr);
-                    curr=next;
-                }
-                disk->queue = disk->last = NULL;
-
-                disk_state = DISK_OK;
-                pthread_mutex_unlock(&disk_mutex);
-                goto sendinterrupt;
-            }
+        /* check if we got to reset the disk */
+        if (disk->queue->request.type == DISK_RESET){
+            disk_queue_elem_t* curr;
+            disk_queue_elem_t *next;
 
-            /* permute the first two elements in the queue
-               probabilistically if queue has two elements
-             */
-            if (disk->queue->next !=NULL &&
-                    (genrand() < reordering_rate)){
-                disk_queue_elem_t* first = disk->queue;
-                disk_queue_elem_t* second = first->next;
-                first->next = second->next;
-                second->next = first;
-                disk->queue = second;
-                if (disk->last == second)
-                    disk->last = first;
+            if (DEBUG)
+                kprintf("Disk: Resetting.\n");
+
+            disk_interrupt->reply=DISK_REPLY_OK;
+            /* empty the queue */
+            curr=disk->queue;
+            while (curr!=NULL){
+                next=curr->next;
+                free(curr);
+                curr=next;
             }
+            disk->queue = disk->last = NULL;
 
-            /* dequeue the first request */
-            disk_request = disk->queue;
-            disk->queue = disk_request->next;
-            if (disk->queue == NULL)
-                disk->last = NULL;
-        } else {
-            /* empty queue, release the lock and leave */
+            *disk_state = DISK_OK;
             pthread_mutex_unlock(&disk_mutex);
-            break;
+            goto sendinterrupt;
         }
 
+        /* permute the first two elements in the queue
+           probabilistically if queue has two elements
+         */
+        if (disk->queue->next !=NULL &&
+                (genrand_r(&disk_random) < reordering_rate)){
+            disk_queue_elem_t* first = disk->queue;
+            disk_queue_elem_t* second = first->next;
+            first->next = second->next;
+            second->next = first;
+            disk->queue = second;
+            if (disk->last == second)
+                disk->last = first;
+        }
+
+        /* dequeue the first request */
+        disk_request = disk->queue;
+        disk->queue = disk_request->next;
+        if (disk->queue == NULL)
+            disk->last = NULL;
+    } else {
+        /* empty queue, release the lock and leave */
         pthread_mutex_unlock(&disk_mutex);
+        return NULL;
+    }
 
-        disk_interrupt->request = disk_request->request;
+    pthread_mutex_unlock(&disk_mutex);
 
-        /* crash the disk ocasionally */
-        if (genrand() < crash_rate){
-            disk_state = DISK_CRASHED;
+    disk_interrupt->request = disk_request->request;
 
-            /*      if (DEBUG) */
-            kprintf("Disk: Crashing disk.\n");
+    /* crash the disk ocasionally */
+    if (genrand_r(&disk_random) < crash_rate){
+        *disk_state = DISK_CRASHED;
 
-        }
+        /*      if (DEBUG) */
+        kprintf("Disk: Crashing disk.\n");
 
-        /* check if disk crashed */
-        if (disk_state == DISK_CRASHED){
-            disk_interrupt->reply=DISK_REPLY_CRASHED;
-            goto sendinterrupt;
-        }
+    }
 
-        if ( genrand() < failure_rate ) {
-            /* Trash the request */
-            disk_interrupt->reply = DISK_REPLY_FAILED;
+    /* check if disk crashed */
+    if (*disk_state == DISK_CRASHED){
+        disk_interrupt->reply=DISK_REPLY_CRASHED;
+        goto sendinterrupt;
+    }
 
-            if (DEBUG)
-                kprintf("Disk: Request failed.\n");
+    if ( genrand_r(&disk_random) < failure_rate ) {
+        /* Trash the request */
+        disk_interrupt->reply = DISK_REPLY_FAILED;
 
-            goto sendinterrupt;
-        }
+        if (DEBUG)
+            kprintf("Disk: Request failed.\n");
 
-        /* Check validity of request */
+        goto sendinterrupt;
+    }
 
-        disk_interrupt->reply = DISK_REPLY_OK;
+    /* Check validity of request */
 
-        blocknum = disk_request->request.blocknum;
-        buffer = disk_request->request.buffer;
-        type = disk_request->request.type;
+    disk_interrupt->reply = DISK_REPLY_OK;
 
-        if (DEBUG)
-            kprintf("Disk Controler: got a request for block %d type %d .\n",
-                    blocknum, type);
+    blocknum = disk_request->request.blocknum;
+    buffer = disk_request->request.buffer;
+    type = disk_request->request.type;
+
+    if (DEBUG)
+        kprintf("Disk Controler: got a request for block %d type %d .\n",
+                blocknum, type);
 
-        /* If we got here is a read or a write request */
+    /* If we got here is a read or a write request */
 
-        offset = DISK_BLOCK_SIZE*(blocknum + 1);
+    offset = DISK_BLOCK_SIZE*(blocknum + 1);
+
+    if ( (blocknum >= layout.size) ||
+            (fseek(disk->file, offset, SEEK_SET) != 0) ) {
+        disk_interrupt->reply = DISK_REPLY_ERROR;
+
+        if (DEBUG)
+            kprintf("Disk Controler: Block too big or failed fseek, block=%d,  offset=%d, disk_size=%d.\n",
+                    blocknum, offset, layout.size);
 
-        if ( (blocknum >= layout.size) ||
-                (fseek(disk->file, offset, SEEK_SET) != 0) ) {
-            disk_interrupt->reply = DISK_REPLY_ERROR;
+        goto sendinterrupt;
+    }
 
+    switch (type) {
+        case DISK_READ:
+            if (fread(buffer, 1, DISK_BLOCK_SIZE, disk->file)
+                    < DISK_BLOCK_SIZE)
+                disk_interrupt->reply = DISK_REPLY_ERROR;
             if (DEBUG)
-                kprintf("Disk Controler: Block too big or failed fseek, block=%d,  offset=%d, disk_size=%d.\n",
-                        blocknum, offset, layout.size);
+                kprintf("Disk: Read request.\n");
 
-            goto sendinterrupt;
-        }
+            break;
+        case DISK_WRITE:
+            if (fwrite(buffer, 1, DISK_BLOCK_SIZE, disk->file)
+                    < DISK_BLOCK_SIZE)
+                disk_interrupt->reply = DISK_REPLY_ERROR;
+            fflush(disk->file);
+            if (DEBUG)
+                kprintf("Disk: Write request.\n");
 
-        switch (type) {
-            case DISK_READ:
-                if (fread(buffer, 1, DISK_BLOCK_SIZE, disk->file)
-                        < DISK_BLOCK_SIZE)
-                    disk_interrupt->reply = DISK_REPLY_ERROR;
-                if (DEBUG)
-                    kprintf("Disk: Read request.\n");
-
-                break;
-            case DISK_WRITE:
-                if (fwrite(buffer, 1, DISK_BLOCK_SIZE, disk->file)
-                        < DISK_BLOCK_SIZE)
-                    disk_interrupt->reply = DISK_REPLY_ERROR;
-                fflush(disk->file);
-                if (DEBUG)
-                    kprintf("Disk: Write request.\n");
-
-                break;
-            default:
-                break;
-        }
+            break;
+        default:
+            break;
+    }
 
 sendinterrupt:
-        if (DEBUG)
-            kprintf("Disk Controler: sending an interrupt for block %d, request type %d, with reply %d.\n",
-                    disk_interrupt->request.blocknum,
-                    disk_interrupt->request.type,
-                    disk_interrupt->reply);
+    if (DEBUG)
+        kprintf("Disk Controler: sending an interrupt for block %d, request type %d, with reply %d.\n",
+                disk_interrupt->request.blocknum,
+                disk_interrupt->request.type,
+                disk_interrupt->reply);
+
+    return disk_interrupt;
+}
+
+/* handle read and write to disk. Watch the job queue and
+   submit the requests to the operating system one by one.
+   On completion, the user suplied function with the user
+   suplied parameter is called
 
-        send_interrupt(DISK_INTERRUPT_TYPE, mini_disk_handler, (void*)disk_interrupt);
+   The interrupt mechanism is used much like in the network
+   case. Requests are counted on an eventfd that the device poller
+   watches; each wakeup serves every request counted so far.
+
+   The argument is a disk_t with the disk description.
+ */
+static void disk_requested(int fd, void* arg) {
+    disk_t* disk = (disk_t*) arg;
+    disk_interrupt_arg_t* disk_interrupt;
+    disk_request_type_t type;
+    disk_state_t disk_state;
+    uint64_t requests;
+
+    /* the count of requests queued since the last call */
+    if (read(fd, &requests, sizeof(requests)) != sizeof(requests))
+        return;
+
+    if (DEBUG)
+        kprintf("Disk Controler: got %lu requests.\n", (unsigned long) requests);
+
+    disk_state = disk->state;
+    while (requests-- > 0) {
+        /* the queue is empty if a reset discarded the requests */
+        disk_interrupt = disk_serve_request(disk, &disk_state);
+        if (disk_interrupt == NULL)
+            break;
+
+        /* once posted, the handler may free it at any time */
+        type = disk_interrupt->request.type;
+        interrupt_ring_post(disk->ring, (void*)disk_interrupt);
+
+        if (type == DISK_SHUTDOWN) {
+            /* stop serving the disk */
+            devpoll_remove(devpoll_system(), fd);
+            close(fd);
+            break;
+        }
     }
+    disk->state = disk_state;
+}
+
+/* Simulation mode completion event: serve one request on the virtual
+   processor, exactly as the controller would have, and run the handler.
+ */
+static void disk_sim_complete(void* arg) {
+    disk_interrupt_arg_t* disk_interrupt;
 
+    disk_interrupt = disk_serve_request((disk_t*) arg, &sim_disk_state);
+    if (disk_interrupt != NULL)
+        mini_disk_handler(disk_interrupt);
+}
+
+/* The disk handler is installed after the disk is started, so the
+   ring looks it up when each completion is delivered.
+ */
+static void disk_ring_handler(void* arg) {
+    mini_disk_handler(arg);
 }
 
 void start_disk_poll(disk_t* disk){
-    //int id;
-    pthread_t disk_thread;
     sigset_t set;
     struct sigaction sa;
     sigset_t old_set;
@@ -421,11 +481,24 @@ void start_disk_poll(disk_t* disk){
     /* reset the request queue */
     disk->queue = disk->last = NULL;
 
-    /* create request semaphore */
-    AbortOnCondition(sem_init(&disk->semaphore, 0, 0),"sem_init");
+    /* requests are completed by simulation events instead of a task */
+    if (sim_enabled) {
+        sim_disk_state = DISK_OK;
+        pthread_sigmask(SIG_SETMASK,&old_set,NULL);
+        return;
+    }
+
+    /* create request counter */
+    disk->requests = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    AbortOnCondition(disk->requests == -1, "eventfd");
+    disk->state = DISK_OK;
 
-    AbortOnCondition(pthread_create(&disk_thread, NULL, (void*)disk_poll, (void*)disk),
-      "pthread");
+    /* every pending request can complete without blocking the task */
+    disk->ring = interrupt_ring_new(MAX_PENDING_DISK_REQUESTS, disk_ring_handler);
+    AbortOnCondition(disk->ring == NULL, "interrupt_ring_new");
+
+    AbortOnCondition(devpoll_add(devpoll_system(), disk->requests, disk_requested, disk),
+      "devpoll_add");
 
     pthread_sigmask(SIG_SETMASK,&old_set,NULL);
 }
@@ -434,6 +507,8 @@ void install_disk_handler(interrupt_handler_t disk_handler){
     kprintf("Starting disk interrupt.\n");
     mini_disk_handler = disk_handler;
 
+    sgenrand_r(&disk_random, sim_seed(SIM_STREAM_DISK, 4357));
+
     /* create mutex used to protect disk datastructures */
     AbortOnCondition(pthread_mutex_init(&disk_mutex, NULL),"mutex");
 }
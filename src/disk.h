@@ -79,7 +79,9 @@ typedef struct {
   FILE* file;
   disk_queue_elem_t* queue;
   disk_queue_elem_t* last;
-  sem_t semaphore; /* the semaphore should be signaled when something is added to the queue */
+  int requests; /* eventfd, written to when something is added to the queue */
+  int state; /* whether the controller has crashed */
+  struct interrupt_ring* ring; /* completed requests for the virtual processor */
 } disk_t;
 
 /* structure used to pass arguments through interrupts */
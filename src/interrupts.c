@@ -7,13 +7,13 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <ucontext.h>
-#include <semaphore.h>
 #include "defs.h"
 #include "interrupts.h"
 #include "interrupts_private.h"
 #include "minithread.h"
 #include "assert.h"
 #include "machineprimitives.h"
+#include "profiler.h"
 
 #define MAXEVENTS 64
 #define DISK_INTERRUPT_TYPE 4
@@ -42,7 +42,6 @@ struct interrupt_t {
   void *arg;
 };
 
-static pthread_mutex_t signal_mutex;
 
 #define R8 0
 #define R9 1
@@ -70,16 +69,162 @@ interrupt_handler_t mini_network_handler;
 interrupt_handler_t mini_read_handler;
 interrupt_handler_t mini_disk_handler;
 
-static volatile int signal_handled = 0;
+/*
+ * Pending-interrupt latch. A device interrupt that arrives while the
+ * virtual processor cannot take it is recorded here instead of being
+ * refused, and runs when interrupts are next enabled: when
+ * set_interrupt_level(ENABLED) restores the level, or at the next clock
+ * tick that is taken. Each ring has at most one doorbell outstanding, so
+ * the latch cannot fill up with the devices we have.
+ *
+ * The signal handler only adds entries and code on the virtual
+ * processor only removes them; both run on the main thread.
+ */
+#define LATCH_SIZE 64
+
+typedef struct latched_interrupt {
+  interrupt_t *interrupt;
+  long raised; // sched_clock() when the signal was refused
+} latched_interrupt_t;
 
-sem_t interrupt_received_sema;
+static latched_interrupt_t latch[LATCH_SIZE];
+static volatile unsigned long latch_head; // Next interrupt to deliver
+static volatile unsigned long latch_tail; // Next free entry
+static interrupt_latch_stats_t latch_stats;
+
+/*
+ * Software interrupts: doorbells the virtual processor rings itself, see
+ * interrupt_ring_post_soft. Only the virtual processor touches them, with
+ * interrupts disabled, and they are delivered after the latched ones. As
+ * with the latch, each ring has at most one outstanding.
+ */
+#define SOFT_SIZE 16
+
+static interrupt_t *soft[SOFT_SIZE];
+static unsigned long soft_head;
+static unsigned long soft_tail;
+
+/*
+ * Single-producer, single-consumer event ring between a device pthread
+ * and the virtual processor, one queue per priority class. The producer
+ * only advances tails and the consumer only advances heads. The doorbell
+ * is set while a drain is pending or running, so one signal covers every
+ * event posted until the drain finds the ring empty.
+ */
+typedef struct ring_class {
+  void **slots;
+  volatile unsigned long head; // Next event to drain
+  volatile unsigned long tail; // Next free slot
+  long events; // Events posted
+  long max_depth; // Most events waiting at once
+} ring_class_t;
+
+struct interrupt_ring {
+  interrupt_handler_t handler; // Device handler run for each event
+  interrupt_t interrupt; // Doorbell, runs the drain
+  unsigned long mask; // Slots - 1; the size is a power of two
+  int classes;
+  ring_class_t class[INTERRUPT_RING_MAX_CLASSES];
+  int weight; // Events in a row for a class while a later one waits
+  int burst; // Events run so far in the current row
+  int doorbell;
+  long events; // Events posted
+  long doorbells; // Signals sent
+};
+
+/*
+ * Run latched interrupts, oldest first, then software interrupts.
+ * invariant: called on the virtual processor with interrupts disabled
+ */
+static void deliver_latched() {
+    latched_interrupt_t *entry;
+    interrupt_t *interrupt;
+    long delay;
+
+    while (latch_head != latch_tail) {
+        entry = &latch[latch_head % LATCH_SIZE];
+        interrupt = entry->interrupt;
+        delay = sched_clock() - entry->raised;
+        latch_head++;
+
+        latch_stats.delivered++;
+        latch_stats.total_delay += delay;
+        if (delay > latch_stats.max_delay)
+            latch_stats.max_delay = delay;
+
+        interrupt->handler(interrupt->arg);
+        interrupt_level = DISABLED;
+    }
+
+    while (soft_head != soft_tail) {
+        interrupt = soft[soft_head % SOFT_SIZE];
+        soft_head++;
+
+        interrupt->handler(interrupt->arg);
+        interrupt_level = DISABLED;
+    }
+}
 
 /*
  * atomically sets interrupt level and returns the original
- * interrupt level
+ * interrupt level. Enabling interrupts first delivers any that were
+ * latched while they were disabled.
  */
 interrupt_level_t set_interrupt_level(interrupt_level_t newlevel) {
-    return swap(&interrupt_level, newlevel);
+    interrupt_level_t old_level = swap(&interrupt_level, newlevel);
+
+    /*
+     * Check again after enabling: an interrupt latched just before the
+     * level changed would otherwise wait for the next clock tick.
+     */
+    while (newlevel == ENABLED &&
+           (latch_head != latch_tail || soft_head != soft_tail)) {
+        interrupt_level = DISABLED;
+        deliver_latched();
+        interrupt_level = ENABLED;
+    }
+    return old_level;
+}
+
+void interrupt_latch_stats(interrupt_latch_stats_t *stats) {
+    interrupt_level_t old_level = swap(&interrupt_level, DISABLED);
+
+    *stats = latch_stats;
+    stats->depth = latch_tail - latch_head;
+    interrupt_level = old_level;
+}
+
+/*
+ * Clock interrupts enter here, so that interrupts latched while the
+ * processor was outside of minithreads code are not held past a tick.
+ */
+static void clock_entry(void *arg) {
+    interrupt_level_t old_level = swap(&interrupt_level, DISABLED);
+
+    deliver_latched();
+    interrupt_level = old_level;
+    mini_clock_handler(arg);
+}
+
+/*
+ * Latch a device interrupt the processor cannot take now.
+ * invariant: called from the signal handler
+ */
+static void latch_interrupt(interrupt_t *interrupt) {
+    int depth = latch_tail - latch_head;
+
+    if (depth == LATCH_SIZE) {
+        printf("INTERRUPT LATCH OVERFLOW\n");
+        fflush(stdout);
+        abort();
+    }
+    latch[latch_tail % LATCH_SIZE].interrupt = interrupt;
+    latch[latch_tail % LATCH_SIZE].raised = sched_clock();
+    latch_tail++;
+
+    latch_stats.latched++;
+    if (depth + 1 > latch_stats.max_depth)
+        latch_stats.max_depth = depth + 1;
 }
 
 
@@ -104,8 +249,6 @@ minithread_clock_init(int period, interrupt_handler_t clock_handler){
     stack_t ss;
     mini_clock_handler = clock_handler;
 
-    sem_init(&interrupt_received_sema,0,0);
-
     ss.ss_sp = malloc(SIGSTKSZ);
     if (ss.ss_sp == NULL){
         perror("malloc.");
@@ -128,6 +271,8 @@ minithread_clock_init(int period, interrupt_handler_t clock_handler){
     sigemptyset(&sa.sa_mask);
     sigaddset(&sa.sa_mask,SIGRTMAX-1);
     sigaddset(&sa.sa_mask,SIGRTMAX-2);
+    /* the profiler's timer must not sample in the middle of a tick's sample */
+    sigaddset(&sa.sa_mask,SIGRTMAX-3);
     if (sigaction(SIGRTMAX-1, &sa, NULL) == -1)
         errExit("sigaction");
 
@@ -157,6 +302,16 @@ void
 handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
 {
     uint64_t eip = ucontext->uc_mcontext.gregs[RIP];
+
+    /*
+     * Clock ticks double as profiler samples, whether or not the
+     * interrupt ends up being taken, unless the profiler has a timer
+     * of its own.
+     */
+    if(sig==SIGRTMAX-1 && profiler_running)
+        profiler_sample(eip, ucontext->uc_mcontext.gregs[RBP],
+                        ucontext->uc_mcontext.gregs[RSP]);
+
     /*
      * This allows us to check the interrupt level
      * and effectively block other signals.
@@ -171,6 +326,7 @@ handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
             eip < (uint64_t)end){
 
         unsigned long *newsp;
+        void *fpstate = 0;
         /*
          * push the return address
          */
@@ -182,16 +338,18 @@ handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
          */
 #define ROUND(X,Y)   (((unsigned long)X) & ~(Y-1)) /* Y must be a power of 2 */
         newsp = (unsigned long *) ROUND(newsp, 16);
-        if(ucontext->uc_mcontext.fpregs!=0){
+        /* FP-clean threads leave fpstate NULL, so the trampoline skips the restore */
+        if(ucontext->uc_mcontext.fpregs!=0 && minithread_fp_live()){
             newsp -= sizeof(struct _fpstate)/sizeof(long);
             memcpy(newsp,ucontext->uc_mcontext.fpregs,sizeof(struct _fpstate));
             ucontext->uc_mcontext.fpregs = (void *)newsp;
+            fpstate = (void *)newsp;
         }
 
         *--newsp = (unsigned long)ucontext->uc_mcontext.gregs[RSP] - sizeof(unsigned long); /*address of RIP*/
         newsp -= sizeof(struct sigcontext)/sizeof(long);
         memcpy(newsp,&ucontext->uc_mcontext,sizeof(struct sigcontext));
-        *--newsp = (unsigned long)ucontext->uc_mcontext.fpregs;
+        *--newsp = (unsigned long)fpstate;
         *--newsp = (unsigned long)minithread_trampoline; /*return address*/
 
         /*
@@ -207,7 +365,7 @@ handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
         }
         else if(sig==SIGRTMAX-1){
             ucontext->uc_mcontext.gregs[RSP]=(unsigned long)newsp;
-            ucontext->uc_mcontext.gregs[RIP]=(unsigned long)mini_clock_handler;
+            ucontext->uc_mcontext.gregs[RIP]=(unsigned long)clock_entry;
             ucontext->uc_mcontext.gregs[RDI]=(unsigned long)0;
             if(DEBUG)
                 printf("SP=%p\n",newsp);
@@ -217,46 +375,208 @@ handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext)
             fflush(stdout);
             abort();
         }
-        if(sig==SIGRTMAX-2)
-            signal_handled = 1;
     }
-
-    if(sig==SIGRTMAX-2){
+    else if(sig==SIGRTMAX-2){
         if(DEBUG)
-            printf("Signal received\n");
-        sem_post(&interrupt_received_sema);
+            printf("Signal latched\n");
+        latch_interrupt((interrupt_t*)si->si_value.sival_ptr);
     }
 }
 
-void send_interrupt(int interrupt_type, interrupt_handler_t handler, void* arg){
+/*
+ * Raise a device interrupt. The signal is never refused: if the
+ * virtual processor cannot take it now, the handler latches it.
+ */
+static void raise_interrupt(interrupt_t *interrupt){
+    /* Repeat if signal is not delivered. */
+    while(sigqueue(getpid(),SIGRTMAX-2, (union sigval)(void*)interrupt)==-1);
+}
 
-    interrupt_t interrupt;
-    pthread_mutex_lock(&signal_mutex);
-    for (;;){
-        signal_handled = 0;
-
-        interrupt.arg = arg;
-        if(interrupt_type==NETWORK_INTERRUPT_TYPE)
-            interrupt.handler = mini_network_handler;
-        else if(interrupt_type==READ_INTERRUPT_TYPE)
-            interrupt.handler = mini_read_handler;
-        else if(interrupt_type==DISK_INTERRUPT_TYPE)
-            interrupt.handler = mini_disk_handler;
+/*
+ * Runs on the virtual processor as the interrupt handler of a doorbell,
+ * with interrupts disabled. Device handlers may enable interrupts and
+ * even switch threads, but no other drain of this ring can start until
+ * the doorbell is cleared, so the ring keeps a single consumer.
+ */
+static int interrupt_ring_empty(interrupt_ring_t ring){
+    int c;
+
+    for (c = 0; c < ring->classes; c++)
+        if (ring->class[c].head != ring->class[c].tail)
+            return 0;
+    return 1;
+}
+
+/*
+ * Takes the next event to run, by class and weight. Returns -1 if the
+ * ring is empty.
+ */
+static int interrupt_ring_take(interrupt_ring_t ring, void **event){
+    ring_class_t *rc;
+    int first = -1;
+    int later = -1;
+    int c;
+
+    for (c = 0; c < ring->classes && later == -1; c++){
+        if (ring->class[c].head == ring->class[c].tail)
+            continue;
+        if (first == -1)
+            first = c;
         else
-            abort();
+            later = c;
+    }
+    if (first == -1)
+        return -1;
+
+    if (later == -1){
+        ring->burst = 0;
+    } else if (ring->weight > 0 && ring->burst >= ring->weight){
+        first = later;
+        ring->burst = 0;
+    } else {
+        ring->burst++;
+    }
+
+    rc = &ring->class[first];
+    *event = rc->slots[rc->head & ring->mask];
+    rc->head++;
+    return 0;
+}
 
-        /* Repeat if signal is not delivered. */
-        while(sigqueue(getpid(),SIGRTMAX-2, (union sigval)(void*)&interrupt)==-1);
+static void interrupt_ring_drain(void *arg){
+    interrupt_ring_t ring = (interrupt_ring_t) arg;
+    void *event;
 
-        /* semaphore_P to wait for main thread signal */
-        sem_wait(&interrupt_received_sema);
+    for (;;){
+        while (interrupt_ring_take(ring, &event) == 0){
+            set_interrupt_level(DISABLED);
+            ring->handler(event);
+        }
+        set_interrupt_level(DISABLED);
 
-        /* Check if interrupt was handled */
-        if(signal_handled)
+        /*
+         * Clear the doorbell, then look again: an event posted after the
+         * last check saw the doorbell still set and sent no signal.
+         */
+        ring->doorbell = 0;
+        __sync_synchronize();
+        if (interrupt_ring_empty(ring) || swap(&ring->doorbell, 1) == 1)
             break;
+    }
+}
+
+interrupt_ring_t interrupt_ring_new_classes(int size, int classes, interrupt_handler_t handler){
+    interrupt_ring_t ring;
+    unsigned long slots = 1;
+    int c;
+
+    if (classes < 1 || classes > INTERRUPT_RING_MAX_CLASSES)
+        return NULL;
+    while (slots < size)
+        slots <<= 1;
+
+    ring = (interrupt_ring_t) malloc(sizeof(struct interrupt_ring));
+    if (ring == NULL)
+        return NULL;
+    for (c = 0; c < classes; c++){
+        ring->class[c].slots = (void **) malloc(slots * sizeof(void *));
+        if (ring->class[c].slots == NULL){
+            while (c-- > 0)
+                free(ring->class[c].slots);
+            free(ring);
+            return NULL;
+        }
+        ring->class[c].head = ring->class[c].tail = 0;
+        ring->class[c].events = ring->class[c].max_depth = 0;
+    }
+    ring->handler = handler;
+    ring->interrupt.handler = interrupt_ring_drain;
+    ring->interrupt.arg = ring;
+    ring->mask = slots - 1;
+    ring->classes = classes;
+    ring->weight = 0;
+    ring->burst = 0;
+    ring->doorbell = 0;
+    ring->events = ring->doorbells = 0;
+    return ring;
+}
 
+interrupt_ring_t interrupt_ring_new(int size, interrupt_handler_t handler){
+    return interrupt_ring_new_classes(size, 1, handler);
+}
+
+void interrupt_ring_set_weight(interrupt_ring_t ring, int weight){
+    ring->weight = weight > 0 ? weight : 0;
+}
+
+/*
+ * Puts an event in a class that has room, on the producer.
+ */
+static void interrupt_ring_put(ring_class_t *rc, unsigned long mask, void *event){
+    unsigned long depth;
+
+    rc->slots[rc->tail & mask] = event;
+    __sync_synchronize();
+    rc->tail++;
+    rc->events++;
+    depth = rc->tail - rc->head;
+    if (depth > rc->max_depth)
+        rc->max_depth = depth;
+}
+
+void interrupt_ring_post_class(interrupt_ring_t ring, int class, void *event){
+    ring_class_t *rc = &ring->class[class];
+
+    /* Wait for the virtual processor to make room */
+    while (rc->tail - rc->head > ring->mask)
         sleep(0);
-        /* resend if necessary */
+
+    interrupt_ring_put(rc, ring->mask, event);
+    ring->events++;
+
+    if (swap(&ring->doorbell, 1) == 0){
+        ring->doorbells++;
+        raise_interrupt(&ring->interrupt);
+    }
+}
+
+void interrupt_ring_post(interrupt_ring_t ring, void *event){
+    interrupt_ring_post_class(ring, 0, event);
+}
+
+int interrupt_ring_post_soft(interrupt_ring_t ring, int class, void *event){
+    ring_class_t *rc = &ring->class[class];
+
+    if (rc->tail - rc->head > ring->mask)
+        return -1;
+
+    interrupt_ring_put(rc, ring->mask, event);
+    ring->events++;
+
+    if (swap(&ring->doorbell, 1) == 0){
+        AbortOnCondition(soft_tail - soft_head >= SOFT_SIZE,
+                         "Too many software interrupts");
+        ring->doorbells++;
+        soft[soft_tail % SOFT_SIZE] = &ring->interrupt;
+        soft_tail++;
     }
-    pthread_mutex_unlock(&signal_mutex);
+    return 0;
+}
+
+void interrupt_ring_stats(interrupt_ring_t ring, long *events, long *doorbells){
+    if (events)
+        *events = ring->events;
+    if (doorbells)
+        *doorbells = ring->doorbells;
+}
+
+void interrupt_ring_class_stats(interrupt_ring_t ring, int class, long *events, long *depth, long *max_depth){
+    ring_class_t *rc = &ring->class[class];
+
+    if (events)
+        *events = rc->events;
+    if (depth)
+        *depth = rc->tail - rc->head;
+    if (max_depth)
+        *max_depth = rc->max_depth;
 }
@@ -11,10 +11,10 @@
  *
  * Interrupts are disabled when running code that is not part of the
  * minithreads package (e.g. printf or gettimeofday), or if they are explicitly
- * disabled (see set_interrupt_level below).  Any interrupts that occur while
- * interrupts are disabled will be dropped.  Thus if you want to reliably
- * receive interrupts, you must avoid spending a large portion of time with
- * interrupts disabled.
+ * disabled (see set_interrupt_level below).  Clock ticks that occur while
+ * interrupts are disabled will be dropped; device interrupts are latched and
+ * delivered late.  Thus if you want to receive interrupts promptly, you must
+ * avoid spending a large portion of time with interrupts disabled.
  *
  * YOU SHOULD NOT [NEED TO] MODIFY THIS FILE.
  */
@@ -51,9 +51,9 @@
  * to minithread_switch: the minithread switch code resets the interrupt
  * level to ENABLED itself.
  *
- * Interrupts that occur while interrupts are disabled are dropped, so you
- * should minimize the amount of time interrupts are disabled in order to
- * reduce the number of dropped interrupts.
+ * Clock ticks that occur while interrupts are disabled are dropped, and
+ * device interrupts wait, so you should minimize the amount of time
+ * interrupts are disabled.
  */
 
 typedef int interrupt_level_t;
@@ -64,6 +64,27 @@ extern interrupt_level_t interrupt_level;
 
 extern interrupt_level_t set_interrupt_level(interrupt_level_t newlevel);
 
+/*
+ * Device interrupts that arrive while interrupts are disabled, or while
+ * the processor is outside of minithreads code, are latched rather than
+ * dropped. They run, oldest first, as soon as set_interrupt_level
+ * enables interrupts again, or at the next clock tick that is taken.
+ * Clock ticks themselves are not latched.
+ *
+ * interrupt_latch_stats reports how often that happened and how long the
+ * interrupts waited, in nanoseconds.
+ */
+typedef struct interrupt_latch_stats {
+    long latched; // Interrupts that had to wait
+    long delivered; // Latched interrupts delivered so far
+    int depth; // Interrupts waiting now
+    int max_depth;
+    long total_delay; // Total wait of delivered interrupts
+    long max_delay;
+} interrupt_latch_stats_t;
+
+extern void interrupt_latch_stats(interrupt_latch_stats_t *stats);
+
 
 /*
  * minithread_clock_init(h,period)
@@ -40,7 +40,55 @@ mini_read_handler;
 extern interrupt_handler_t
 mini_disk_handler;
 
-void send_interrupt(int interrupt_type, interrupt_handler_t handler, void* arg);
+/*
+ * Event rings batch device interrupts. Each device pthread posts its
+ * events to its own ring, and only the event that makes the ring
+ * non-empty signals the virtual processor. That one interrupt then runs
+ * the ring's handler on every event posted before the ring is empty
+ * again, with interrupts disabled for each call.
+ *
+ * A ring has exactly one producer thread. interrupt_ring_post waits
+ * while the ring is full.
+ *
+ * A ring may keep events in up to INTERRUPT_RING_MAX_CLASSES priority
+ * classes, each of size slots, class 0 first. Events of a class run in
+ * the order posted, and a class runs ahead of those after it, except
+ * that with a weight of n > 0 a class that has had n events in a row
+ * while a later one waited lets that one have an event. A weight of 0
+ * is strict priority.
+ */
+#define INTERRUPT_RING_MAX_CLASSES 4
+
+typedef struct interrupt_ring *interrupt_ring_t;
+
+extern interrupt_ring_t interrupt_ring_new(int size, interrupt_handler_t handler);
+extern interrupt_ring_t interrupt_ring_new_classes(int size, int classes, interrupt_handler_t handler);
+
+extern void interrupt_ring_set_weight(interrupt_ring_t ring, int weight);
+
+extern void interrupt_ring_post(interrupt_ring_t ring, void *event);
+extern void interrupt_ring_post_class(interrupt_ring_t ring, int class, void *event);
+
+/*
+ * Post an event from the virtual processor itself, with interrupts
+ * disabled. No signal is involved: the doorbell is queued as a software
+ * interrupt and the ring drains as soon as interrupts are enabled again,
+ * or at the next clock tick. Returns -1 if the ring is full, since the
+ * virtual processor cannot wait for itself. A ring is posted to either
+ * this way or by a device thread, never both.
+ */
+extern int interrupt_ring_post_soft(interrupt_ring_t ring, int class, void *event);
+
+/*
+ * Events posted to the ring and doorbell signals sent for them.
+ */
+extern void interrupt_ring_stats(interrupt_ring_t ring, long *events, long *doorbells);
+
+/*
+ * Events posted to a class of the ring, those waiting in it now, and the
+ * most that have waited at once.
+ */
+extern void interrupt_ring_class_stats(interrupt_ring_t ring, int class, long *events, long *depth, long *max_depth);
 
 #endif /* __INTERRUPTS_PRIVATE_H__ */
 
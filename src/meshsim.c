@@ -0,0 +1,914 @@
+/* meshsim
+
+    Mesh routing simulator. Hosts thousands of virtual nodes in one
+    process, connected by in-memory links, and runs the miniroute protocol
+    between them in virtual time: discoveries flooded with each hop
+    appended to the path, replies sent back along the reversed path, route
+    caches, and source-routed data, with the header layout, timeouts,
+    retries and limits of miniroute. Reports what route discovery costs,
+    the paths it finds and how long delivery takes.
+
+    USAGE: ./meshsim <topology> <nodes> [<queries> [<degree> [<seed>
+                     [<suppress>]]]]
+
+    topology = grid, geometric, scalefree, or a file in the format of
+               topology.txt (host names, a blank line, then the link
+               matrix) listing any number of hosts, in which case <nodes>
+               is ignored.
+    nodes    = number of nodes to generate.
+    queries  = packets sent between random pairs of nodes, one every
+               QUERY_INTERVAL ms of virtual time (default 1000).
+    degree   = average number of links per node of a geometric or
+               scalefree mesh (default 6). A grid links each node to the
+               four next to it.
+    seed     = seed for the topology, the pairs and link jitter
+               (default 1).
+    suppress = 1 to have each node rebroadcast a discovery once rather
+               than once per path reaching it, to see what duplicate
+               suppression would save (default 0).
+
+    A query is sent the way miniroute_send_pkt sends a packet: on a fresh
+    cached route, or after joining or starting a discovery of the
+    destination. miniroute rebroadcasts a discovery along every loop-free
+    path of up to MAX_ROUTE_LENGTH hops, and nodes go on rebroadcasting
+    after the source has its route, so a flood grows exponentially with
+    the number of links in range; it is cut off after FLOOD_BUDGET
+    transmissions and counted as truncated.
+*/
+
+#define _GNU_SOURCE /* getline */
+#include "defs.h"
+#include "miniroute.h"
+#include "cache.h"
+#include "random.h"
+#include "slab.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define MAX_NODES 100000
+#define LINK_DELAY 1000 // One-way link latency in microseconds
+#define LINK_JITTER 500 // Up to this much is added per hop, in microseconds
+#define QUERY_INTERVAL 20 // Milliseconds of virtual time between queries
+#define DATA_SIZE 64 // Bytes a query sends behind the routing header
+#define FLOOD_BUDGET 200000 // Transmissions before a discovery is cut off
+
+#define MS 1000L // Microseconds per millisecond
+
+typedef struct query {
+    int src;
+    int dst;
+    long issued;
+    struct query *next;
+} query_t;
+
+typedef struct route {
+    long timestamp;
+    int path_len;
+    int path[MAX_ROUTE_LENGTH];
+} route_t;
+
+typedef struct discovery {
+    int src;
+    int dst;
+    unsigned int id;
+    int attempt; // Broadcasts so far
+    int done;
+    int in_flight; // Discovery and reply packets not yet received
+    int timers; // Timeouts not yet run
+    long started;
+    long transmissions;
+    int truncated;
+    query_t *queries; // Waiting for the route
+    unsigned char *visited; // Nodes that rebroadcast this attempt
+} discovery_t;
+
+typedef struct packet {
+    int type; // enum routing_packet_type
+    int ttl;
+    int path_len;
+    int path[MAX_ROUTE_LENGTH + 1];
+    discovery_t *disc; // Discovery and reply packets
+    query_t *query; // Data packets
+    long sent;
+} packet_t;
+
+typedef struct node {
+    int *links;
+    int n_links;
+    int max_links;
+    double x;
+    double y;
+    cache_t routes; // Destination to route_t, as in miniroute
+    cache_t waiting; // Destination to discovery_t in progress
+    int n_waiting;
+    query_t *deferred; // Waiting for a discovery slot
+    query_t *deferred_tail;
+    unsigned int next_id;
+} node_t;
+
+typedef enum { EVENT_PACKET = 0, EVENT_QUERY, EVENT_TIMEOUT } event_kind_t;
+
+typedef struct event {
+    long time;
+    long seq; // Events due at the same time run in the order scheduled
+    event_kind_t kind;
+    int node;
+    int attempt;
+    void *arg;
+} event_t;
+
+typedef struct samples {
+    long *v;
+    int n;
+    int max;
+} samples_t;
+
+static char *type_names[] = { "data", "discovery", "reply" };
+
+static struct slab_cache packet_cache =
+    SLAB_CACHE_INITIALIZER("meshsim packet", sizeof(packet_t), NULL);
+
+static node_t *nodes;
+static int n_nodes;
+static long n_links;
+
+static event_t *heap;
+static int heap_len;
+static int heap_max;
+static long next_seq;
+static long now;
+static long n_events;
+
+static random_state_t rng;
+static int suppress;
+static int *dist; // Hops from a source, for BFS
+static int *bfs_queue;
+
+static struct {
+    long queries;
+    long delivered;
+    long cache_hits;
+    long joined;
+    long deferred;
+    long failed;
+    long unreachable;
+    long discoveries;
+    long retries;
+    long truncated;
+    long late_replies;
+    long path_limit; // Dropped by send_data for being too long
+    long overflow; // Discoveries too long for a reply header
+    long packets[3];
+    long bytes[3];
+    samples_t disc_tx; // Transmissions per discovery
+    samples_t disc_latency;
+    samples_t found_hops;
+    samples_t shortest_hops;
+    samples_t delivery;
+    samples_t end_to_end;
+} stats;
+
+static void sample(samples_t *s, long v) {
+    if (s->n == s->max) {
+        s->max = s->max ? 2 * s->max : 1024;
+        s->v = (long *) realloc(s->v, sizeof(long) * s->max);
+        AbortOnCondition(s->v == NULL, "realloc");
+    }
+    s->v[s->n++] = v;
+}
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static long percentile(samples_t *s, int p) {
+    if (s->n == 0) return 0;
+    return s->v[(s->n - 1) * p / 100];
+}
+
+static double average(samples_t *s) {
+    double total = 0;
+    int i;
+    for (i = 0; i < s->n; i++) {
+        total += s->v[i];
+    }
+    return s->n ? total / s->n : 0;
+}
+
+/*
+ * Nodes are keyed in the caches by an address made from their index
+ */
+static void node_address(int n, network_address_t addr) {
+    addr[0] = n;
+    addr[1] = 0;
+}
+
+/* ---- topology ---- */
+
+static void add_link(int a, int b) {
+    node_t *n = &nodes[a];
+    int i;
+
+    for (i = 0; i < n->n_links; i++) {
+        if (n->links[i] == b) return;
+    }
+    if (n->n_links == n->max_links) {
+        n->max_links = n->max_links ? 2 * n->max_links : 4;
+        n->links = (int *) realloc(n->links, sizeof(int) * n->max_links);
+        AbortOnCondition(n->links == NULL, "realloc");
+    }
+    n->links[n->n_links++] = b;
+    n_links++;
+}
+
+static void link_nodes(int a, int b) {
+    add_link(a, b);
+    add_link(b, a);
+}
+
+static void make_nodes(int n) {
+    int i;
+
+    AbortOnCondition(n < 2 || n > MAX_NODES, "Error: bad number of nodes.");
+    n_nodes = n;
+    nodes = (node_t *) calloc(n, sizeof(node_t));
+    dist = (int *) malloc(sizeof(int) * n);
+    bfs_queue = (int *) malloc(sizeof(int) * n);
+    AbortOnCondition(!nodes || !dist || !bfs_queue, "malloc");
+    for (i = 0; i < n; i++) {
+        nodes[i].routes = cache_new(SIZE_OF_ROUTE_CACHE);
+        nodes[i].waiting = cache_new(SIZE_OF_ROUTE_CACHE);
+        AbortOnCondition(!nodes[i].routes || !nodes[i].waiting, "cache_new");
+    }
+}
+
+/*
+ * Nodes in rows of the square root of n, each linked to the ones beside,
+ * above and below it
+ */
+static void make_grid(int n) {
+    int width = (int) ceil(sqrt(n));
+    int i;
+
+    make_nodes(n);
+    for (i = 0; i < n; i++) {
+        if ((i + 1) % width != 0 && i + 1 < n) link_nodes(i, i + 1);
+        if (i + width < n) link_nodes(i, i + width);
+    }
+}
+
+/*
+ * Nodes placed at random in the unit square, linked to every node within
+ * the radius that gives the average degree
+ */
+static void make_geometric(int n, int degree) {
+    double radius = sqrt(degree / (M_PI * n));
+    double dx, dy;
+    int i, j;
+
+    make_nodes(n);
+    for (i = 0; i < n; i++) {
+        nodes[i].x = genrand_r(&rng);
+        nodes[i].y = genrand_r(&rng);
+    }
+    for (i = 0; i < n; i++) {
+        for (j = i + 1; j < n; j++) {
+            dx = nodes[i].x - nodes[j].x;
+            dy = nodes[i].y - nodes[j].y;
+            if (dx * dx + dy * dy <= radius * radius) link_nodes(i, j);
+        }
+    }
+}
+
+/*
+ * Barabasi-Albert preferential attachment: each node joins with degree / 2
+ * links to nodes chosen in proportion to their degree
+ */
+static void make_scalefree(int n, int degree) {
+    int m = degree / 2 > 0 ? degree / 2 : 1;
+    int *ends; // Both ends of every link so far
+    int n_ends = 0;
+    int *targets;
+    int i, j, k, t;
+
+    if (m >= n) m = n - 1;
+    make_nodes(n);
+    ends = (int *) malloc(sizeof(int) * 2 * ((long) n * m + m * m));
+    targets = (int *) malloc(sizeof(int) * m);
+    AbortOnCondition(!ends || !targets, "malloc");
+
+    // Start from a clique of m + 1 nodes
+    for (i = 0; i <= m; i++) {
+        for (j = 0; j < i; j++) {
+            link_nodes(i, j);
+            ends[n_ends++] = i;
+            ends[n_ends++] = j;
+        }
+    }
+    for (i = m + 1; i < n; i++) {
+        for (j = 0; j < m; j++) {
+            do {
+                t = ends[genintrand_r(&rng, n_ends) - 1];
+                for (k = 0; k < j && targets[k] != t; k++)
+                    ;
+            } while (k < j);
+            targets[j] = t;
+        }
+        for (j = 0; j < m; j++) {
+            link_nodes(i, targets[j]);
+            ends[n_ends++] = i;
+            ends[n_ends++] = targets[j];
+        }
+    }
+    free(ends);
+    free(targets);
+}
+
+/*
+ * Reads the host names, then the link matrix, as topology_load does for a text file
+ */
+static void read_topology(char *file) {
+    FILE *f = fopen(file, "r");
+    char *line = NULL;
+    size_t size = 0;
+    long start;
+    int n = 0;
+    int i, j;
+
+    AbortOnCondition(f == NULL, "Error: cannot open topology file.");
+    // Rows are as long as there are nodes, so lines are read whole
+    while (getline(&line, &size, f) != -1 &&
+           line[0] != '\r' && line[0] != '\n') {
+        n++;
+    }
+    start = ftell(f);
+    make_nodes(n);
+    fseek(f, start, SEEK_SET);
+    for (i = 0; i < n; i++) {
+        if (getline(&line, &size, f) == -1) break;
+        for (j = 0; j < n && line[j] != '\0' && line[j] != '\n'; j++) {
+            if (i != j && line[j] != '.') add_link(i, j);
+        }
+    }
+    fclose(f);
+    free(line);
+}
+
+/*
+ * Hops from src to every node over the broadcast links, -1 if unreachable
+ */
+static void bfs(int src) {
+    int head = 0, tail = 0;
+    int i, n;
+
+    for (i = 0; i < n_nodes; i++) {
+        dist[i] = -1;
+    }
+    dist[src] = 0;
+    bfs_queue[tail++] = src;
+    while (head < tail) {
+        n = bfs_queue[head++];
+        for (i = 0; i < nodes[n].n_links; i++) {
+            if (dist[nodes[n].links[i]] == -1) {
+                dist[nodes[n].links[i]] = dist[n] + 1;
+                bfs_queue[tail++] = nodes[n].links[i];
+            }
+        }
+    }
+}
+
+/* ---- events ---- */
+
+static int event_before(event_t *a, event_t *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void schedule(long delay, event_kind_t kind, int node, int attempt,
+                     void *arg) {
+    event_t e;
+    int i = heap_len;
+
+    if (heap_len == heap_max) {
+        heap_max = heap_max ? 2 * heap_max : 4096;
+        heap = (event_t *) realloc(heap, sizeof(event_t) * heap_max);
+        AbortOnCondition(heap == NULL, "realloc");
+    }
+    e.time = now + delay;
+    e.seq = next_seq++;
+    e.kind = kind;
+    e.node = node;
+    e.attempt = attempt;
+    e.arg = arg;
+
+    heap_len++;
+    while (i > 0 && event_before(&e, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = e;
+}
+
+static event_t next_event() {
+    event_t top = heap[0];
+    event_t last = heap[--heap_len];
+    int i = 0;
+    int child;
+
+    while ((child = 2 * i + 1) < heap_len) {
+        if (child + 1 < heap_len && event_before(&heap[child + 1], &heap[child]))
+            child++;
+        if (!event_before(&heap[child], &last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* ---- the protocol, as in miniroute.c ---- */
+
+static packet_t *new_packet(int type) {
+    packet_t *p = (packet_t *) slab_alloc(&packet_cache);
+    AbortOnCondition(p == NULL, "slab_alloc");
+    p->type = type;
+    p->ttl = MAX_ROUTE_LENGTH;
+    p->path_len = 0;
+    p->disc = NULL;
+    p->query = NULL;
+    p->sent = now;
+    return p;
+}
+
+/*
+ * Sends p from one node to another. A node sending to itself, as the
+ * source of data does first, reaches itself without crossing a link.
+ */
+static void transmit(int from, int to, packet_t *p) {
+    long delay = 0;
+
+    if (from != to) {
+        delay = LINK_DELAY + (long) (genrand_r(&rng) * LINK_JITTER);
+        stats.packets[p->type]++;
+        stats.bytes[p->type] += sizeof(struct routing_header) +
+                                (p->type == ROUTING_DATA ? DATA_SIZE : 0);
+        if (p->disc != NULL) p->disc->transmissions++;
+    }
+    if (p->disc != NULL) p->disc->in_flight++;
+    schedule(delay, EVENT_PACKET, to, 0, p);
+}
+
+/*
+ * send_data: on to the next node of the path, given by the hops left
+ */
+static void send_along(int at, packet_t *p) {
+    int i = MAX_ROUTE_LENGTH - p->ttl;
+
+    if (i >= MAX_ROUTE_LENGTH - 1 || i >= p->path_len) {
+        stats.path_limit++;
+        slab_free(&packet_cache, p);
+        return;
+    }
+    transmit(at, p->path[i], p);
+}
+
+/*
+ * bcast_discovery: appends the node to the path and sends a copy over
+ * each of its links
+ */
+static void bcast(int at, packet_t *p) {
+    discovery_t *d = p->disc;
+    packet_t *copy;
+    int i;
+
+    if (p->ttl == 0) {
+        slab_free(&packet_cache, p);
+        return;
+    }
+    if (d->transmissions + nodes[at].n_links > FLOOD_BUDGET) {
+        d->truncated = 1;
+        slab_free(&packet_cache, p);
+        return;
+    }
+    p->path[p->path_len++] = at;
+    for (i = 0; i < nodes[at].n_links; i++) {
+        copy = (packet_t *) slab_alloc(&packet_cache);
+        AbortOnCondition(copy == NULL, "slab_alloc");
+        memcpy(copy, p, sizeof(packet_t));
+        transmit(at, nodes[at].links[i], copy);
+    }
+    slab_free(&packet_cache, p);
+}
+
+static int on_path(packet_t *p, int n) {
+    int i;
+    for (i = 0; i < p->path_len; i++) {
+        if (p->path[i] == n) return 1;
+    }
+    return 0;
+}
+
+static void reverse_path(int *from, int *to, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        to[i] = from[len - 1 - i];
+    }
+}
+
+static route_t *cached_route(int at, int dst) {
+    network_address_t addr;
+    void *node;
+    route_t *route;
+
+    node_address(dst, addr);
+    if (cache_get(nodes[at].routes, addr, &node) == -1) return NULL;
+    route = (route_t *) node;
+    if (now - route->timestamp >= CACHE_FRESH * MS) return NULL;
+    return route;
+}
+
+/*
+ * set_cached_route: the route back to the other end of a path that
+ * reached this node
+ */
+static void cache_route(int at, packet_t *p) {
+    network_address_t addr;
+    void *node;
+    void *overflow;
+    route_t *route;
+
+    node_address(p->path[0], addr);
+    if (cache_get(nodes[at].routes, addr, &node) == 0) {
+        route = (route_t *) node;
+        cache_delete(nodes[at].routes, addr);
+    } else {
+        route = (route_t *) malloc(sizeof(route_t));
+        AbortOnCondition(route == NULL, "malloc");
+    }
+    route->path_len = p->path_len;
+    reverse_path(p->path, route->path, p->path_len);
+    route->timestamp = now;
+    cache_set(nodes[at].routes, addr, route, &overflow);
+    free(overflow);
+}
+
+static void send_query_data(query_t *q, route_t *route) {
+    packet_t *p = new_packet(ROUTING_DATA);
+
+    p->path_len = route->path_len;
+    memcpy(p->path, route->path, sizeof(int) * route->path_len);
+    p->query = q;
+    send_along(q->src, p);
+}
+
+static void flood(discovery_t *d) {
+    packet_t *p = new_packet(ROUTING_ROUTE_DISCOVERY);
+
+    if (d->attempt > 0) stats.retries++;
+    d->attempt++;
+    if (d->visited) memset(d->visited, 0, n_nodes);
+    p->disc = d;
+    bcast(d->src, p);
+    d->timers++;
+    schedule(WAIT_DELAY * MS, EVENT_TIMEOUT, d->src, d->attempt, d);
+}
+
+/*
+ * A discovery is freed once it is over and the last of its flood has
+ * died out, when all it cost is known
+ */
+static void release(discovery_t *d) {
+    if (!d->done || d->in_flight > 0 || d->timers > 0) return;
+    sample(&stats.disc_tx, d->transmissions);
+    if (d->truncated) stats.truncated++;
+    free(d->visited);
+    free(d);
+}
+
+static void start_query(query_t *q);
+
+/*
+ * The discovery is over, with a route or not: release the queries
+ * waiting on it, then those waiting for a discovery slot
+ */
+static void finish(discovery_t *d, route_t *route) {
+    network_address_t addr;
+    node_t *n = &nodes[d->src];
+    query_t *q;
+
+    d->done = 1;
+    node_address(d->dst, addr);
+    cache_delete(n->waiting, addr);
+    n->n_waiting--;
+
+    bfs(d->src);
+    if (route != NULL) {
+        sample(&stats.disc_latency, now - d->started);
+        sample(&stats.found_hops, route->path_len - 1);
+        sample(&stats.shortest_hops, dist[d->dst]);
+    } else if (dist[d->dst] == -1 || dist[d->dst] > MAX_ROUTE_LENGTH - 2) {
+        stats.unreachable++;
+    }
+
+    while ((q = d->queries) != NULL) {
+        d->queries = q->next;
+        if (route != NULL) {
+            send_query_data(q, route);
+        } else {
+            stats.failed++;
+            free(q);
+        }
+    }
+    while (n->deferred != NULL && n->n_waiting < SIZE_OF_ROUTE_CACHE) {
+        q = n->deferred;
+        n->deferred = q->next;
+        start_query(q);
+    }
+}
+
+/*
+ * miniroute_send_pkt: on a fresh cached route, or by joining or starting
+ * a discovery of the destination
+ */
+static void start_query(query_t *q) {
+    network_address_t addr;
+    node_t *n = &nodes[q->src];
+    route_t *route;
+    discovery_t *d;
+    void *node;
+    void *overflow;
+
+    q->next = NULL;
+    route = cached_route(q->src, q->dst);
+    if (route != NULL) {
+        stats.cache_hits++;
+        send_query_data(q, route);
+        return;
+    }
+
+    node_address(q->dst, addr);
+    if (cache_get(n->waiting, addr, &node) == 0) {
+        d = (discovery_t *) node;
+        stats.joined++;
+        q->next = d->queries;
+        d->queries = q;
+        return;
+    }
+
+    if (n->n_waiting == SIZE_OF_ROUTE_CACHE) { // wait_limit
+        stats.deferred++;
+        if (n->deferred == NULL) n->deferred = q;
+        else n->deferred_tail->next = q;
+        n->deferred_tail = q;
+        return;
+    }
+
+    d = (discovery_t *) calloc(1, sizeof(discovery_t));
+    AbortOnCondition(d == NULL, "calloc");
+    d->src = q->src;
+    d->dst = q->dst;
+    d->id = n->next_id++;
+    d->started = now;
+    d->queries = q;
+    if (suppress) {
+        d->visited = (unsigned char *) malloc(n_nodes);
+        AbortOnCondition(d->visited == NULL, "malloc");
+    }
+    cache_set(n->waiting, addr, d, &overflow); // wait_limit keeps it in
+    n->n_waiting++;
+    stats.discoveries++;
+    flood(d);
+}
+
+static void timeout(discovery_t *d, int attempt) {
+    d->timers--;
+    if (!d->done && attempt == d->attempt) {
+        if (d->attempt < NUM_RETRY) {
+            flood(d);
+        } else {
+            finish(d, NULL);
+        }
+    }
+    release(d);
+}
+
+/*
+ * miniroute_handle
+ */
+static void receive(int at, packet_t *p) {
+    discovery_t *d = p->disc;
+    network_address_t addr;
+    route_t route;
+    void *node;
+
+    if (d != NULL) d->in_flight--;
+
+    switch (p->type) {
+    case ROUTING_ROUTE_DISCOVERY:
+        if (at == d->dst) {
+            // create_reply_hdr, then on to the next hop back
+            if (p->path_len >= MAX_ROUTE_LENGTH) {
+                stats.overflow++;
+                slab_free(&packet_cache, p);
+                break;
+            }
+            p->path[p->path_len++] = at;
+            reverse_path(p->path, route.path, p->path_len);
+            memcpy(p->path, route.path, sizeof(int) * p->path_len);
+            p->type = ROUTING_ROUTE_REPLY;
+            p->ttl = MAX_ROUTE_LENGTH - 1;
+            send_along(at, p);
+        } else {
+            p->ttl--;
+            if (on_path(p, at) || (d->visited && d->visited[at])) {
+                slab_free(&packet_cache, p);
+                break;
+            }
+            if (d->visited) d->visited[at] = 1;
+            bcast(at, p);
+        }
+        break;
+
+    case ROUTING_ROUTE_REPLY:
+        if (at != p->path[p->path_len - 1]) {
+            p->ttl--;
+            send_along(at, p);
+            break;
+        }
+        node_address(p->path[0], addr);
+        if (cache_get(nodes[at].waiting, addr, &node) == 0 &&
+            ((discovery_t *) node)->id == d->id) {
+            route.path_len = p->path_len;
+            reverse_path(p->path, route.path, p->path_len);
+            cache_route(at, p);
+            finish(d, &route);
+        } else {
+            stats.late_replies++;
+        }
+        slab_free(&packet_cache, p);
+        break;
+
+    case ROUTING_DATA:
+        if (at != p->path[p->path_len - 1]) {
+            p->ttl--;
+            send_along(at, p);
+            break;
+        }
+        cache_route(at, p);
+        stats.delivered++;
+        sample(&stats.delivery, now - p->sent);
+        sample(&stats.end_to_end, now - p->query->issued);
+        free(p->query);
+        slab_free(&packet_cache, p);
+        break;
+    }
+
+    if (d != NULL) release(d);
+}
+
+/* ---- driver ---- */
+
+static void report(char *topology, double seconds) {
+    long degree_max = 0;
+    int i;
+
+    for (i = 0; i < n_nodes; i++) {
+        if (nodes[i].n_links > degree_max) degree_max = nodes[i].n_links;
+    }
+    printf("topology %s: %d nodes, %ld links, degree avg %.1f max %ld\n",
+           topology, n_nodes, n_links / 2, (double) n_links / n_nodes,
+           degree_max);
+    printf("queries %ld: delivered %ld, cache hits %ld, joined %ld, "
+           "deferred %ld, failed %ld\n", stats.queries, stats.delivered,
+           stats.cache_hits, stats.joined, stats.deferred, stats.failed);
+    printf("discoveries %ld: retries %ld, unreachable %ld, truncated %ld, "
+           "late replies %ld\n", stats.discoveries, stats.retries,
+           stats.unreachable, stats.truncated, stats.late_replies);
+    printf("dropped: %ld past the route length limit, %ld too long to "
+           "reply to\n\n", stats.path_limit, stats.overflow);
+
+    printf("%-10s %12s %14s\n", "packets", "sent", "bytes");
+    for (i = 0; i < 3; i++) {
+        printf("%-10s %12ld %14ld\n", type_names[i], stats.packets[i],
+               stats.bytes[i]);
+    }
+
+    qsort(stats.disc_tx.v, stats.disc_tx.n, sizeof(long), compare_longs);
+    qsort(stats.found_hops.v, stats.found_hops.n, sizeof(long), compare_longs);
+    qsort(stats.shortest_hops.v, stats.shortest_hops.n, sizeof(long),
+          compare_longs);
+    qsort(stats.disc_latency.v, stats.disc_latency.n, sizeof(long),
+          compare_longs);
+    qsort(stats.delivery.v, stats.delivery.n, sizeof(long), compare_longs);
+    qsort(stats.end_to_end.v, stats.end_to_end.n, sizeof(long), compare_longs);
+
+    printf("\n%-16s %10s %10s %10s %10s %10s\n", "", "avg", "p50", "p90",
+           "p99", "max");
+    printf("%-16s %10.0f %10ld %10ld %10ld %10ld\n", "sent/discovery",
+           average(&stats.disc_tx), percentile(&stats.disc_tx, 50),
+           percentile(&stats.disc_tx, 90), percentile(&stats.disc_tx, 99),
+           percentile(&stats.disc_tx, 100));
+    printf("%-16s %10.2f %10ld %10ld %10ld %10ld\n", "hops found",
+           average(&stats.found_hops), percentile(&stats.found_hops, 50),
+           percentile(&stats.found_hops, 90),
+           percentile(&stats.found_hops, 99),
+           percentile(&stats.found_hops, 100));
+    printf("%-16s %10.2f %10ld %10ld %10ld %10ld\n", "hops shortest",
+           average(&stats.shortest_hops), percentile(&stats.shortest_hops, 50),
+           percentile(&stats.shortest_hops, 90),
+           percentile(&stats.shortest_hops, 99),
+           percentile(&stats.shortest_hops, 100));
+    printf("%-16s %10.1f %10.1f %10.1f %10.1f %10.1f\n", "discovery (ms)",
+           average(&stats.disc_latency) / MS,
+           (double) percentile(&stats.disc_latency, 50) / MS,
+           (double) percentile(&stats.disc_latency, 90) / MS,
+           (double) percentile(&stats.disc_latency, 99) / MS,
+           (double) percentile(&stats.disc_latency, 100) / MS);
+    printf("%-16s %10.1f %10.1f %10.1f %10.1f %10.1f\n", "delivery (ms)",
+           average(&stats.delivery) / MS,
+           (double) percentile(&stats.delivery, 50) / MS,
+           (double) percentile(&stats.delivery, 90) / MS,
+           (double) percentile(&stats.delivery, 99) / MS,
+           (double) percentile(&stats.delivery, 100) / MS);
+    printf("%-16s %10.1f %10.1f %10.1f %10.1f %10.1f\n", "end to end (ms)",
+           average(&stats.end_to_end) / MS,
+           (double) percentile(&stats.end_to_end, 50) / MS,
+           (double) percentile(&stats.end_to_end, 90) / MS,
+           (double) percentile(&stats.end_to_end, 99) / MS,
+           (double) percentile(&stats.end_to_end, 100) / MS);
+
+    printf("\n%ld events in %.1f s of virtual time, %.2f s to simulate\n",
+           n_events, (double) now / (1000 * MS), seconds);
+}
+
+int
+main(int argc, char** argv) {
+    struct timeval start, stop;
+    int queries = 1000;
+    int degree = 6;
+    unsigned long seed = 1;
+    query_t *q;
+    event_t e;
+    int i;
+
+    if (argc < 3) {
+        printf("usage: meshsim <topology> <nodes> [<queries> [<degree> "
+               "[<seed> [<suppress>]]]]\n");
+        return 1;
+    }
+    if (argc > 3) queries = atoi(argv[3]);
+    if (argc > 4) degree = atoi(argv[4]);
+    if (argc > 5) seed = strtoul(argv[5], NULL, 10);
+    if (argc > 6) suppress = atoi(argv[6]);
+    sgenrand_r(&rng, seed);
+
+    if (strcmp(argv[1], "grid") == 0) {
+        make_grid(atoi(argv[2]));
+    } else if (strcmp(argv[1], "geometric") == 0) {
+        make_geometric(atoi(argv[2]), degree);
+    } else if (strcmp(argv[1], "scalefree") == 0) {
+        make_scalefree(atoi(argv[2]), degree);
+    } else {
+        read_topology(argv[1]);
+    }
+
+    for (i = 0; i < queries; i++) {
+        q = (query_t *) malloc(sizeof(query_t));
+        AbortOnCondition(q == NULL, "malloc");
+        q->src = genintrand_r(&rng, n_nodes) - 1;
+        do {
+            q->dst = genintrand_r(&rng, n_nodes) - 1;
+        } while (q->dst == q->src);
+        q->issued = (long) i * QUERY_INTERVAL * MS;
+        schedule(q->issued, EVENT_QUERY, q->src, 0, q);
+    }
+
+    gettimeofday(&start, NULL);
+    while (heap_len > 0) {
+        e = next_event();
+        now = e.time;
+        n_events++;
+        switch (e.kind) {
+        case EVENT_PACKET:
+            receive(e.node, (packet_t *) e.arg);
+            break;
+        case EVENT_QUERY:
+            stats.queries++;
+            start_query((query_t *) e.arg);
+            break;
+        case EVENT_TIMEOUT:
+            timeout((discovery_t *) e.arg, e.attempt);
+            break;
+        }
+    }
+    gettimeofday(&stop, NULL);
+
+    report(argv[1], (stop.tv_sec - start.tv_sec) +
+                    (stop.tv_usec - start.tv_usec) / 1e6);
+    return 0;
+}
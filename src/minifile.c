@@ -7,6 +7,7 @@
 #include "miniheader.h"
 #include <string.h>
 #include "uthash.h"
+#include "slab.h"
 #include "counter.h"
 
 /* Structure for locking access to an inode
@@ -58,6 +59,10 @@ typedef struct waiting_request {
     UT_hash_handle hh;
 }* waiting_request_t;
 
+static struct slab_cache waiting_request_cache =
+    SLAB_CACHE_INITIALIZER("waiting request", sizeof(struct waiting_request),
+                           NULL);
+
 /*
  * Strucutre denoting a blockid and block
  */
@@ -209,7 +214,7 @@ void move_dir(thread_files_t files, int new_blocknum) {
 
 void destroy_waiting_disk(waiting_request_t req) {
     counter_destroy(req->mutex);
-    free(req);
+    slab_free(&waiting_request_cache, req);
 }
 
 /* Handler for disk operations
@@ -247,15 +252,15 @@ waiting_request_t create_waiting_disk(int blockid, disk_reply_t* reply) {
 
     HASH_FIND_INT( req_map, &blockid, req );
     if (!req) {
-        req = (waiting_request_t) malloc (sizeof (struct waiting_request));
+        req = (waiting_request_t) slab_alloc(&waiting_request_cache);
         if (!req) {
-            free(wait);
+            semaphore_destroy(wait);
             return NULL;
         }
 
         req->mutex = counter_new();
         if (!req->mutex) {
-            free(wait);
+            semaphore_destroy(wait);
             destroy_waiting_disk(req);
             return NULL;
         }
@@ -295,12 +300,12 @@ char* get_block_blocking(int blocknum) {
     wait = read_block(blocknum, &reply, block);
     semaphore_P(wait);
     if (reply != DISK_REPLY_OK) {
-        free(wait);
+        semaphore_destroy(wait);
         free(block);
         return NULL;
     }
 
-    free(wait);
+    semaphore_destroy(wait);
     return block;
 }
 
@@ -311,11 +316,11 @@ int write_block_blocking(int blocknum, char* block) {
     wait = write_block(blocknum, &reply, block);
     semaphore_P(wait);
     if (reply != DISK_REPLY_OK) {
-        free(wait);
+        semaphore_destroy(wait);
         return -1;
     }
 
-    free(wait);
+    semaphore_destroy(wait);
     return 0;
 }
 
@@ -1029,6 +1034,12 @@ void minifile_initialize() {
     semaphore_initialize(free_data_lock, 1);
     semaphore_initialize(free_inode_lock, 1);
 
+    semaphore_name(file_lock, "file_lock");
+    semaphore_name(open_dir_lock, "open_dir_lock");
+    semaphore_name(inode_lock_lock, "inode_lock_lock");
+    semaphore_name(free_data_lock, "free_data_lock");
+    semaphore_name(free_inode_lock, "free_inode_lock");
+
     disk_superblock = (superblock_t) malloc (sizeof(struct superblock));
 }
 
@@ -8,6 +8,9 @@
 #include "network.h"
 #include "queue.h"
 #include "synch.h"
+#include "interrupts.h"
+#include "netstats.h"
+#include "txsched.h"
 
 #define validUnbound(p) p >= 0 && p < NUMPORTS
 
@@ -15,10 +18,12 @@
 struct miniport {
     char port_type;
     int port_number;
+    netstats_port_t stats;
 
     union {
         struct {
             queue_t incoming_data;
+            int queued_bytes; // Packet memory in incoming_data
             semaphore_t lock;
             semaphore_t ready;
         } unbound;
@@ -46,18 +51,29 @@ minimsg_handle(network_interrupt_arg_t *arg) {
     int source;
     int destination;
 
-    header = (mini_header_t) (arg->buffer + sizeof(struct routing_header));
+    // The header stays on the packet until it is received
+    if (network_pkt_len(arg) < sizeof(struct mini_header)) {
+        netstats_dropped(NETSTATS_DROP_INVALID);
+        network_free_pkt(arg);
+        return;
+    }
+    header = (mini_header_t) network_pkt_data(arg);
     source = unpack_unsigned_short(header->source_port);
     destination = unpack_unsigned_short(header->destination_port);
 
     // Sanity checks
     if (!(validUnbound(source)) || !(validUnbound(destination)) ||
         unbound_ports[destination] == NULL) {
+        netstats_dropped(NETSTATS_DROP_BAD_PORT);
+        network_free_pkt(arg);
         return;
     }
+    netstats_port_received(&unbound_ports[destination]->stats,
+                           NETSTATS_MINIDATAGRAM, network_pkt_len(arg));
 
     // Lock incoming data queue
     queue_append(unbound_ports[destination]->u.unbound.incoming_data, arg);
+    unbound_ports[destination]->u.unbound.queued_bytes += network_pkt_bytes(arg);
     // One more piece of data ready
     semaphore_V(unbound_ports[destination]->u.unbound.ready);
 }
@@ -95,6 +111,8 @@ minimsg_initialize() {
 
     semaphore_initialize(mutex_unbound, 1);
     semaphore_initialize(mutex_bound, 1);
+    semaphore_name(mutex_unbound, "mutex_unbound");
+    semaphore_name(mutex_bound, "mutex_bound");
 }
 
 /*
@@ -110,8 +128,10 @@ new_unbound(int port_number) {
     // Generic port data
     port->port_type = UNBOUND;
     port->port_number = port_number;
+    memset(&port->stats, 0, sizeof(port->stats));
     // Unbound port data
     port->u.unbound.incoming_data = queue_new();
+    port->u.unbound.queued_bytes = 0;
     port->u.unbound.lock = semaphore_create();
     port->u.unbound.ready = semaphore_create();
     // Null check (free if any mallocs fail)
@@ -126,6 +146,8 @@ new_unbound(int port_number) {
 
     semaphore_initialize(port->u.unbound.lock, 1);
     semaphore_initialize(port->u.unbound.ready, 0);
+    semaphore_name(port->u.unbound.lock, "unbound.lock");
+    semaphore_name(port->u.unbound.ready, "unbound.ready");
 
     // Successfully created an unbound port
     unbound_ports[port_number] = port;
@@ -144,6 +166,7 @@ new_bound(int bound_id, network_address_t addr, int remote_unbound_port) {
     // Generic port data
     port->port_type = BOUND;
     port->port_number = bound_id + NUMPORTS;
+    memset(&port->stats, 0, sizeof(port->stats));
     // Bound port data
     port->u.bound.remote_address[0] = addr[0];
     port->u.bound.remote_address[1] = addr[1];
@@ -225,11 +248,12 @@ miniport_destroy(miniport_t miniport) {
         semaphore_V(mutex_unbound); // Release lock
 
         while (queue_dequeue(miniport->u.unbound.incoming_data, &data) == 0) {
-            free((network_interrupt_arg_t *) data);
+            network_free_pkt((network_interrupt_arg_t *) data);
         }
         queue_free(miniport->u.unbound.incoming_data);
         semaphore_destroy(miniport->u.unbound.lock);
         semaphore_destroy(miniport->u.unbound.ready);
+        txsched_set_flow(TXSCHED_FLOW(PROTOCOL_MINIDATAGRAM, miniport->port_number), NULL);
     } else if (miniport->port_type == BOUND) {
         // Sets to array value to NULL and free
         semaphore_P(mutex_bound); // Acquire lock
@@ -239,6 +263,45 @@ miniport_destroy(miniport_t miniport) {
     free(miniport);
 }
 
+/* Returns the memory held by packets queued on an unbound port, or -1 for
+ * a bound or invalid port.
+ */
+int
+miniport_buffered_bytes(miniport_t miniport) {
+    interrupt_level_t old_level;
+    int bytes;
+
+    if ( !miniport || miniport->port_type != UNBOUND ) return -1;
+
+    old_level = set_interrupt_level(DISABLED);
+    bytes = miniport->u.unbound.queued_bytes;
+    set_interrupt_level(old_level);
+    return bytes;
+}
+
+/* Copies the counters of a port into stats. See minimsg.h.
+ */
+int
+miniport_stats(miniport_t miniport, netstats_port_t *stats) {
+    if ( !miniport || !stats ) return -1;
+
+    netstats_port_snapshot(&miniport->stats, stats);
+    return 0;
+}
+
+/* Schedules the messages sent from an unbound port. See minimsg.h.
+ */
+int
+miniport_set_tx_flow(miniport_t miniport, txsched_flow_t *cfg) {
+    int flow;
+
+    if ( !miniport || miniport->port_type != UNBOUND ) return -1;
+
+    flow = TXSCHED_FLOW(PROTOCOL_MINIDATAGRAM, miniport->port_number);
+    txsched_set_flow(flow, cfg);
+    return flow;
+}
+
 /* Sends a message through a locally bound port (the bound port already has an associated
  * receiver address so it is sufficient to just supply the bound port number). In order
  * for the remote system to correctly create a bound port for replies back to the sending
@@ -251,36 +314,88 @@ miniport_destroy(miniport_t miniport) {
 int
 minimsg_send(miniport_t local_unbound_port, miniport_t local_bound_port, minimsg_t msg, int len) {
     network_address_t my_address;
-    mini_header_t header;
+    struct mini_header header;
+    struct iovec iov[2];
     // Null checks
     if ( !local_unbound_port || !local_bound_port || msg == NULL ) return -1;
 
     // Size check
-    if (len > MINIMSG_MAX_MSG_SIZE) return -1;
+    if (len < 0 || len > minimsg_max_msg_size()) {
+        netstats_port_dropped(&local_unbound_port->stats, NETSTATS_DROP_INVALID);
+        return -1;
+    }
 
     network_get_my_address(my_address); // Get my address
     // Construct a header to send
-    header = (mini_header_t) malloc (sizeof(struct mini_header));
-
-    if ( !header ) return -1;
-
-    header->protocol = PROTOCOL_MINIDATAGRAM;
+    header.protocol = PROTOCOL_MINIDATAGRAM;
     // Pack source and destination
-    pack_address(header->source_address, my_address);
-    pack_unsigned_short(header->source_port, local_unbound_port->port_number);
-    pack_address(header->destination_address, local_bound_port->u.bound.remote_address);
-    pack_unsigned_short(header->destination_port, local_bound_port->u.bound.remote_unbound_port);
-
-    // Frees the header after sending the packet
-    if (miniroute_send_pkt(local_bound_port->u.bound.remote_address, sizeof(struct mini_header), (char *) header, len, msg) == -1) {
-	free(header);
+    pack_address(header.source_address, my_address);
+    pack_unsigned_short(header.source_port, local_unbound_port->port_number);
+    pack_address(header.destination_address, local_bound_port->u.bound.remote_address);
+    pack_unsigned_short(header.destination_port, local_bound_port->u.bound.remote_unbound_port);
+
+    // The header and the message go out as they are, without a copy
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(struct mini_header);
+    iov[1].iov_base = msg;
+    iov[1].iov_len = len;
+    if (miniroute_send_pktv(local_bound_port->u.bound.remote_address, iov, 2) == -1) {
         return -1;
     }
-    free(header);
+    netstats_port_sent(&local_unbound_port->stats, NETSTATS_MINIDATAGRAM,
+                       sizeof(struct mini_header) + len);
     // Assumes that we have transmitted the whole message if successful
     return len;
 }
 
+int
+minimsg_max_msg_size() {
+    int fits = network_mtu() - sizeof(struct routing_header) - sizeof(struct mini_header);
+
+    if (network_mtu() > MAX_NETWORK_PKT_SIZE || fits < MINIMSG_MAX_MSG_SIZE)
+        return fits;
+    return MINIMSG_MAX_MSG_SIZE;
+}
+
+int
+minimsg_send_segments(miniport_t local_unbound_port, miniport_t local_bound_port, minimsg_t msg, int len, int seg_size) {
+    network_address_t my_address;
+    struct mini_header header;
+    struct iovec iov;
+    int segments;
+    int sent;
+    int i;
+    // Null checks
+    if ( !local_unbound_port || !local_bound_port || msg == NULL ) return -1;
+
+    // Size check
+    if (len < 0 || seg_size <= 0 || seg_size > minimsg_max_msg_size()) {
+        netstats_port_dropped(&local_unbound_port->stats, NETSTATS_DROP_INVALID);
+        return -1;
+    }
+
+    // One header goes in front of every segment
+    network_get_my_address(my_address);
+    header.protocol = PROTOCOL_MINIDATAGRAM;
+    pack_address(header.source_address, my_address);
+    pack_unsigned_short(header.source_port, local_unbound_port->port_number);
+    pack_address(header.destination_address, local_bound_port->u.bound.remote_address);
+    pack_unsigned_short(header.destination_port, local_bound_port->u.bound.remote_unbound_port);
+
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(struct mini_header);
+    sent = miniroute_send_segments(local_bound_port->u.bound.remote_address, &iov, 1, msg, len, seg_size);
+    if (sent == -1) {
+        return -1;
+    }
+    segments = len == 0 ? 1 : (sent + seg_size - 1) / seg_size;
+    for (i = 0; i < segments; i++) {
+        netstats_port_sent(&local_unbound_port->stats, NETSTATS_MINIDATAGRAM, sizeof(struct mini_header) +
+                           (sent - i * seg_size < seg_size ? sent - i * seg_size : seg_size));
+    }
+    return sent;
+}
+
 /* Receives a message through a locally unbound port. Threads that call this function are
  * blocked until a message arrives. Upon arrival of each message, the function must create
  * a new bound port that targets the sender's address and listening port, so that use of
@@ -291,17 +406,41 @@ minimsg_send(miniport_t local_unbound_port, miniport_t local_bound_port, minimsg
  */
 int
 minimsg_receive(miniport_t local_unbound_port, miniport_t* new_local_bound_port, minimsg_t msg, int *len) {
+    minimsg_buf_t buf;
+    minimsg_t payload;
+    int payload_size;
+
+    payload_size = minimsg_receive_buf(local_unbound_port, new_local_bound_port, &buf, &payload);
+    if (payload_size == -1) {
+        *len = 0;
+        return -1;
+    }
+
+    // We have less payload than the allocated buffer
+    if (payload_size < *len) {
+        *len = payload_size;
+    }
+    // Copies data over to user buffer
+    memcpy(msg, payload, *len);
+    minimsg_release_buf(buf);
+    return *len;
+}
+
+/* Receives a message like minimsg_receive, but lends out the packet it arrived in instead of
+ * copying the payload. See minimsg.h.
+ */
+int
+minimsg_receive_buf(miniport_t local_unbound_port, miniport_t* new_local_bound_port, minimsg_buf_t* buf, minimsg_t* msg) {
     void *node;
     mini_header_t header;
-    int payload_size;
     network_interrupt_arg_t *data;
     network_address_t source_address;
     int source_port;
+    interrupt_level_t old_level;
 
     // Null check
-    if ( !local_unbound_port ) {
+    if ( !local_unbound_port || local_unbound_port->port_type != UNBOUND ) {
         *new_local_bound_port = NULL;
-        *len = 0;
         return -1;
     }
 
@@ -310,21 +449,17 @@ minimsg_receive(miniport_t local_unbound_port, miniport_t* new_local_bound_port,
 
     // Lock incoming data queue to get data
     semaphore_P(local_unbound_port->u.unbound.lock);
+    old_level = set_interrupt_level(DISABLED); // The handler appends
     queue_dequeue(local_unbound_port->u.unbound.incoming_data, &node);
-    semaphore_V(local_unbound_port->u.unbound.lock);
-
     data = (network_interrupt_arg_t *) node;
+    local_unbound_port->u.unbound.queued_bytes -= network_pkt_bytes(data);
+    set_interrupt_level(old_level);
+    semaphore_V(local_unbound_port->u.unbound.lock);
 
-    payload_size = data->size - sizeof(struct routing_header) - sizeof(struct mini_header);
-    // We have less payload than the allocated buffer
-    if (payload_size < *len) {
-        *len = payload_size;
-    }
-    // Copies data over to user buffer
-    memcpy(msg, data->buffer + sizeof(struct routing_header) + sizeof(struct mini_header), *len);
+    // Strip the header, checked for length by the handler
+    header = (mini_header_t) network_pkt_pull(data, sizeof(struct mini_header));
 
     // Try to construct bound port
-    header = (mini_header_t) data->buffer;
     unpack_address(header->source_address, source_address);
     source_port = unpack_unsigned_short(header->source_port);
 
@@ -332,12 +467,20 @@ minimsg_receive(miniport_t local_unbound_port, miniport_t* new_local_bound_port,
 
     // Failed to get a new bound port
     if ( *new_local_bound_port == NULL ) {
-        free(data);
+        network_free_pkt(data);
         return -1;
     }
 
-    // Successfully created bound port
-    free(data);
-    return *len;
+    // Successfully created bound port, the payload is lent out in place
+    *buf = data;
+    *msg = network_pkt_data(data);
+    return network_pkt_len(data);
+}
+
+/* Returns a packet lent out by minimsg_receive_buf
+ */
+void
+minimsg_release_buf(minimsg_buf_t buf) {
+    network_free_pkt(buf);
 }
 
@@ -8,9 +8,11 @@
  *      the exact arguments in the prototypes.
  */
 #include "network.h"
+#include "netstats.h"
+#include "txsched.h"
 
-/* The maximum size of a minimsg.
- * Must be <= MAX_NETWORK_PKT_SIZE - NETWORK_HDR_SIZE
+/* The maximum size of a minimsg at the default MTU.
+ * Must be <= MAX_NETWORK_PKT_SIZE - NETWORK_HDR_SIZE; see minimsg_max_msg_size
  */
 #define MINIMSG_MAX_MSG_SIZE (4096)
 #define NUMPORTS 32768
@@ -19,6 +21,7 @@ enum {UNBOUND = 1, BOUND};
 
 typedef struct miniport* miniport_t;
 typedef char* minimsg_t;
+typedef network_interrupt_arg_t* minimsg_buf_t;
 
 /* Handler for receiving a minimsg */
 extern void minimsg_handle(network_interrupt_arg_t *arg);
@@ -50,6 +53,24 @@ extern miniport_t miniport_create_bound(network_address_t addr, int remote_unbou
  */
 extern void miniport_destroy(miniport_t miniport);
 
+/* Returns the memory held by packets waiting to be received on an unbound port,
+ * or -1 for a bound or invalid port.
+ */
+extern int miniport_buffered_bytes(miniport_t miniport);
+
+/* Copies a port's counters into stats (see netstats.h): the messages sent
+ * from an unbound port, with their headers, and those received on it or
+ * dropped there. Returns 0, or -1 for an invalid port.
+ */
+extern int miniport_stats(miniport_t miniport, netstats_port_t *stats);
+
+/* Configures the transmit flow of the messages sent from an unbound port
+ * (see txsched.h): a rate limit, its weight against other flows and its
+ * queue limit, or the defaults if cfg is NULL. Returns the flow, for
+ * txsched_flow_stats, or -1 for a bound or invalid port.
+ */
+extern int miniport_set_tx_flow(miniport_t miniport, txsched_flow_t *cfg);
+
 /* Sends a message through a locally bound port (the bound port already has an associated
  * receiver address so it is sufficient to just supply the bound port number). In order
  * for the remote system to correctly create a bound port for replies back to the sending
@@ -61,6 +82,19 @@ extern void miniport_destroy(miniport_t miniport);
  */
 extern int minimsg_send(miniport_t local_unbound_port, miniport_t local_bound_port, minimsg_t msg, int len);
 
+/* Returns the largest message minimsg_send takes: MINIMSG_MAX_MSG_SIZE, or less if the MTU
+ * (see network_set_mtu) cannot carry it with the headers, or as much as a jumbo MTU carries.
+ */
+extern int minimsg_max_msg_size();
+
+/* Sends len bytes of msg as messages of seg_size bytes, the last one shorter, each a minimsg
+ * of its own that the receiver gets with minimsg_receive. They are handed to the network
+ * layer at once (see network_send_segments), which costs a route lookup and, to another host,
+ * a system call for a batch of them, rather than one of each per message. seg_size is at most
+ * minimsg_max_msg_size(). Returns the payload bytes sent, or -1.
+ */
+extern int minimsg_send_segments(miniport_t local_unbound_port, miniport_t local_bound_port, minimsg_t msg, int len, int seg_size);
+
 /* Receives a message through a locally unbound port. Threads that call this function are
  * blocked until a message arrives. Upon arrival of each message, the function must create
  * a new bound port that targets the sender's address and listening port, so that use of
@@ -71,4 +105,14 @@ extern int minimsg_send(miniport_t local_unbound_port, miniport_t local_bound_po
  */
 extern int minimsg_receive(miniport_t local_unbound_port, miniport_t* new_local_bound_port, minimsg_t msg, int *len);
 
+/* Receives a message like minimsg_receive, without copying it: msg is pointed at the payload
+ * inside the packet it arrived in, which is lent out as buf. The payload stays valid until buf
+ * is returned with minimsg_release_buf. The return value is the payload length, or -1 on
+ * failure, in which case there is nothing to release.
+ */
+extern int minimsg_receive_buf(miniport_t local_unbound_port, miniport_t* new_local_bound_port, minimsg_buf_t* buf, minimsg_t* msg);
+
+/* Returns a packet lent out by minimsg_receive_buf or minisocket_receive_buf. */
+extern void minimsg_release_buf(minimsg_buf_t buf);
+
 #endif /*__MINIMSG_H__*/
@@ -7,11 +7,9 @@
 #include "minithread.h"
 #include "synch.h"
 #include "cache.h"
-#include "alarm.h"
-
-#define NUM_RETRY 3
-#define WAIT_DELAY 12000
-#define CACHE_FRESH 3000
+#include "slab.h"
+#include "netstats.h"
+#include "txsched.h"
 
 typedef struct route {
     long timestamp;
@@ -27,6 +25,10 @@ typedef struct waiting {
     route_t route;
 }* waiting_t;
 
+static struct slab_cache header_cache =
+    SLAB_CACHE_INITIALIZER("routing header", sizeof(struct routing_header),
+                           NULL);
+
 cache_t wait_cache;
 cache_t path_cache;
 semaphore_t path_mutex;
@@ -67,6 +69,8 @@ create_waiting() {
     wait->id = get_next_id();
     semaphore_initialize(wait->wait_disc, 0);
     semaphore_initialize(wait->wait_for_data, 0);
+    semaphore_name(wait->wait_disc, "wait_disc");
+    semaphore_name(wait->wait_for_data, "wait_for_data");
     return wait;
 }
 
@@ -138,6 +142,7 @@ bcast_discovery(routing_header_t hdr) {
     int pathlen;
 
     if (unpack_unsigned_int(hdr->ttl) == 0) { // Fail if ttl is 0
+        netstats_dropped(NETSTATS_DROP_TTL);
         return 0;
     }
 
@@ -146,23 +151,81 @@ bcast_discovery(routing_header_t hdr) {
     pack_unsigned_int(hdr->path_len, pathlen + 1);
     pack_address(hdr->path[pathlen], my_address);
 
+    // Counted once, however many links it goes out on
+    netstats_sent(NETSTATS_ROUTING_DISCOVERY, sizeof(struct routing_header));
     return network_bcast_pkt(sizeof(struct routing_header), (char *) hdr, 0, dummy);
 }
 
 /* Sends a data packet along a path
- *
+ * The routing header goes out in front of the iovcnt pieces in iov
  */
 int
-send_data(routing_header_t hdr, int len, char* data) {
+send_data(routing_header_t hdr, struct iovec* iov, int iovcnt) {
+    network_address_t next_addr; // Next address along path
+    struct iovec pkt_iov[MAX_NETWORK_IOV];
+    int len;
+    int i; // Index of the current node in the path
+
+    if (iovcnt > MAX_NETWORK_IOV - 1) {
+        netstats_dropped(NETSTATS_DROP_INVALID);
+        return -1;
+    }
+
+    i = MAX_ROUTE_LENGTH - unpack_unsigned_int(hdr->ttl);
+    if (i >= MAX_ROUTE_LENGTH - 1) {
+        netstats_dropped(NETSTATS_DROP_TTL);
+        return 0;
+    }
+    unpack_address(hdr->path[i], next_addr);
+
+    pkt_iov[0].iov_base = hdr;
+    pkt_iov[0].iov_len = sizeof(struct routing_header);
+    len = sizeof(struct routing_header);
+    for (i = 0; i < iovcnt; i++) {
+        pkt_iov[i + 1] = iov[i];
+        len += iov[i].iov_len;
+    }
+    netstats_sent(NETSTATS_ROUTING_DATA + hdr->routing_packet_type, len);
+    return network_send_pktv(next_addr, pkt_iov, iovcnt + 1);
+}
+
+/* Sends data along a path in segments of seg_size, each behind the routing
+ * header and the hdrcnt pieces in hdr, which add up to hdr_len. Returns the
+ * data bytes sent, or -1.
+ */
+static int
+send_data_segments(routing_header_t hdr, struct iovec* user_hdr, int hdrcnt, int hdr_len,
+                   char* data, int data_len, int seg_size) {
     network_address_t next_addr; // Next address along path
+    struct iovec pkt_iov[MAX_NETWORK_IOV];
+    int sent;
+    int segments;
     int i; // Index of the current node in the path
 
     i = MAX_ROUTE_LENGTH - unpack_unsigned_int(hdr->ttl);
     if (i >= MAX_ROUTE_LENGTH - 1) {
+        netstats_dropped(NETSTATS_DROP_TTL);
         return 0;
     }
     unpack_address(hdr->path[i], next_addr);
-    return network_send_pkt(next_addr, sizeof(struct routing_header), (char *) hdr, len, data);
+
+    pkt_iov[0].iov_base = hdr;
+    pkt_iov[0].iov_len = sizeof(struct routing_header);
+    for (i = 0; i < hdrcnt; i++)
+        pkt_iov[i + 1] = user_hdr[i];
+
+    sent = network_send_segments(next_addr, pkt_iov, hdrcnt + 1, data, data_len, seg_size);
+    if (sent == -1)
+        return -1;
+
+    // Each segment counts as a packet of its own
+    segments = data_len == 0 ? 1 : (sent + seg_size - 1) / seg_size;
+    for (i = 0; i < segments; i++) {
+        netstats_sent(NETSTATS_ROUTING_DATA + hdr->routing_packet_type,
+                      sizeof(struct routing_header) + hdr_len +
+                      (sent - i * seg_size < seg_size ? sent - i * seg_size : seg_size));
+    }
+    return sent;
 }
 
 /* Sends a reply along a path
@@ -170,7 +233,7 @@ send_data(routing_header_t hdr, int len, char* data) {
  */
 int
 send_reply(routing_header_t hdr) {
-    return send_data(hdr, 0, dummy);
+    return send_data(hdr, NULL, 0);
 }
 
 /* Time passes for the header (decrease ttl)
@@ -189,7 +252,7 @@ routing_header_t
 create_disc_hdr(network_address_t dest_address, int id) {
     routing_header_t header;
 
-    header = (routing_header_t) malloc (sizeof(struct routing_header));
+    header = (routing_header_t) slab_alloc(&header_cache);
     if (!header) return NULL;
 
     header->routing_packet_type = ROUTING_ROUTE_DISCOVERY;
@@ -239,7 +302,7 @@ create_data_hdr(network_address_t dest_address, int len, char (*path)[8]) {
     routing_header_t header;
     int i;
 
-    header = (routing_header_t) malloc (sizeof(struct routing_header));
+    header = (routing_header_t) slab_alloc(&header_cache);
     if (!header) return NULL;
 
     network_get_my_address(my_address); // Get my address
@@ -301,6 +364,47 @@ complete_wait(waiting_t wait) {
     }
 }
 
+/* Sorts a received packet for the network layer: route replies and
+ * minisocket packets without data (SYN, SYNACK, FIN and bare ACKs) are
+ * control, everything else bulk. Runs on the device pollers.
+ */
+static int
+miniroute_classify(char *packet, int len) {
+    routing_header_t header = (routing_header_t) packet;
+
+    if (len < sizeof(struct routing_header))
+        return NETWORK_RX_BULK;
+    if (header->routing_packet_type == ROUTING_ROUTE_REPLY)
+        return NETWORK_RX_CONTROL;
+    if (header->routing_packet_type == ROUTING_DATA &&
+        len == sizeof(struct routing_header) + sizeof(struct mini_header_reliable) &&
+        packet[sizeof(struct routing_header)] == PROTOCOL_MINISTREAM)
+        return NETWORK_RX_CONTROL;
+    return NETWORK_RX_BULK;
+}
+
+/* Gives the transmit flow of a packet we send: that of the local port a
+ * minimsg or minisocket packet comes from, or the default flow for
+ * routing packets and those forwarded for other hosts.
+ */
+static int
+miniroute_flow(char *packet, int len) {
+    routing_header_t header = (routing_header_t) packet;
+    mini_header_t mini = (mini_header_t) (packet + sizeof(struct routing_header));
+    network_address_t my_address;
+    network_address_t source;
+
+    if (len < sizeof(struct routing_header) + sizeof(struct mini_header) ||
+        header->routing_packet_type != ROUTING_DATA)
+        return TXSCHED_DEFAULT_FLOW;
+
+    network_get_my_address(my_address);
+    unpack_address(mini->source_address, source);
+    if (!network_compare_network_addresses(my_address, source))
+        return TXSCHED_DEFAULT_FLOW;
+    return TXSCHED_FLOW(mini->protocol, unpack_unsigned_short(mini->source_port));
+}
+
 /* Handler for miniroutes messages
  * Assumes interrupts are disabled within
  */
@@ -312,9 +416,19 @@ miniroute_handle(network_interrupt_arg_t *arg) {
     void* wait_node;
     waiting_t wait;
     route_t route;
+    struct iovec iov;
     int i;
 
-    header = (routing_header_t) arg->buffer;
+    // Routing header, the rest of the packet is passed up
+    header = (routing_header_t) network_pkt_pull(arg, sizeof(struct routing_header));
+    if (header == NULL || header->routing_packet_type < ROUTING_DATA ||
+        header->routing_packet_type > ROUTING_ROUTE_REPLY) {
+        netstats_dropped(NETSTATS_DROP_INVALID);
+        network_free_pkt(arg);
+        return;
+    }
+    netstats_received(NETSTATS_ROUTING_DATA + header->routing_packet_type,
+                      sizeof(struct routing_header) + network_pkt_len(arg));
 
     // Check routing type
     if (header->routing_packet_type == ROUTING_ROUTE_DISCOVERY) {
@@ -328,7 +442,7 @@ miniroute_handle(network_interrupt_arg_t *arg) {
                 bcast_discovery(header);
             }
         }
-        free(arg);
+        network_free_pkt(arg);
     } else if (header->routing_packet_type == ROUTING_ROUTE_REPLY) {
         if (check_destination(header) != 0) { // We have reached the destination
             unpack_address(header->path[0], dest_address);
@@ -336,7 +450,10 @@ miniroute_handle(network_interrupt_arg_t *arg) {
                 wait = (waiting_t) wait_node;
                 if (wait->id == unpack_unsigned_int(header->id)) {
                     route = (route_t) malloc(sizeof(struct route));
-                    if (!route) return;
+                    if (!route) {
+                        network_free_pkt(arg);
+                        return;
+                    }
 
                     route->path_len = unpack_unsigned_int(header->path_len);
                     for (i = 0; i < route->path_len; i++) { // Reverses path
@@ -353,21 +470,26 @@ miniroute_handle(network_interrupt_arg_t *arg) {
             increment_hdr(header);
             send_reply(header);
         }
-        free(arg);
+        network_free_pkt(arg);
     } else if (header->routing_packet_type == ROUTING_DATA) {
         if (check_destination(header) != 0) { // We have reached the destination
             unpack_address(header->path[0], dest_address);
             set_cached_route(dest_address, header);
             // Check protocol type
-            if (arg->buffer[sizeof(struct routing_header)] == PROTOCOL_MINIDATAGRAM) {
+            if (network_pkt_data(arg)[0] == PROTOCOL_MINIDATAGRAM) {
                 minimsg_handle(arg);
-            } else if (arg->buffer[sizeof(struct routing_header)] == PROTOCOL_MINISTREAM) {
+            } else if (network_pkt_data(arg)[0] == PROTOCOL_MINISTREAM) {
                 minisocket_handle(arg);
+            } else {
+                network_free_pkt(arg);
             }
         } else { // Continue sending
             increment_hdr(header);
-            send_data(header, arg->size - sizeof(struct routing_header), arg->buffer + sizeof(struct routing_header));
-            free(arg);
+            // Sent on from the receive buffer, behind the updated header
+            iov.iov_base = network_pkt_data(arg);
+            iov.iov_len = network_pkt_len(arg);
+            send_data(header, &iov, 1);
+            network_free_pkt(arg);
         }
     }
 }
@@ -396,16 +518,12 @@ miniroute_initialize() {
     semaphore_initialize(wait_mutex, 1);
     semaphore_initialize(path_mutex, 1);
     semaphore_initialize(wait_limit, SIZE_OF_ROUTE_CACHE);
-}
-
-/*
- * Times out a waiting flood discovery
- */
-void timeout(void *w) {
-    waiting_t wait;
+    semaphore_name(wait_mutex, "wait_mutex");
+    semaphore_name(path_mutex, "path_mutex");
+    semaphore_name(wait_limit, "wait_limit");
 
-    wait = (waiting_t) w;
-    semaphore_V(wait->wait_disc);
+    network_set_classifier(miniroute_classify);
+    txsched_set_classifier(miniroute_flow);
 }
 
 /* Performs flood broadcasting to discover path to destination
@@ -414,7 +532,6 @@ void
 flood_discovery(network_address_t dest_address, waiting_t wait) {
     int i;
     routing_header_t header;
-    alarm_id retry_alarm;
 
     header = create_disc_hdr(dest_address, wait->id);
     if (!header) {
@@ -423,18 +540,17 @@ flood_discovery(network_address_t dest_address, waiting_t wait) {
     }
     
     for (i = 0; i < NUM_RETRY; i++) {
-        retry_alarm = register_alarm(WAIT_DELAY, timeout, wait);
+        netstats_flooded();
         bcast_discovery(header);
-        semaphore_P(wait->wait_disc);
-        deregister_alarm(retry_alarm);
+        semaphore_P_timeout(wait->wait_disc, WAIT_DELAY);
         if (wait->route != NULL) { // Success
-            free(header);
+            slab_free(&header_cache, header);
             return;
         }
     }
 
     // 3 failures
-    free(header);
+    slab_free(&header_cache, header);
     complete_wait(wait);
 }
 
@@ -443,83 +559,150 @@ flood_discovery(network_address_t dest_address, waiting_t wait) {
  */
 int
 miniroute_send_pkt(network_address_t dest_address, int hdr_len, char* hdr, int data_len, char* data) {
-    int pktlen; // Size of the packet
-    routing_header_t data_hdr;
-    char* full_data;
+    struct iovec iov[2];
+
+    if (hdr_len < 0 || data_len < 0)
+        return -1;
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hdr_len;
+    iov[1].iov_base = data;
+    iov[1].iov_len = data_len;
+    return miniroute_send_pktv(dest_address, iov, 2);
+}
+
+/* Finds the route to dest_address: from the cache, or by joining or
+ * starting a discovery, which is left in *wait until done_waiting.
+ * Returns NULL if discovery failed.
+ */
+static route_t
+find_route(network_address_t dest_address, waiting_t* wait) {
     void* wait_node;
     void* overflow_node;
     route_t route;
-    waiting_t wait;
-
-    wait = NULL;
-    pktlen = sizeof(struct routing_header) + hdr_len + data_len;
 
-    // sanity checks
-    if (hdr_len < 0 || data_len < 0 || pktlen > MAX_NETWORK_PKT_SIZE)
-        return -1;
+    *wait = NULL;
 
     // Checks if the path is in the cache
     semaphore_P(path_mutex);
     route = get_cached_route(dest_address);
     semaphore_V(path_mutex);
+    if (route != NULL)
+        return route;
+
+    // Cache miss
+    semaphore_P(wait_mutex);
+    if (cache_get(wait_cache, dest_address, &wait_node) == -1) { // New dest
+        semaphore_V(wait_mutex);
+        semaphore_P(wait_limit);
+        *wait = create_waiting();
+        cache_set(wait_cache, dest_address, *wait, &overflow_node); // should not overflow
+        flood_discovery(dest_address, *wait);
+    } else {
+        semaphore_V(wait_mutex);
+        *wait = (waiting_t) wait_node;
+        (*wait)->num_waiting++;
+        semaphore_P((*wait)->wait_for_data);
+    }
+    if ((*wait)->route == NULL) { // Route discovery failure
+        netstats_dropped(NETSTATS_DROP_NO_ROUTE);
+    }
+    return (*wait)->route;
+}
 
-    if (route == NULL) { // Cache miss
-        semaphore_P(wait_mutex);
-        if (cache_get(wait_cache, dest_address, &wait_node) == -1) { // New dest
-            semaphore_V(wait_mutex);
-            semaphore_P(wait_limit);
-            wait = create_waiting();
-            cache_set(wait_cache, dest_address, wait, &overflow_node); // should not overflow
-            flood_discovery(dest_address, wait);
-        } else {
-            semaphore_V(wait_mutex);
-            wait = (waiting_t) wait_node;
-            wait->num_waiting++;
-            semaphore_P(wait->wait_for_data);
-        }
-        if (wait->route == NULL) { // Route discovery failure
-            wait->num_waiting--;
-            if (wait->num_waiting == 0) { // If last out, remove
-                cache_delete(wait_cache, dest_address);
-                destroy_waiting(wait);
-                semaphore_V(wait_limit);
-            }
+/* Leaves a discovery joined by find_route */
+static void
+done_waiting(network_address_t dest_address, waiting_t wait) {
+    if (wait == NULL)
+        return;
+    wait->num_waiting--;
+    if (wait->num_waiting == 0) { // If last out, remove
+        cache_delete(wait_cache, dest_address);
+        destroy_waiting(wait);
+        semaphore_V(wait_limit);
+    }
+}
+
+int
+miniroute_send_pktv(network_address_t dest_address, struct iovec* iov, int iovcnt) {
+    int len; // Size of the caller's pieces
+    routing_header_t data_hdr;
+    route_t route;
+    waiting_t wait;
+    int result;
+    int i;
+
+    // sanity checks
+    if (iovcnt < 0 || iovcnt > MAX_NETWORK_IOV - 1) {
+        netstats_dropped(NETSTATS_DROP_INVALID);
+        return -1;
+    }
+    len = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if ((int) iov[i].iov_len < 0) {
+            netstats_dropped(NETSTATS_DROP_INVALID);
             return -1;
-        } else { // Route discovery success
-            route = wait->route;
         }
+        len += iov[i].iov_len;
     }
-    
+    if (sizeof(struct routing_header) + len > network_mtu()) {
+        netstats_dropped(NETSTATS_DROP_INVALID);
+        return -1;
+    }
+
+    route = find_route(dest_address, &wait);
+    if (route == NULL) {
+        done_waiting(dest_address, wait);
+        return -1;
+    }
+
     // We have successfully gotten a path
     data_hdr = create_data_hdr(dest_address, route->path_len, route->path);
+    result = send_data(data_hdr, iov, iovcnt);
+    done_waiting(dest_address, wait);
+    slab_free(&header_cache, data_hdr);
+    return result == -1 ? -1 : len;
+}
 
-    full_data = (char *) malloc(hdr_len + data_len);
-    memcpy(full_data, hdr, hdr_len);
-    memcpy(full_data + hdr_len, data, data_len);
-
-    if (send_data(data_hdr, hdr_len + data_len, full_data) == -1) {
-        free(data_hdr);
-	if (wait != NULL) {
-            wait->num_waiting--;
-            if (wait->num_waiting == 0) { // If last out, remove
-                cache_delete(wait_cache, dest_address);
-                destroy_waiting(wait);
-                semaphore_V(wait_limit);
-            }
+int
+miniroute_send_segments(network_address_t dest_address, struct iovec* hdr, int hdrcnt,
+                        char* data, int data_len, int seg_size) {
+    int hdr_len; // Size of the caller's headers
+    routing_header_t data_hdr;
+    route_t route;
+    waiting_t wait;
+    int result;
+    int i;
+
+    // sanity checks
+    if (hdrcnt < 0 || hdrcnt > MAX_NETWORK_IOV - 2 || data_len < 0 || seg_size <= 0) {
+        netstats_dropped(NETSTATS_DROP_INVALID);
+        return -1;
+    }
+    hdr_len = 0;
+    for (i = 0; i < hdrcnt; i++) {
+        if ((int) hdr[i].iov_len < 0) {
+            netstats_dropped(NETSTATS_DROP_INVALID);
+            return -1;
         }
+        hdr_len += hdr[i].iov_len;
+    }
+    if (sizeof(struct routing_header) + hdr_len + seg_size > network_mtu()) {
+        netstats_dropped(NETSTATS_DROP_INVALID);
         return -1;
     }
 
-    if (wait != NULL) {
-        wait->num_waiting--;
-        if (wait->num_waiting == 0) { // If last out, remove
-            cache_delete(wait_cache, dest_address);
-            destroy_waiting(wait);
-            semaphore_V(wait_limit);
-        }
+    route = find_route(dest_address, &wait);
+    if (route == NULL) {
+        done_waiting(dest_address, wait);
+        return -1;
     }
-    free(data_hdr);
-    return hdr_len + data_len;
+
+    data_hdr = create_data_hdr(dest_address, route->path_len, route->path);
+    result = send_data_segments(data_hdr, hdr, hdrcnt, hdr_len, data, data_len, seg_size);
+    done_waiting(dest_address, wait);
+    slab_free(&header_cache, data_hdr);
+    return result;
 }
 
 /* hashes a network_address_t into a 16 bit unsigned int */
@@ -13,6 +13,10 @@ enum routing_packet_type {
 #define MAX_ROUTE_LENGTH 20
 #define SIZE_OF_ROUTE_CACHE 20
 
+#define NUM_RETRY 3       /* broadcasts of a discovery before giving up */
+#define WAIT_DELAY 12000  /* milliseconds to wait for a reply to each */
+#define CACHE_FRESH 3000  /* milliseconds a cached route is used for */
+
 typedef struct routing_header
 {
 	char routing_packet_type;		/* the type of routing packet */
@@ -49,6 +53,21 @@ void miniroute_initialize();
  */
 int miniroute_send_pkt(network_address_t dest_address, int hdr_len, char* hdr, int data_len, char* data);
 
+/*
+ * Like miniroute_send_pkt, but the user's headers and data are given as iovcnt pieces, at most
+ * MAX_NETWORK_IOV - 1, which are sent behind the miniroute header without being copied.
+ */
+int miniroute_send_pktv(network_address_t dest_address, struct iovec* iov, int iovcnt);
+
+/*
+ * Sends data_len bytes of data as packets of at most seg_size data bytes, each behind the miniroute
+ * header and the user's hdrcnt header pieces, at most MAX_NETWORK_IOV - 2, through
+ * network_send_segments. A route is found once for them all. Returns the number of data bytes sent
+ * (not including any header), or -1.
+ */
+int miniroute_send_segments(network_address_t dest_address, struct iovec* hdr, int hdrcnt,
+                            char* data, int data_len, int seg_size);
+
 
 /*
  * hash function that generates an unsigned short integer value from a given network address. This value will
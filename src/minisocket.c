@@ -13,6 +13,7 @@
 #include "interrupts.h"
 #include "stream.h"
 #include "state.h"
+#include "netstats.h"
 
 #define CLOSEDELAY 15000
 
@@ -49,6 +50,8 @@ struct minisocket {
     state_t close_state;
     alarm_id close_alarm;
 
+    netstats_port_t stats;
+
     union {
         struct {
             state_t server_state;
@@ -120,7 +123,9 @@ reply_to_address(minisocket_t socket, char message_type, network_address_t dest,
     header = create_header_to_address(socket, dest, dest_port, &err);
     if ( err == SOCKET_NOERROR ) {
         header->message_type = message_type;
-        miniroute_send_pkt(dest, sizeof(struct mini_header_reliable), (char *) header, 0, dummy);
+        if (miniroute_send_pkt(dest, sizeof(struct mini_header_reliable), (char *) header, 0, dummy) != -1) {
+            netstats_port_sent(&socket->stats, NETSTATS_MINISTREAM, sizeof(struct mini_header_reliable));
+        }
         free(header);
     }
 }
@@ -183,13 +188,14 @@ handle_synack(minisocket_t socket, network_address_t source, int source_port) {
 
 /*
  * Handles ack packets
+ * Returns 1 if the packet was queued on the stream, which then owns it
  */
-void
+int
 handle_ack(minisocket_t socket, network_address_t source, int source_port, int ack, int seq, network_interrupt_arg_t *arg) {
     // Source validation
     if ( socket->remote_port != source_port ||
          !network_compare_network_addresses(socket->remote_address, source) ) {
-        return;
+        return 0;
     }
 
     // Waiting for ack on synack
@@ -208,14 +214,18 @@ handle_ack(minisocket_t socket, network_address_t source, int source_port, int a
         }
     }
     // Data
-    if (arg->size > sizeof(struct routing_header) + sizeof(struct mini_header_reliable)) {
+    if (network_pkt_len(arg) > 0) {
         if (seq - 1 == socket->ack && socket->receive_state == RECEIVE_RECEIVING) {
             socket->ack++;
             stream_add(socket->stream, arg);
             semaphore_V(socket->receive_lock);
+            reply(socket, MSG_ACK);
+            return 1;
         }
-        reply(socket, MSG_ACK);
+        netstats_port_dropped(&socket->stats, NETSTATS_DROP_DUPLICATE);
+        reply(socket, MSG_ACK); // Duplicate or out of order
     }
+    return 0;
 }
 
 
@@ -260,8 +270,15 @@ minisocket_handle(network_interrupt_arg_t *arg) {
     minisocket_t socket;
     int seq;
     int ack;
+    int kept = 0;
 
-    header = (mini_header_reliable_t) (arg->buffer + sizeof(struct routing_header));
+    // Strip the header, what is left is the data
+    header = (mini_header_reliable_t) network_pkt_pull(arg, sizeof(struct mini_header_reliable));
+    if (header == NULL) {
+        netstats_dropped(NETSTATS_DROP_INVALID);
+        network_free_pkt(arg);
+        return;
+    }
     unpack_address(header->source_address, source);
     source_port = unpack_unsigned_short(header->source_port);
     port = unpack_unsigned_short(header->destination_port);
@@ -269,16 +286,21 @@ minisocket_handle(network_interrupt_arg_t *arg) {
     ack = unpack_unsigned_int(header->ack_number);
 
     if ( port >= 0 && port < NUMPORTS ) { // Server port
-        if ( !server_ports[port] ) return;
         socket = server_ports[port];
     } else if ( port >= NUMPORTS && port < 2 * NUMPORTS ) { // Client port
-        if ( !client_ports[port - NUMPORTS] ) return;
         socket = client_ports[port -  NUMPORTS];
     } else {
-        return;
+        socket = NULL;
     }
 
-    if (get_state(socket->close_state) == CLOSED) return; // Already closed
+    // No such socket, or already closed
+    if ( !socket || get_state(socket->close_state) == CLOSED ) {
+        netstats_dropped(NETSTATS_DROP_NO_SOCKET);
+        network_free_pkt(arg);
+        return;
+    }
+    netstats_port_received(&socket->stats, NETSTATS_MINISTREAM,
+                           sizeof(struct mini_header_reliable) + network_pkt_len(arg));
 
     switch (header->message_type) {
         case MSG_SYN:
@@ -290,15 +312,16 @@ minisocket_handle(network_interrupt_arg_t *arg) {
                 handle_synack(socket, source, source_port);
             break;
         case MSG_ACK:
-            handle_ack(socket, source, source_port, ack, seq, arg);
+            kept = handle_ack(socket, source, source_port, ack, seq, arg);
             break;
         case MSG_FIN:
             handle_fin(socket, source, source_port, seq);
             break;
     }
 
-    if (!(header->message_type == MSG_ACK && arg->size > sizeof(struct routing_header) + sizeof(struct mini_header_reliable))) {
-        free(arg);
+    // Once on the stream the receiver may have taken it already
+    if (!kept) {
+        network_free_pkt(arg);
     }
 }
 
@@ -336,6 +359,8 @@ minisocket_initialize() {
 
     semaphore_initialize(mutex_server, 1);
     semaphore_initialize(mutex_client, 1);
+    semaphore_name(mutex_server, "mutex_server");
+    semaphore_name(mutex_client, "mutex_client");
 }
 
 /*
@@ -368,6 +393,8 @@ create_socket(int port) {
     socket->close_state = state_new(OPEN);
     socket->close_alarm = NULL;
 
+    memset(&socket->stats, 0, sizeof(socket->stats));
+
     if ( !socket->lock || !socket->send_lock || !socket->send_state ||
          !socket->receive_lock || !socket->stream ||
          !socket->close_state ) {
@@ -383,6 +410,9 @@ create_socket(int port) {
     semaphore_initialize(socket->lock, 1);
     semaphore_initialize(socket->send_lock, 1);
     semaphore_initialize(socket->receive_lock, 0);
+    semaphore_name(socket->lock, "socket.lock");
+    semaphore_name(socket->send_lock, "socket.send_lock");
+    semaphore_name(socket->receive_lock, "socket.receive_lock");
 
     return socket;
 }
@@ -410,6 +440,7 @@ destroy_socket(minisocket_t socket) {
     state_destroy(socket->close_state);
     stream_destroy(socket->stream);
     deregister_alarm(socket->close_alarm);
+    txsched_set_flow(TXSCHED_FLOW(PROTOCOL_MINISTREAM, socket->port_number), NULL);
     free(socket);
 }
 
@@ -460,14 +491,12 @@ minisocket_t
 server_handshake(minisocket_t socket, minisocket_error *error) {
     int num_sent;
     int timeout;
-    alarm_id retry_alarm;
 
     while (1) {
         switch (get_state(socket->u.server.server_state)) {
             case LISTEN: // Listening for Syn
                 num_sent = 0;
                 timeout = BASE_DELAY;
-                retry_alarm = NULL;
                 wait_for_transition(socket->u.server.server_state);
                 socket->ack = 1;
                 break;
@@ -479,16 +508,14 @@ server_handshake(minisocket_t socket, minisocket_error *error) {
                 }
 
                 semaphore_P(socket->lock);
-                retry_alarm = register_alarm(timeout, transition_timer, socket->u.server.server_state); // Set up alarm
+                if (num_sent > 0) netstats_port_retransmitted(&socket->stats);
                 reply(socket, MSG_SYNACK);
 
                 semaphore_V(socket->lock);
 
                 num_sent++;
+                wait_for_transition_timeout(socket->u.server.server_state, timeout);
                 timeout *= 2;
-
-                wait_for_transition(socket->u.server.server_state);
-                deregister_alarm(retry_alarm);
                 break;
             case S_ESTABLISHED: // Received Ack
                 *error = SOCKET_NOERROR;
@@ -504,11 +531,9 @@ minisocket_t
 client_handshake(minisocket_t socket, minisocket_error *error) {
     int num_sent;
     int timeout;
-    alarm_id retry_alarm;
 
     num_sent = 0;
     timeout = BASE_DELAY;
-    retry_alarm = NULL;
 
     while (1) {
         switch (get_state(socket->u.client.client_state)) {
@@ -519,16 +544,14 @@ client_handshake(minisocket_t socket, minisocket_error *error) {
                 }
 
                 semaphore_P(socket->lock);
-                retry_alarm = register_alarm(timeout, transition_timer, socket->u.client.client_state); // Set up alarm
+                if (num_sent > 0) netstats_port_retransmitted(&socket->stats);
                 reply(socket, MSG_SYN);
 
                 semaphore_V(socket->lock);
 
                 num_sent++;
+                wait_for_transition_timeout(socket->u.client.client_state, timeout);
                 timeout *= 2;
-
-                wait_for_transition(socket->u.client.client_state);
-                deregister_alarm(retry_alarm);
                 break;
             case C_ESTABLISHED: // Received Synack
                 *error = SOCKET_NOERROR;
@@ -687,7 +710,6 @@ minisocket_send(minisocket_t socket, minimsg_t msg, int len, minisocket_error *e
     int size;
     int timeout;
     int num_sent;
-    alarm_id retry_alarm;
     int message_iterator;
     int len_left;
 
@@ -729,8 +751,8 @@ minisocket_send(minisocket_t socket, minimsg_t msg, int len, minisocket_error *e
     // iterate until no more data to send
     while (len_left > 0) {
         // find the size for this iteration of send
-        if (MAX_NETWORK_PKT_SIZE - sizeof(struct routing_header) - sizeof(struct mini_header_reliable) < len_left) {
-            size = MAX_NETWORK_PKT_SIZE - sizeof(struct routing_header) - sizeof(struct mini_header_reliable);
+        if (network_mtu() - sizeof(struct routing_header) - sizeof(struct mini_header_reliable) < len_left) {
+            size = network_mtu() - sizeof(struct routing_header) - sizeof(struct mini_header_reliable);
         } else {
             size = len_left;
         }
@@ -773,18 +795,17 @@ minisocket_send(minisocket_t socket, minimsg_t msg, int len, minisocket_error *e
                     }
                 }
                 header->message_type = MSG_ACK;
-                retry_alarm = register_alarm(timeout, transition_timer, socket->send_state);
-                // create alarm to timeout
-                miniroute_send_pkt(socket->remote_address, sizeof(struct mini_header_reliable), (char *) header, size, msg+message_iterator);
+                if (num_sent > 0) netstats_port_retransmitted(&socket->stats);
+                if (miniroute_send_pkt(socket->remote_address, sizeof(struct mini_header_reliable), (char *) header, size, msg+message_iterator) != -1) {
+                    netstats_port_sent(&socket->stats, NETSTATS_MINISTREAM, sizeof(struct mini_header_reliable) + size);
+                }
                 free(header);
 
                 semaphore_V(socket->lock);
 
                 num_sent++;
+                wait_for_transition_timeout(socket->send_state, timeout);
                 timeout *= 2;
-
-                wait_for_transition(socket->send_state);
-                deregister_alarm(retry_alarm);
                 break;
             // received ack, send successful
             case SEND_ACK:
@@ -835,30 +856,12 @@ minisocket_send(minisocket_t socket, minimsg_t msg, int len, minisocket_error *e
 }
 
 /*
- * Receive a message from the other end of the socket. Blocks until
- * some data is received (which can be smaller than max_len bytes).
- *
- * Arguments: the socket on which the communication is made (socket), the memory
- *            location where the received message is returned (msg) and its
- *            maximum length (max_len).
- * Return value: -1 in case of error and sets the error code, the number of
- *           bytes received otherwise
+ * Waits for data and takes it from the stream: up to max_len bytes copied
+ * into msg, or, if pkt is not NULL, the next packet itself
  */
-int
-minisocket_receive(minisocket_t socket, minimsg_t msg, int max_len, minisocket_error *error) {
+static int
+receive(minisocket_t socket, minimsg_t msg, int max_len, network_interrupt_arg_t **pkt, minisocket_error *error) {
     int output;
-    // Sanity checks
-    if (!error) return -1;
-    if (!socket || !msg) {
-        *error = SOCKET_INVALIDPARAMS;
-        return -1;
-    }
-
-    // if length is 0, receive nothing and return
-    if (max_len == 0) {
-        *error = SOCKET_NOERROR;
-        return 0;
-    }
 
     // is waiting
     semaphore_P(socket->lock);
@@ -878,7 +881,12 @@ minisocket_receive(minisocket_t socket, minimsg_t msg, int max_len, minisocket_e
         case RECEIVE_RECEIVING:
         // got data and closed
         case RECEIVE_DATACLOSE:
-            output = stream_take(socket->stream, max_len, msg);
+            if (pkt != NULL) {
+                *pkt = stream_take_pkt(socket->stream);
+                output = *pkt != NULL ? network_pkt_len(*pkt) : -1;
+            } else {
+                output = stream_take(socket->stream, max_len, msg);
+            }
 
             // set error based on if there is output
             if (output != -1) {
@@ -924,6 +932,56 @@ minisocket_receive(minisocket_t socket, minimsg_t msg, int max_len, minisocket_e
     return -1;
 }
 
+/*
+ * Receive a message from the other end of the socket. Blocks until
+ * some data is received (which can be smaller than max_len bytes).
+ *
+ * Arguments: the socket on which the communication is made (socket), the memory
+ *            location where the received message is returned (msg) and its
+ *            maximum length (max_len).
+ * Return value: -1 in case of error and sets the error code, the number of
+ *           bytes received otherwise
+ */
+int
+minisocket_receive(minisocket_t socket, minimsg_t msg, int max_len, minisocket_error *error) {
+    // Sanity checks
+    if (!error) return -1;
+    if (!socket || !msg) {
+        *error = SOCKET_INVALIDPARAMS;
+        return -1;
+    }
+
+    // if length is 0, receive nothing and return
+    if (max_len == 0) {
+        *error = SOCKET_NOERROR;
+        return 0;
+    }
+
+    return receive(socket, msg, max_len, NULL, error);
+}
+
+/*
+ * Receive the data of the next packet without copying it. See minisocket.h.
+ */
+int
+minisocket_receive_buf(minisocket_t socket, minimsg_buf_t *buf, minimsg_t *msg, minisocket_error *error) {
+    int output;
+
+    // Sanity checks
+    if (!error) return -1;
+    if (!socket || !buf || !msg) {
+        *error = SOCKET_INVALIDPARAMS;
+        return -1;
+    }
+
+    *buf = NULL;
+    output = receive(socket, NULL, 0, buf, error);
+    if (*buf != NULL) {
+        *msg = network_pkt_data(*buf);
+    }
+    return output;
+}
+
 /* terminates receives and sends */
 void end_send_receive(minisocket_t socket) {
     // Terminates sends
@@ -939,6 +997,38 @@ void end_send_receive(minisocket_t socket) {
     semaphore_V(socket->receive_lock);
 }
 
+/* Returns the memory held by packets received on the socket and not yet
+ * read, or -1 if the socket is invalid.
+ */
+int
+minisocket_buffered_bytes(minisocket_t socket) {
+    if (!socket) return -1;
+    return stream_bytes(socket->stream);
+}
+
+/* Copies the counters of a socket into stats. See minisocket.h.
+ */
+int
+minisocket_stats(minisocket_t socket, netstats_port_t *stats) {
+    if (!socket || !stats) return -1;
+
+    netstats_port_snapshot(&socket->stats, stats);
+    return 0;
+}
+
+/* Schedules the packets sent on a socket. See minisocket.h.
+ */
+int
+minisocket_set_tx_flow(minisocket_t socket, txsched_flow_t *cfg) {
+    int flow;
+
+    if (!socket) return -1;
+
+    flow = TXSCHED_FLOW(PROTOCOL_MINISTREAM, socket->port_number);
+    txsched_set_flow(flow, cfg);
+    return flow;
+}
+
 /* Close a connection. If minisocket_close is issued, any send or receive should
  * fail.  As soon as the other side knows about the close, it should fail any
  * send or receive in progress. The minisocket is destroyed by minisocket_close
@@ -948,7 +1038,6 @@ void
 minisocket_close(minisocket_t socket) {
     int num_sent;
     int timeout;
-    alarm_id retry_alarm;
 
     if (!socket) return;
 
@@ -981,22 +1070,18 @@ minisocket_close(minisocket_t socket) {
 
                 // create header
                 semaphore_P(socket->lock);
-                retry_alarm = register_alarm(timeout, transition_timer, socket->close_state);
+                if (num_sent > 0) netstats_port_retransmitted(&socket->stats);
                 reply(socket, MSG_FIN);
-                // create alarm to timeout
                 semaphore_V(socket->lock);
 
                 num_sent++;
-                timeout *= 2;
-
                 // wait for ack response or timeout signal
-                wait_for_transition(socket->close_state);
-                deregister_alarm(retry_alarm);
+                wait_for_transition_timeout(socket->close_state, timeout);
+                timeout *= 2;
                 break;
-            // received ack, considered closed
+            // received ack, considered closed; the socket may be freed
             case CLOSED:
                 check_last(socket);
-                wait_for_transition(socket->close_state);
                 return;
         }
     }
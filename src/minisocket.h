@@ -104,6 +104,36 @@ int minisocket_send(minisocket_t socket, minimsg_t msg, int len, minisocket_erro
  */
 int minisocket_receive(minisocket_t socket, minimsg_t msg, int max_len, minisocket_error *error);
 
+/*
+ * Receive without copying: blocks like minisocket_receive, then lends out
+ * the next packet of data as buf, with msg pointing at its unread data.
+ * The data stays valid until buf is returned with minimsg_release_buf.
+ *
+ * Return value: -1 in case of error and sets the error code, in which case
+ *           there is nothing to release, the number of bytes at msg
+ *           otherwise
+ */
+int minisocket_receive_buf(minisocket_t socket, minimsg_buf_t *buf, minimsg_t *msg, minisocket_error *error);
+
+/* Returns the memory held by packets received on the socket and not yet
+ * read, or -1 if the socket is invalid.
+ */
+int minisocket_buffered_bytes(minisocket_t socket);
+
+/* Copies the socket's counters into stats (see netstats.h): the packets
+ * sent and received on it, with their headers, data dropped as duplicate
+ * or out of order, and the SYN, SYNACK, data and FIN packets sent again
+ * after a timeout. Returns 0, or -1 if the socket is invalid.
+ */
+int minisocket_stats(minisocket_t socket, netstats_port_t *stats);
+
+/* Configures the transmit flow of the packets sent on a socket (see
+ * txsched.h): a rate limit, its weight against other flows and its queue
+ * limit, or the defaults if cfg is NULL. Returns the flow, for
+ * txsched_flow_stats, or -1 if the socket is invalid.
+ */
+int minisocket_set_tx_flow(minisocket_t socket, txsched_flow_t *cfg);
+
 /* Close a connection. If minisocket_close is issued, any send or receive should
  * fail.  As soon as the other side knows about the close, it should fail any
  * send or receive in progress. The minisocket is destroyed by minisocket_close
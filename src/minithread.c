@@ -22,6 +22,8 @@
 #include "read_private.h"
 #include "disk.h"
 #include "minifile.h"
+#include "random.h"
+#include "sim.h"
 
 #include <assert.h>
 #include <time.h>
@@ -42,6 +44,12 @@ struct minithread {
     thread_files_t files;
     stack_pointer_t base;
     stack_pointer_t top;
+    stack_pointer_t limit; // Highest address of the stack (initial top)
+    long run_ticks; // Clock ticks charged to the thread
+    long wakeups; // Number of times the thread was woken up
+    long ready_stamp; // When it was last woken, -1 once it has run
+    long wakeup_latency; // Nanoseconds between the last wakeup and running
+    int fp_used; // Keeps floating point values in registers
 };
 
 stack_pointer_t system_stack; // Stack pointer to the system thread
@@ -54,6 +62,8 @@ semaphore_t garbage; // Semaphore representing garbage needed to be collected
 int cur_id; // Current id (used to assign new ids)
 int quanta_passed; // The amount of quanta that has passed for current thread
 long time_ticks; // Current time in number of interrupt ticks
+random_state_t sched_random; // Generator used to pick the starting level
+int lazy_fp = 0; // Save FP state on interrupts only for threads that use it
 
 /*
  * Thread that garbage collects all the garbage in the zombie queue.
@@ -85,7 +95,7 @@ int reaper(int *arg) {
 int next_item(void **location) {
     int rng;
     int level;
-    rng = rand() % 100;
+    rng = genintrand_r(&sched_random, 100) - 1;
     // 50% for level 0, 25% for level 1, 15% for level 2, 10% for level 3
     if (rng < 50) {
         level = 0;
@@ -99,6 +109,20 @@ int next_item(void **location) {
     return multilevel_queue_dequeue(ready_queue, level, location);
 }
 
+/*
+ * Clock for scheduler accounting in nanoseconds. Uses virtual time in
+ * simulation mode so that the accounting replays too.
+ */
+long sched_clock() {
+    struct timespec ts;
+
+    if (sim_enabled) {
+        return time_ticks * PERIOD * MILLISECOND;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * SECOND + ts.tv_nsec;
+}
+
 /*
  * Function to get the next thread and switch to it
  * It is assumed that interrupts are already disabled when calling this function
@@ -110,6 +134,11 @@ void switch_next(stack_pointer_t *stack) {
     next_item(&next);
     cur_thread = (minithread_t) next;
     cur_thread->status = RUNNING;
+    // charge the time spent ready after a wakeup
+    if (cur_thread->ready_stamp != -1) {
+        cur_thread->wakeup_latency = sched_clock() - cur_thread->ready_stamp;
+        cur_thread->ready_stamp = -1;
+    }
     minithread_switch(stack, &(cur_thread->top));
 }
 
@@ -191,6 +220,12 @@ minithread_t minithread_create(proc_t proc, arg_t arg) {
 
     t->status = NEW;
     t->level = 0;
+    t->files = NULL;
+    t->run_ticks = 0;
+    t->wakeups = 0;
+    t->ready_stamp = -1;
+    t->wakeup_latency = 0;
+    t->fp_used = 0;
 
     if (cur_thread && use_existing_disk) {
         t->files = (thread_files_t) malloc (sizeof(struct thread_files));
@@ -209,6 +244,7 @@ minithread_t minithread_create(proc_t proc, arg_t arg) {
     }
 
     minithread_allocate_stack(&(t->base), &(t->top));
+    t->limit = t->top;
     minithread_initialize_stack(&(t->top), proc, arg, minithread_exit, NULL);
 
     return t;
@@ -228,6 +264,51 @@ int minithread_id() {
     return cur_thread->id;
 }
 
+/*
+ * Gets the address range of a thread's stack. Returns -1 for NULL.
+ */
+int minithread_stack_range(minithread_t t, stack_pointer_t *base, stack_pointer_t *limit) {
+    if ( !t ) return -1;
+    *base = t->base;
+    *limit = t->limit;
+    return 0;
+}
+
+/*
+ * Gets the scheduler accounting of a thread. Returns -1 for NULL.
+ */
+int minithread_sched_stats(minithread_t t, minithread_stats_t *stats) {
+    interrupt_level_t old_level;
+
+    if ( !t || !stats ) return -1;
+    old_level = set_interrupt_level(DISABLED);
+    stats->run_ticks = t->run_ticks;
+    stats->wakeups = t->wakeups;
+    stats->wakeup_latency = t->wakeup_latency;
+    set_interrupt_level(old_level);
+    return 0;
+}
+
+void minithread_set_lazy_fp(int enabled) {
+    lazy_fp = enabled;
+}
+
+/*
+ * Before the first minithread runs there is no thread to mark, and the
+ * system thread never needs its FP state saved
+ */
+void minithread_use_fp() {
+    if (cur_thread != NULL) cur_thread->fp_used = 1;
+}
+
+/*
+ * The system thread only idles, so it is always FP-clean
+ */
+int minithread_fp_live() {
+    if ( !lazy_fp ) return 1;
+    return cur_thread != NULL && cur_thread->fp_used;
+}
+
 /*
  * Makes a minithread runnable
  * Does not work on already READY or ZOMBIE threads
@@ -236,6 +317,11 @@ void minithread_start(minithread_t t) {
     interrupt_level_t old_level;
 
     if (t->status != READY && t->status != ZOMBIE) {
+        // a yield is not a wakeup
+        if (t->status != RUNNING) {
+            t->wakeups++;
+            t->ready_stamp = sched_clock();
+        }
         t->status = READY;
         t->level = 0;
         old_level = set_interrupt_level(DISABLED);
@@ -309,8 +395,10 @@ void clock_handler(void* arg) {
 
     time_ticks++;
     check_alarms();
+    semaphore_check_timeouts();
     // only deal with quanta logic when not in system thread
     if (cur_thread != NULL) {
+        cur_thread->run_ticks++;
         quanta_passed++;
         // if the thread used up all its quanta, demote its priority
         if (quanta_passed == (1 << cur_thread->level)) {
@@ -329,6 +417,25 @@ void clock_handler(void* arg) {
     set_interrupt_level(old_level);
 }
 
+/*
+ * Idle loop for simulation mode, which has no clock interrupt. Virtual time
+ * only passes while no thread is ready: each pass advances it by one tick,
+ * fires the alarms and device events that became due, and runs whatever
+ * they made ready.
+ */
+void sim_idle() {
+    while (1) {
+        set_interrupt_level(DISABLED);
+        time_ticks++;
+        check_alarms();
+        semaphore_check_timeouts();
+        sim_deliver(time_ticks);
+        if (multilevel_queue_length(ready_queue) > 0) {
+            switch_next(&system_stack);
+        }
+    }
+}
+
 /*
  * Interrupt handler to handle receiving packets
  * Does nothing if either source or destination ports are invalid port numbers
@@ -397,8 +504,8 @@ void minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
     }
     install_disk_handler(disk_handler);
     minifile_initialize();
-    // Use time to seed the random function
-    srand(time(NULL));
+    // Use time to seed the scheduler, unless the run must be reproducible
+    sgenrand_r(&sched_random, sim_seed(SIM_STREAM_SCHEDULER, time(NULL)));
     // Initialize globals
     ready_queue = multilevel_queue_new(LEVELS);
     zombie_queue = queue_new();
@@ -416,8 +523,10 @@ void minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
     cur_thread = minithread_create(init_blocks, NULL);
     // Disable interrupts for first switch
     old_level = set_interrupt_level(DISABLED);
-    // Initialize clock
-    minithread_clock_init(PERIOD * MILLISECOND, clock_handler);
+    // Initialize clock; simulation mode keeps virtual time in the idle loop
+    if (!sim_enabled) {
+        minithread_clock_init(PERIOD * MILLISECOND, clock_handler);
+    }
     // Initialize network
     network_initialize(network_handler);
     miniroute_initialize();
@@ -427,5 +536,8 @@ void minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
     // Switch into our first thread
     minithread_switch(&system_stack, &(cur_thread->top));
     // Idles
+    if (sim_enabled) {
+        sim_idle();
+    }
     while (1);
 }
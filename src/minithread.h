@@ -64,6 +64,71 @@ extern minithread_t minithread_self();
 extern int minithread_id();
 
 
+/*
+ * int minithread_stack_range(minithread_t t, stack_pointer_t *base,
+ *                            stack_pointer_t *limit)
+ *      Return the lowest and highest addresses of t's stack, for
+ *      debugging and profiling. Returns 0 on success, -1 if t is NULL.
+ */
+extern int minithread_stack_range(minithread_t t, stack_pointer_t *base,
+                                  stack_pointer_t *limit);
+
+/*
+ * Scheduler accounting for a thread.
+ */
+typedef struct minithread_stats {
+    long run_ticks; // Clock ticks the thread was running for
+    long wakeups; // Times the thread was started or woken after blocking
+    long wakeup_latency; // Nanoseconds from the last wakeup to running
+} minithread_stats_t;
+
+/*
+ * int minithread_sched_stats(minithread_t t, minithread_stats_t *stats)
+ *      Fill in the scheduler accounting of t. Returns 0 on success, -1 if
+ *      t is NULL.
+ */
+extern int minithread_sched_stats(minithread_t t, minithread_stats_t *stats);
+
+/*
+ * long sched_clock()
+ *      Nanoseconds on the clock used for scheduler accounting (virtual time
+ *      in simulation mode).
+ */
+extern long sched_clock();
+
+/*
+ * Lazy floating point state.
+ *
+ * Every interrupt that is taken saves the floating point and SSE registers
+ * of the interrupted thread on its stack, and restores them when the thread
+ * resumes. With lazy FP enabled, that is done only for threads that have
+ * called minithread_use_fp; the others are taken to be FP-clean, holding
+ * no floating point values in registers, and their interrupts skip both
+ * the copy and the restore. Context switches never save these registers,
+ * since the calling convention does not preserve them across a call.
+ *
+ * A thread that uses floating point without calling minithread_use_fp can
+ * have its registers clobbered by interrupt handlers while lazy FP is on.
+ * The library marks the calling thread itself wherever it computes with
+ * doubles: synthetic loss and duplication in the network layer, netem and
+ * the transmit scheduler. Any other floating point, including printing
+ * it, is up to the caller to declare.
+ */
+extern void minithread_set_lazy_fp(int enabled);
+
+/*
+ * minithread_use_fp()
+ *      Mark the calling thread as using floating point, for good.
+ */
+extern void minithread_use_fp();
+
+/*
+ * int minithread_fp_live()
+ *      Whether the interrupted thread's floating point registers must be
+ *      saved. Called by the interrupt handler.
+ */
+extern int minithread_fp_live();
+
 /*
  * minithread_stop()
  *  Block the calling thread.
@@ -0,0 +1,32 @@
+/*
+ * Compiles a broadcast topology into the binary format (see topology.h),
+ * resolving its host names once so that the network layer starts without
+ * resolving them again:
+ *
+ *      ./mktopo [<text file> [<binary file>]]
+ *
+ * which defaults to topology.txt and topology.bin. The network layer reads
+ * the binary file instead of the text file as long as it is not older.
+ */
+#include "network.h"
+#include "topology.h"
+
+#include <stdio.h>
+
+int main(int argc, char** argv) {
+    char* text = argc > 1 ? argv[1] : BCAST_TOPOLOGY_FILE;
+    char* binary = argc > 2 ? argv[2] : BCAST_TOPOLOGY_BINARY;
+    topology_t t;
+
+    t = topology_load(text);
+    if (t == NULL)
+        return 1;
+    if (topology_save(t, binary) == -1) {
+        printf("Error: cannot write %s.\n", binary);
+        topology_destroy(t);
+        return 1;
+    }
+    printf("%s: %d nodes\n", binary, topology_nodes(t));
+    topology_destroy(t);
+    return 0;
+}
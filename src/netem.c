@@ -0,0 +1,452 @@
+/*
+ * Network emulation: per destination delay, jitter, bandwidth, queue limits
+ * and reordering, with a timed queue of held packets.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "defs.h"
+#include "netem.h"
+#include "interrupts.h"
+#include "minithread.h"
+#include "devpoll.h"
+#include "random.h"
+#include "sim.h"
+#include "uthash.h"
+
+#define NETEM_MAX_LINE_LEN 256
+#define NETEM_TICK (1 * MILLISECOND) // Release granularity in real mode
+#define PARETO_SHAPE 3.0
+
+struct link {
+    unsigned int ip; // Destination, by IP address like the simulator
+    int active;
+    netem_link_t cfg;
+    double tokens; // Bucket contents at tb_time
+    long tb_time; // When the link is done sending what it has been given
+    long last_deliver; // Delivery time of the latest packet kept in order
+    int held; // Packets of this link in the emulator
+    UT_hash_handle hh;
+};
+
+typedef struct held {
+    long deliver; // ns
+    long seq; // Orders packets due at the same time
+    struct link *link;
+    network_address_t dest;
+    int len;
+    char buf[];
+} *held_t;
+
+/*
+ * The virtual processor queues packets, with interrupts disabled, and the
+ * device poller releases them, so all of this is under a lock.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct link *links; // By ip, never freed since packets refer to them
+static netem_link_t default_link;
+static int has_default;
+static int emulating; // Some link is configured
+
+static held_t *heap; // Min heap on (deliver, seq)
+static int heap_size;
+static int heap_cap;
+static long next_seq;
+
+static netem_release_t release_fn;
+static int timer_started;
+static int timer_fd;
+static int timer_armed; // Only while packets are held
+static random_state_t netem_random;
+static netem_stats_t stats;
+
+/* Current time in ns, virtual in simulation mode */
+static long now() {
+    struct timespec ts;
+
+    if (sim_enabled)
+        return time_ticks * PERIOD * MILLISECOND;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * SECOND + ts.tv_nsec;
+}
+
+static int earlier(held_t a, held_t b) {
+    return a->deliver < b->deliver ||
+           (a->deliver == b->deliver && a->seq < b->seq);
+}
+
+static int heap_push(held_t h) {
+    held_t *grown;
+    int i;
+
+    if (heap_size == heap_cap) {
+        grown = (held_t *) realloc(heap, (heap_cap * 2 + 16) * sizeof(held_t));
+        if ( !grown ) return -1;
+        heap = grown;
+        heap_cap = heap_cap * 2 + 16;
+    }
+    for (i = heap_size++; i > 0 && earlier(h, heap[(i - 1) / 2]); i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = h;
+    return 0;
+}
+
+static held_t heap_pop() {
+    held_t top = heap[0];
+    held_t last = heap[--heap_size];
+    int i = 0;
+    int child;
+
+    while ((child = 2 * i + 1) < heap_size) {
+        if (child + 1 < heap_size && earlier(heap[child + 1], heap[child]))
+            child++;
+        if ( !earlier(heap[child], last) ) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static struct link *find_link(unsigned int ip) {
+    struct link *l;
+
+    HASH_FIND_INT( links, &ip, l );
+    return l;
+}
+
+/* Returns the new link, or NULL if memory runs out */
+static struct link *new_link(unsigned int ip, netem_link_t *cfg) {
+    struct link *l = (struct link *) malloc(sizeof(struct link));
+
+    if ( !l ) return NULL;
+    memset(l, 0, sizeof(struct link));
+    l->active = 1;
+    l->ip = ip;
+    l->cfg = *cfg;
+    l->tokens = cfg->burst;
+    HASH_ADD_INT( links, ip, l );
+    return l;
+}
+
+/* Called with the lock held, once the timer is started */
+static void arm_timer(int on) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_value.tv_nsec = NETEM_TICK;
+        its.it_interval = its.it_value;
+    }
+    AbortOnCondition(timerfd_settime(timer_fd, 0, &its, NULL) == -1,
+                     "timerfd_settime");
+    timer_armed = on;
+}
+
+/* Called with the lock held */
+static void release_held(held_t h) {
+    h->link->held--;
+    stats.released++;
+    stats.depth--;
+}
+
+/*
+ * Device poller: send whatever is due. The lock is dropped around each
+ * send. The timer stops once nothing is held, so an idle emulator does not
+ * wake the poller.
+ */
+static void netem_tick(int fd, void *arg) {
+    unsigned long expirations;
+    held_t h;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        if (heap_size == 0 || heap[0]->deliver > now()) {
+            if (heap_size == 0 && timer_armed) arm_timer(0);
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        h = heap_pop();
+        release_held(h);
+        pthread_mutex_unlock(&lock);
+
+        release_fn(h->dest, h->buf, h->len);
+        free(h);
+    }
+}
+
+/* Simulation mode: the packet's event came due */
+static void sim_release(void *arg) {
+    held_t h = (held_t) arg;
+
+    pthread_mutex_lock(&lock);
+    release_held(h);
+    pthread_mutex_unlock(&lock);
+
+    release_fn(h->dest, h->buf, h->len);
+    free(h);
+}
+
+/* Called with the lock held */
+static void start_timer() {
+    if (timer_started || sim_enabled || !release_fn || !emulating) return;
+
+    timer_fd = devpoll_timer(devpoll_system(), NETEM_TICK, netem_tick, NULL);
+    AbortOnCondition(timer_fd == -1, "devpoll_timer");
+    timer_started = 1;
+    arm_timer(heap_size > 0);
+}
+
+/* Jitter in ns, drawn with the lock held */
+static long jitter(netem_link_t *cfg) {
+    double u;
+    double v;
+    double j = (double) cfg->jitter * MILLISECOND;
+
+    if (cfg->jitter == 0) return 0;
+
+    u = genrand_r(&netem_random);
+    switch (cfg->dist) {
+        case NETEM_NORMAL:
+            v = genrand_r(&netem_random);
+            if (u < 1e-12) u = 1e-12;
+            return (long) (j * sqrt(-2.0 * log(u)) * cos(2 * M_PI * v));
+        case NETEM_PARETO: // Heavy tailed, non-negative, mean of j
+            return (long) (j * (PARETO_SHAPE - 1) *
+                           (pow(1.0 - u, -1.0 / PARETO_SHAPE) - 1.0));
+        default:
+            return (long) (j * (2.0 * u - 1.0));
+    }
+}
+
+void netem_set_link(network_address_t dest, netem_link_t *link) {
+    interrupt_level_t old_level;
+    struct link *l;
+
+    minithread_use_fp(); // Token buckets are doubles
+    old_level = set_interrupt_level(DISABLED);
+    pthread_mutex_lock(&lock);
+    if (dest == NULL) {
+        if (link) default_link = *link;
+        has_default = link != NULL;
+    } else {
+        l = find_link(dest[0]);
+        if (l && link) {
+            l->cfg = *link;
+            l->active = 1;
+        } else if (l) {
+            l->active = 0; // Kept, in case packets still refer to it
+        } else if (link) {
+            AbortOnCondition(new_link(dest[0], link) == NULL,
+                             "Error: out of memory for emulated links.");
+        }
+    }
+    if (link) emulating = 1;
+    start_timer();
+    pthread_mutex_unlock(&lock);
+    set_interrupt_level(old_level);
+}
+
+int netem_active(network_address_t dest) {
+    interrupt_level_t old_level;
+    struct link *l;
+    int active;
+
+    if ( !emulating ) return 0;
+
+    old_level = set_interrupt_level(DISABLED);
+    pthread_mutex_lock(&lock);
+    l = find_link(dest[0]);
+    active = l ? l->active : has_default;
+    pthread_mutex_unlock(&lock);
+    set_interrupt_level(old_level);
+    return active;
+}
+
+int netem_send(network_address_t dest, struct iovec *iov, int iovcnt,
+               int len) {
+    interrupt_level_t old_level;
+    struct link *l;
+    held_t h;
+    long t;
+    long depart;
+    double bytes_per_ns;
+    int off;
+    int i;
+
+    minithread_use_fp(); // Jitter, reordering and the token bucket
+    h = (held_t) malloc(sizeof(struct held) + len);
+    if ( !h ) return -1;
+    for (off = 0, i = 0; i < iovcnt; i++) {
+        memcpy(h->buf + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    h->len = len;
+    network_address_copy(dest, h->dest);
+
+    old_level = set_interrupt_level(DISABLED);
+    pthread_mutex_lock(&lock);
+
+    l = find_link(dest[0]);
+    if ( !l && has_default ) l = new_link(dest[0], &default_link);
+    if ( !l ) {
+        pthread_mutex_unlock(&lock);
+        set_interrupt_level(old_level);
+        free(h);
+        return -1;
+    }
+
+    // Tail drop
+    if (l->cfg.limit > 0 && l->held >= l->cfg.limit) {
+        stats.dropped++;
+        pthread_mutex_unlock(&lock);
+        set_interrupt_level(old_level);
+        free(h);
+        return len;
+    }
+
+    // Token bucket: leave once the bucket holds the packet
+    t = now();
+    depart = t;
+    if (l->cfg.rate > 0) {
+        bytes_per_ns = l->cfg.rate * 1000.0 / SECOND;
+        if (t > l->tb_time) {
+            l->tokens += (t - l->tb_time) * bytes_per_ns;
+            if (l->tokens > l->cfg.burst) l->tokens = l->cfg.burst;
+            l->tb_time = t;
+        }
+        depart = l->tb_time;
+        if (l->tokens >= len) {
+            l->tokens -= len;
+        } else {
+            depart += (long) ((len - l->tokens) / bytes_per_ns);
+            l->tokens = 0;
+            l->tb_time = depart;
+        }
+    }
+
+    // Propagation, in order unless reordered
+    if (l->cfg.reorder > 0 && genrand_r(&netem_random) < l->cfg.reorder) {
+        h->deliver = depart;
+        stats.reordered++;
+    } else {
+        h->deliver = depart + (long) l->cfg.delay * MILLISECOND + jitter(&l->cfg);
+        if (h->deliver < depart) h->deliver = depart;
+        if (h->deliver < l->last_deliver) h->deliver = l->last_deliver;
+        l->last_deliver = h->deliver;
+    }
+    h->seq = next_seq++;
+    h->link = l;
+
+    if (sim_enabled) {
+        i = sim_schedule((h->deliver - t + MILLISECOND - 1) / MILLISECOND,
+                         sim_release, h);
+    } else {
+        i = heap_push(h);
+    }
+    if (i == -1) {
+        pthread_mutex_unlock(&lock);
+        set_interrupt_level(old_level);
+        free(h);
+        return -1;
+    }
+    if (timer_started && !timer_armed) arm_timer(1);
+    l->held++;
+    stats.queued++;
+    if (++stats.depth > stats.max_depth) stats.max_depth = stats.depth;
+
+    pthread_mutex_unlock(&lock);
+    set_interrupt_level(old_level);
+    return len;
+}
+
+void netem_stats(netem_stats_t *out) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+    set_interrupt_level(old_level);
+}
+
+/*
+ * Parses "key=value ..." settings into link. Returns 0, or -1 on an
+ * unknown key.
+ */
+static int parse_settings(char *settings, netem_link_t *link) {
+    char *tok;
+    char *value;
+
+    memset(link, 0, sizeof(netem_link_t));
+    link->burst = network_mtu();
+
+    for (tok = strtok(settings, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        value = strchr(tok, '=');
+        if ( !value ) return -1;
+        *value++ = '\0';
+        if (strcmp(tok, "delay") == 0) link->delay = atoi(value);
+        else if (strcmp(tok, "jitter") == 0) link->jitter = atoi(value);
+        else if (strcmp(tok, "rate") == 0) link->rate = atoi(value);
+        else if (strcmp(tok, "burst") == 0) link->burst = atoi(value);
+        else if (strcmp(tok, "limit") == 0) link->limit = atoi(value);
+        else if (strcmp(tok, "reorder") == 0) link->reorder = atof(value);
+        else if (strcmp(tok, "dist") == 0) {
+            if (strcmp(value, "uniform") == 0) link->dist = NETEM_UNIFORM;
+            else if (strcmp(value, "normal") == 0) link->dist = NETEM_NORMAL;
+            else if (strcmp(value, "pareto") == 0) link->dist = NETEM_PARETO;
+            else return -1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void netem_initialize(char *configfile, netem_release_t release) {
+    FILE *config;
+    char line[NETEM_MAX_LINE_LEN];
+    char host[NETEM_MAX_LINE_LEN];
+    network_address_t addr;
+    netem_link_t link;
+    int skip;
+
+    sgenrand_r(&netem_random, sim_seed(SIM_STREAM_NETEM, 4357));
+
+    pthread_mutex_lock(&lock);
+    release_fn = release;
+    pthread_mutex_unlock(&lock);
+
+    config = fopen(configfile, "r");
+    if (config != NULL) {
+        while (fgets(line, NETEM_MAX_LINE_LEN, config) != NULL) {
+            if (sscanf(line, " %s %n", host, &skip) != 1 || host[0] == '#')
+                continue;
+            if (parse_settings(line + skip, &link) == -1) {
+                kprintf("Error: bad settings for %s in %s.\n", host, configfile);
+                AbortOnCondition(1, "Crashing.");
+            }
+            if (strcmp(host, "default") == 0) {
+                netem_set_link(NULL, &link);
+            } else if (network_translate_hostname(host, addr) == 0) {
+                netem_set_link(addr, &link);
+            } else {
+                kprintf("Error: could not resolve hostname %s.\n", host);
+                AbortOnCondition(1, "Crashing.");
+            }
+        }
+        fclose(config);
+    }
+
+    pthread_mutex_lock(&lock);
+    start_timer();
+    pthread_mutex_unlock(&lock);
+}
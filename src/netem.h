@@ -0,0 +1,91 @@
+/*
+ * netem.h:
+ *      Network emulation.
+ *
+ *      Packets sent to an emulated destination do not go out right away.
+ *      Each destination is a link with a one-way delay, jitter drawn from a
+ *      distribution, a token bucket bandwidth cap, a queue limit beyond
+ *      which packets are tail dropped, and a reordering probability. The
+ *      emulator works out when each packet is delivered, holds a copy in a
+ *      timed queue and releases packets in order of their delivery time.
+ *
+ *      Links are configured from NETEM_CONFIG_FILE, next to the topology
+ *      file, one line per destination host, or "default" for any other:
+ *
+ *          # host   settings
+ *          default  delay=20 jitter=5 dist=normal
+ *          csug09   delay=40 rate=1000 burst=3000 limit=32 reorder=0.1
+ *
+ *      delay and jitter are in milliseconds, rate in kilobytes per second
+ *      (0 is unlimited), burst in bytes, limit in packets (0 is unlimited)
+ *      and reorder a probability. dist is uniform, normal or pareto. A
+ *      reordered packet is delivered as soon as it clears the bucket,
+ *      without delay or jitter, overtaking the packets ahead of it; all
+ *      others leave a link in the order they were sent.
+ *
+ *      Without the file nothing is emulated. In simulation mode delivery
+ *      times are rounded up to whole clock ticks.
+ */
+#ifndef __NETEM_H__
+#define __NETEM_H__
+
+#include <sys/uio.h>
+#include "network.h"
+
+#define NETEM_CONFIG_FILE "netem.txt"
+
+enum netem_dist { NETEM_UNIFORM = 0, NETEM_NORMAL, NETEM_PARETO };
+
+typedef struct netem_link {
+    int delay; /* ms */
+    int jitter; /* ms */
+    enum netem_dist dist;
+    int rate; /* kilobytes per second, 0 for no cap */
+    int burst; /* bytes */
+    int limit; /* packets queued on the link, 0 for no limit */
+    double reorder; /* probability */
+} netem_link_t;
+
+/*
+ * Sends a packet that is due, by the time it is released. Runs on the
+ * device poller in real mode and as a simulated interrupt in simulation
+ * mode.
+ */
+typedef void (*netem_release_t)(network_address_t dest, char *buf, int len);
+
+/*
+ * Read the link configuration from configfile, if it exists, and start
+ * releasing packets through release. Called by network_initialize.
+ */
+extern void netem_initialize(char *configfile, netem_release_t release);
+
+/*
+ * Emulate the link to dest with the given settings, or stop emulating it
+ * if link is NULL. A NULL dest sets the default link.
+ */
+extern void netem_set_link(network_address_t dest, netem_link_t *link);
+
+/*
+ * Returns 1 if packets to dest are emulated.
+ */
+extern int netem_active(network_address_t dest);
+
+/*
+ * Queue a packet to dest for release by the emulator. Returns the bytes
+ * sent, which includes packets the link drops, or -1 on failure.
+ */
+extern int netem_send(network_address_t dest, struct iovec *iov, int iovcnt,
+                      int len);
+
+typedef struct netem_stats {
+    long queued; /* packets accepted by a link */
+    long dropped; /* packets tail dropped */
+    long reordered; /* packets sent ahead of the queue */
+    long released; /* packets released */
+    int depth; /* packets held now */
+    int max_depth;
+} netem_stats_t;
+
+extern void netem_stats(netem_stats_t *stats);
+
+#endif /*__NETEM_H__*/
@@ -0,0 +1,112 @@
+/*
+ * Network counters.
+ */
+#include <string.h>
+
+#include "netstats.h"
+
+#define COUNT(counter, n) __sync_fetch_and_add(&(counter), (n))
+#define READ(counter) __sync_fetch_and_add(&(counter), 0)
+
+static char *protocol_names[NETSTATS_PROTOCOLS] =
+    { "minimsg", "minisocket", "route data", "discovery", "reply" };
+
+static char *drop_names[NETSTATS_DROP_REASONS] =
+    { "invalid", "bad port", "no socket", "duplicate", "ttl", "no route" };
+
+static netstats_t stats;
+
+void netstats_sent(int protocol, int bytes) {
+    COUNT(stats.sent[protocol].packets, 1);
+    COUNT(stats.sent[protocol].bytes, bytes);
+}
+
+void netstats_received(int protocol, int bytes) {
+    COUNT(stats.received[protocol].packets, 1);
+    COUNT(stats.received[protocol].bytes, bytes);
+}
+
+void netstats_dropped(int reason) {
+    COUNT(stats.dropped[reason], 1);
+}
+
+void netstats_retransmitted() {
+    COUNT(stats.retransmissions, 1);
+}
+
+void netstats_flooded() {
+    COUNT(stats.floods, 1);
+}
+
+void netstats_port_sent(netstats_port_t *port, int protocol, int bytes) {
+    COUNT(port->sent.packets, 1);
+    COUNT(port->sent.bytes, bytes);
+    netstats_sent(protocol, bytes);
+}
+
+void netstats_port_received(netstats_port_t *port, int protocol, int bytes) {
+    COUNT(port->received.packets, 1);
+    COUNT(port->received.bytes, bytes);
+    netstats_received(protocol, bytes);
+}
+
+void netstats_port_dropped(netstats_port_t *port, int reason) {
+    COUNT(port->dropped, 1);
+    netstats_dropped(reason);
+}
+
+void netstats_port_retransmitted(netstats_port_t *port) {
+    COUNT(port->retransmissions, 1);
+    netstats_retransmitted();
+}
+
+void netstats_snapshot(netstats_t *s) {
+    int i;
+
+    for (i = 0; i < NETSTATS_PROTOCOLS; i++) {
+        s->sent[i].packets = READ(stats.sent[i].packets);
+        s->sent[i].bytes = READ(stats.sent[i].bytes);
+        s->received[i].packets = READ(stats.received[i].packets);
+        s->received[i].bytes = READ(stats.received[i].bytes);
+    }
+    for (i = 0; i < NETSTATS_DROP_REASONS; i++) {
+        s->dropped[i] = READ(stats.dropped[i]);
+    }
+    s->retransmissions = READ(stats.retransmissions);
+    s->floods = READ(stats.floods);
+}
+
+void netstats_port_snapshot(netstats_port_t *port, netstats_port_t *s) {
+    s->sent.packets = READ(port->sent.packets);
+    s->sent.bytes = READ(port->sent.bytes);
+    s->received.packets = READ(port->received.packets);
+    s->received.bytes = READ(port->received.bytes);
+    s->dropped = READ(port->dropped);
+    s->retransmissions = READ(port->retransmissions);
+}
+
+void netstats_reset() {
+    memset(&stats, 0, sizeof(stats));
+    __sync_synchronize();
+}
+
+void netstats_report(FILE *out) {
+    netstats_t s;
+    int i;
+
+    netstats_snapshot(&s);
+    fprintf(out, "%-12s %10s %12s %10s %12s\n", "protocol", "sent", "bytes",
+            "received", "bytes");
+    for (i = 0; i < NETSTATS_PROTOCOLS; i++) {
+        fprintf(out, "%-12s %10ld %12ld %10ld %12ld\n", protocol_names[i],
+                s.sent[i].packets, s.sent[i].bytes, s.received[i].packets,
+                s.received[i].bytes);
+    }
+    fprintf(out, "dropped:");
+    for (i = 0; i < NETSTATS_DROP_REASONS; i++) {
+        fprintf(out, " %s %ld%s", drop_names[i], s.dropped[i],
+                i < NETSTATS_DROP_REASONS - 1 ? "," : "\n");
+    }
+    fprintf(out, "retransmissions %ld, discovery floods %ld\n",
+            s.retransmissions, s.floods);
+}
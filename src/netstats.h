@@ -0,0 +1,97 @@
+/*
+ * netstats.h:
+ *      Network counters.
+ *
+ *      Packets and bytes sent and received by each protocol: minimsg and
+ *      minisocket packets at their own layer, and each routing packet type
+ *      at miniroute's, where a packet forwarded for another host counts as
+ *      received and sent again. A broadcast counts once, however many
+ *      links it goes out on. Packets dropped are counted by reason, along
+ *      with minisocket retransmissions and the route discovery floods
+ *      this host starts.
+ *
+ *      Each miniport and minisocket also keeps its own counters; see
+ *      miniport_stats and minisocket_stats.
+ *
+ *      Counters are bumped with atomic adds, so any thread may count, and
+ *      read one at a time: a snapshot taken while packets flow need not
+ *      add up exactly.
+ */
+#ifndef __NETSTATS_H__
+#define __NETSTATS_H__
+
+#include <stdio.h>
+
+enum netstats_protocol {
+    NETSTATS_MINIDATAGRAM = 0,
+    NETSTATS_MINISTREAM,
+    NETSTATS_ROUTING_DATA, /* + routing_packet_type */
+    NETSTATS_ROUTING_DISCOVERY,
+    NETSTATS_ROUTING_REPLY,
+    NETSTATS_PROTOCOLS
+};
+
+enum netstats_drop {
+    NETSTATS_DROP_INVALID = 0, /* failed a sanity check, sent or received */
+    NETSTATS_DROP_BAD_PORT, /* minimsg to a port not listening */
+    NETSTATS_DROP_NO_SOCKET, /* minisocket packet for no open socket */
+    NETSTATS_DROP_DUPLICATE, /* minisocket data out of order or seen */
+    NETSTATS_DROP_TTL, /* route too long for the time to live */
+    NETSTATS_DROP_NO_ROUTE, /* route discovery failed */
+    NETSTATS_DROP_REASONS
+};
+
+typedef struct netstats_count {
+    long packets;
+    long bytes;
+} netstats_count_t;
+
+typedef struct netstats {
+    netstats_count_t sent[NETSTATS_PROTOCOLS];
+    netstats_count_t received[NETSTATS_PROTOCOLS];
+    long dropped[NETSTATS_DROP_REASONS];
+    long retransmissions;
+    long floods;
+} netstats_t;
+
+/* counters of one miniport or minisocket */
+typedef struct netstats_port {
+    netstats_count_t sent;
+    netstats_count_t received;
+    long dropped;
+    long retransmissions;
+} netstats_port_t;
+
+extern void netstats_sent(int protocol, int bytes);
+extern void netstats_received(int protocol, int bytes);
+extern void netstats_dropped(int reason);
+extern void netstats_retransmitted();
+extern void netstats_flooded();
+
+/*
+ * Count on a port's counters as well as the protocol's.
+ */
+extern void netstats_port_sent(netstats_port_t *port, int protocol, int bytes);
+extern void netstats_port_received(netstats_port_t *port, int protocol,
+                                   int bytes);
+extern void netstats_port_dropped(netstats_port_t *port, int reason);
+extern void netstats_port_retransmitted(netstats_port_t *port);
+
+/*
+ * Copy the counters into stats.
+ */
+extern void netstats_snapshot(netstats_t *stats);
+extern void netstats_port_snapshot(netstats_port_t *port,
+                                   netstats_port_t *stats);
+
+/*
+ * Zero the protocol counters; ports keep theirs.
+ */
+extern void netstats_reset();
+
+/*
+ * Print the counters.
+ */
+extern void netstats_report(FILE *out);
+
+#endif /*__NETSTATS_H__*/
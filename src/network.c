@@ -3,26 +3,35 @@
  *      This module paints the unix socket interface a pretty color.
  */
 
+#define _GNU_SOURCE /* recvmmsg */
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "defs.h"
 #include "network.h"
 #include "interrupts_private.h"
+#include "devpoll.h"
 #include "minithread.h"
 #include "random.h"
+#include "sim.h"
+#include "netem.h"
+#include "capture.h"
+#include "netstats.h"
+#include "txsched.h"
+#include "topology.h"
 
 
-#define BCAST_MAX_LINE_LEN 128
-#define BCAST_MAX_ENTRIES 64
 #define BCAST_MAX_NAME_LEN 64
 
 #define MINIMSG_PORT 8086
@@ -33,21 +42,23 @@
 *  Private types and functions                                                 *
 *******************************************************************************/
 
-typedef struct {
-  char name[BCAST_MAX_NAME_LEN];
-  network_address_t addr;
-  int links[BCAST_MAX_ENTRIES];
-  int n_links;
-} bcast_entry_t;
-
-typedef struct {
-  int n_entries;
-  bcast_entry_t entries[BCAST_MAX_ENTRIES];
-  int me;
-} bcast_t;
-
+/*
+ * The broadcast topology and our node in it. Broadcasts go out to the
+ * fanout, the addresses of our node's links, which is rebuilt whenever
+ * they change. A broadcast holds a reference to the fanout it started
+ * with, so that it may be replaced under it. All three are only touched
+ * with interrupts disabled.
+ */
+typedef struct bcast_fanout {
+  int refs;
+  int n;
+  network_address_t self;
+  network_address_t neighbors[];
+}* bcast_fanout_t;
 
-bcast_t topology;
+static topology_t topology;
+static int topology_me;
+static bcast_fanout_t fanout;
 
 short my_udp_port = MINIMSG_PORT;
 short other_udp_port = MINIMSG_PORT;
@@ -58,16 +69,80 @@ int synthetic_network = 0;
 
 
 struct address_info {
-  int sock;
   struct sockaddr_in sin;
-  char pkt[MAX_NETWORK_PKT_SIZE];
 };
 
 struct address_info if_info;
 static network_address_t broadcast_addr = { 0 };
 
+/* generator behind synthetic loss and duplication */
+static random_state_t network_random;
+
+/* our own address, the only reachable one in simulation mode */
+static network_address_t sim_my_addr;
+
+/*
+ * A receive queue: a socket, the poller that reads it and the ring that
+ * carries its packets to the virtual processor. With more than one queue
+ * the sockets share the port through SO_REUSEPORT, and the kernel spreads
+ * flows over them by address and port hash.
+ */
+#define NETWORK_RING_SIZE 1024
+struct net_queue {
+  int sock;
+  devpoll_t poller;
+  interrupt_ring_t ring;
+  network_interrupt_arg_t* recv_pkts[MAX_NETWORK_RECV_BATCH]; /* spares */
+};
+
+static struct net_queue queues[MAX_NETWORK_QUEUES];
+static int n_queues = 1;
+
+/* set by network_initialize, after which the queues are fixed */
+static int network_initialized;
+
+/*
+ * packets we send ourselves, posted by the virtual processor, those the
+ * emulator releases to us, posted by the device poller, and those the
+ * transmit scheduler releases, posted by its thread
+ */
+static interrupt_ring_t loopback_ring;
+static interrupt_ring_t netem_ring;
+static interrupt_ring_t txsched_ring;
+
+/* sorts received packets into priorities, see network_set_classifier */
+static network_classifier_t classifier;
+static int control_weight = NETWORK_RX_CONTROL_WEIGHT;
+
+/*
+ * Packet pools, one per buffer size. The device poller takes packets and the
+ * virtual processor returns them, so the pools are locked; the virtual
+ * processor also keeps interrupts disabled, so that no other minithread can
+ * run into the lock while it is held. A free packet is linked through its
+ * buffer.
+ */
+static int class_size[NETWORK_PKT_CLASSES] = /* the last is the MTU */
+  { 256, 2048, MAX_NETWORK_PKT_SIZE };
+static const int class_pool_max[NETWORK_PKT_CLASSES] = /* free packets kept */
+  { 4096, 512, 128 };
+#define MTU_CLASS (NETWORK_PKT_CLASSES - 1)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static network_interrupt_arg_t* pool[NETWORK_PKT_CLASSES];
+static int pool_free[NETWORK_PKT_CLASSES];
+
+#define POOL_NEXT(pkt) (*(network_interrupt_arg_t **) (pkt)->buffer)
+#define CLASS_BYTES(c) \
+  ((int) (offsetof(network_interrupt_arg_t, buffer) + class_size[c]))
+
+static int mtu = MAX_NETWORK_PKT_SIZE;
+
+/* receiver state */
+static int recv_batch = 32;
+static network_recv_stats_t recv_stats;
+
 /* forward definition */
-void start_network_poll(interrupt_handler_t, int*);
+void start_network_poll(interrupt_handler_t);
 void network_address_to_sockaddr(network_address_t addr, struct sockaddr_in* sin);
 void sockaddr_to_network_address(struct sockaddr_in* sin, network_address_t addr);
 
@@ -96,68 +171,729 @@ network_printaddr(network_address_t addr) {
   printf("%s", name);
 }
 
+/* the smallest buffer size that holds size bytes */
 static int
-send_pkt(network_address_t dest_address,
-         int hdr_len, char* hdr,
-         int data_len, char* data) {
-  int cc;
+size_class(int size) {
+  int c;
+
+  for (c = 0; c < MTU_CLASS; c++)
+    if (size <= class_size[c])
+      break;
+  return c;
+}
+
+/*
+ * Take a packet that holds size bytes from the pool, or from the host if the
+ * pool is empty. On the virtual processor, call with interrupts disabled.
+ */
+static network_interrupt_arg_t*
+network_alloc_pkt(int size) {
+  network_interrupt_arg_t* pkt;
+  int c = size_class(size);
+
+  pthread_mutex_lock(&pool_lock);
+  pkt = pool[c];
+  if (pkt != NULL) {
+    pool[c] = POOL_NEXT(pkt);
+    pool_free[c]--;
+    recv_stats.pool_reuses++;
+  } else {
+    recv_stats.pool_allocs++;
+  }
+  recv_stats.class_packets[c]++;
+  pthread_mutex_unlock(&pool_lock);
+
+  if (pkt == NULL) {
+    pkt = (network_interrupt_arg_t *) malloc(CLASS_BYTES(c));
+    if (pkt == NULL)
+      return NULL;
+  }
+  pkt->size_class = c;
+  pkt->head = 0;
+  pkt->refs = 1;
+  return pkt;
+}
+
+void
+network_free_pkt(network_interrupt_arg_t* pkt) {
+  interrupt_level_t old_level;
+  int c;
+
+  if (pkt == NULL)
+    return;
+
+  c = pkt->size_class;
+  old_level = set_interrupt_level(DISABLED);
+  if (--pkt->refs > 0) {
+    set_interrupt_level(old_level);
+    return;
+  }
+  pthread_mutex_lock(&pool_lock);
+  if (pool_free[c] < class_pool_max[c]) {
+    POOL_NEXT(pkt) = pool[c];
+    pool[c] = pkt;
+    pool_free[c]++;
+    pkt = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  set_interrupt_level(old_level);
+
+  free(pkt);
+}
+
+void
+network_hold_pkt(network_interrupt_arg_t* pkt) {
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+  pkt->refs++;
+  set_interrupt_level(old_level);
+}
+
+int
+network_pkt_bytes(network_interrupt_arg_t* pkt) {
+  return CLASS_BYTES(pkt->size_class);
+}
+
+char*
+network_pkt_pull(network_interrupt_arg_t* pkt, int len) {
+  char* hdr;
+
+  if (len < 0 || pkt->size - pkt->head < len)
+    return NULL;
+  hdr = pkt->buffer + pkt->head;
+  pkt->head += len;
+  return hdr;
+}
+
+char*
+network_pkt_push(network_interrupt_arg_t* pkt, int len) {
+  if (len < 0 || pkt->head < len)
+    return NULL;
+  pkt->head -= len;
+  return pkt->buffer + pkt->head;
+}
+
+char*
+network_pkt_data(network_interrupt_arg_t* pkt) {
+  return pkt->buffer + pkt->head;
+}
+
+int
+network_pkt_len(network_interrupt_arg_t* pkt) {
+  return pkt->size - pkt->head;
+}
+
+void
+network_set_recv_batch(int batch) {
+  if (batch < 1)
+    batch = 1;
+  if (batch > MAX_NETWORK_RECV_BATCH)
+    batch = MAX_NETWORK_RECV_BATCH;
+  recv_batch = batch;
+}
+
+/*
+ * Adds a ring's priority queues to the receive counters.
+ */
+static void
+ring_priority_stats(interrupt_ring_t ring, network_recv_stats_t* stats) {
+  long events;
+  long depth;
+  long max_depth;
+  int p;
+
+  if (ring == NULL)
+    return;
+  for (p = 0; p < NETWORK_RX_PRIORITIES; p++) {
+    interrupt_ring_class_stats(ring, p, &events, &depth, &max_depth);
+    stats->priority_packets[p] += events;
+    stats->priority_depth[p] += depth;
+    if (max_depth > stats->priority_max_depth[p])
+      stats->priority_max_depth[p] = max_depth;
+  }
+}
+
+void
+network_recv_stats(network_recv_stats_t* stats) {
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  int i;
+
+  pthread_mutex_lock(&pool_lock);
+  *stats = recv_stats;
+  pthread_mutex_unlock(&pool_lock);
+
+  ring_priority_stats(loopback_ring, stats);
+  ring_priority_stats(netem_ring, stats);
+  ring_priority_stats(txsched_ring, stats);
+  for (i = 0; i < n_queues; i++)
+    ring_priority_stats(queues[i].ring, stats);
+  set_interrupt_level(old_level);
+}
+
+/*
+ * The priority of a received packet.
+ */
+static int
+rx_priority(network_interrupt_arg_t* packet) {
+  int priority;
+
+  if (classifier == NULL)
+    return NETWORK_RX_BULK;
+  priority = classifier(packet->buffer, packet->size);
+  if (priority < 0 || priority >= NETWORK_RX_PRIORITIES)
+    return NETWORK_RX_BULK;
+  return priority;
+}
+
+/*
+ * Records a received packet, when capturing.
+ */
+static void
+capture_in(network_interrupt_arg_t* packet) {
+  struct iovec iov;
+
+  iov.iov_base = network_pkt_data(packet);
+  iov.iov_len = network_pkt_len(packet);
+  capture_packet(CAPTURE_IN, packet->sender, &iov, 1, iov.iov_len);
+}
+
+/*
+ * Hands a packet to the network handler as it arrives in simulation mode.
+ */
+static void
+sim_receive(void* arg) {
+  if (capture_running)
+    capture_in((network_interrupt_arg_t*) arg);
+  mini_network_handler(arg);
+}
+
+/*
+ * Simulation mode transmit: a packet to our own host is delivered after the
+ * modeled latency, anything else is lost on the wire. Only the IP address is
+ * compared, since a simulation runs as a single process.
+ */
+static int
+sim_send_pktv(network_address_t dest_address, struct iovec* iov, int iovcnt,
+              int pktlen) {
+  network_interrupt_arg_t* packet;
+  interrupt_level_t old_level;
+  int off;
+  int i;
+
+  if (dest_address[0] != sim_my_addr[0])
+    return pktlen;
+
+  old_level = set_interrupt_level(DISABLED);
+  packet = network_alloc_pkt(pktlen);
+  set_interrupt_level(old_level);
+  if (packet == NULL)
+    return -1;
+
+  /* the receive buffer is the only copy */
+  off = 0;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(packet->buffer + off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  packet->size = pktlen;
+  network_address_copy(sim_my_addr, packet->sender);
+
+  if (sim_schedule(sim_network_delay(), sim_receive, packet) == -1) {
+    network_free_pkt(packet);
+    return -1;
+  }
+  return pktlen;
+}
+
+/*
+ * The queue whose socket sends to dest_address, so that each destination
+ * always leaves through the same socket.
+ */
+static struct net_queue*
+send_queue(network_address_t dest_address) {
+  unsigned int h;
+
+  if (n_queues == 1)
+    return &queues[0];
+  h = (dest_address[0] ^ dest_address[1]) * 2654435761u;
+  return &queues[(h >> 16) % n_queues];
+}
+
+/*
+ * Returns 1 if dest_address is this process. The local address is resolved
+ * by then, so this is safe on the device poller too.
+ */
+static int
+is_loopback(network_address_t dest_address) {
+  network_address_t my_address;
+
+  if (loopback_ring == NULL || dest_address[1] != htons(my_udp_port))
+    return 0;
+  network_get_my_address(my_address);
+  return dest_address[0] == my_address[0] ||
+         (ntohl(dest_address[0]) >> 24) == 127;
+}
+
+/*
+ * Delivers a packet to ourselves without the socket: it is gathered into a
+ * receive buffer and queued as a software interrupt, which runs as soon as
+ * the caller's interrupt level allows. A full ring drops it, as a full
+ * socket buffer would.
+ */
+static int
+loopback_send(struct iovec* iov, int iovcnt, int pktlen) {
+  network_interrupt_arg_t* packet;
+  interrupt_level_t old_level;
+  int off;
+  int i;
+
+  old_level = set_interrupt_level(DISABLED);
+  packet = network_alloc_pkt(pktlen);
+  if (packet == NULL) {
+    set_interrupt_level(old_level);
+    return -1;
+  }
+
+  for (off = 0, i = 0; i < iovcnt; i++) {
+    memcpy(packet->buffer + off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  packet->size = pktlen;
+  network_get_my_address(packet->sender);
+  if (capture_running)
+    capture_in(packet);
+
+  if (interrupt_ring_post_soft(loopback_ring, rx_priority(packet), packet) == -1)
+    network_free_pkt(packet);
+  pthread_mutex_lock(&pool_lock);
+  recv_stats.loopback++;
+  pthread_mutex_unlock(&pool_lock);
+  set_interrupt_level(old_level);
+  return pktlen;
+}
+
+/*
+ * Sends the pieces out of the socket for dest_address.
+ */
+static int
+socket_send(network_address_t dest_address, struct iovec* iov, int iovcnt) {
   struct sockaddr_in sin;
-  char* bufp;
-  int sz, pktlen;
+  struct msghdr msg;
+
+  network_address_to_sockaddr(dest_address, &sin);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &sin;
+  msg.msg_namelen = sizeof(sin);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  return sendmsg(send_queue(dest_address)->sock, &msg, 0);
+}
+
+/*
+ * Delivers a packet to ourselves from a device thread, through its ring.
+ */
+static void
+ring_deliver(interrupt_ring_t ring, char* buf, int len) {
+  network_interrupt_arg_t* packet;
+
+  packet = network_alloc_pkt(len);
+  if (packet == NULL)
+    return;
+  memcpy(packet->buffer, buf, len);
+  packet->size = len;
+  network_get_my_address(packet->sender);
+  if (capture_running)
+    capture_in(packet);
+  interrupt_ring_post_class(ring, rx_priority(packet), packet);
+}
 
-  pktlen = hdr_len + data_len;
+/*
+ * Puts a packet on its way, on the virtual processor: to the emulator, to
+ * ourselves, into the simulation or out of the socket.
+ */
+static int
+transmit(network_address_t dest_address, struct iovec* iov, int iovcnt,
+         int pktlen) {
+  if (capture_running)
+    capture_packet(CAPTURE_OUT, dest_address, iov, iovcnt, pktlen);
+
+  if (netem_active(dest_address))
+    return netem_send(dest_address, iov, iovcnt, pktlen);
+
+  if (is_loopback(dest_address))
+    return loopback_send(iov, iovcnt, pktlen);
+
+  if (sim_enabled)
+    return sim_send_pktv(dest_address, iov, iovcnt, pktlen);
+
+  return socket_send(dest_address, iov, iovcnt);
+}
+
+/*
+ * Sends a packet the transmit scheduler let go. In simulation mode this
+ * is on the virtual processor. Otherwise it is on the transmit thread,
+ * which has a ring of its own to deliver packets to ourselves, and never
+ * sees emulated destinations.
+ */
+static void
+txsched_release(network_address_t dest_address, char* buf, int len) {
+  struct iovec iov;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  if (sim_enabled) {
+    transmit(dest_address, &iov, 1, len);
+    return;
+  }
+
+  if (capture_running)
+    capture_packet(CAPTURE_OUT, dest_address, &iov, 1, len);
+  if (is_loopback(dest_address)) {
+    ring_deliver(txsched_ring, buf, len);
+    pthread_mutex_lock(&pool_lock);
+    recv_stats.loopback++;
+    pthread_mutex_unlock(&pool_lock);
+    return;
+  }
+  socket_send(dest_address, &iov, 1);
+}
+
+/*
+ * Sends the pieces straight from the caller's buffers, unless the
+ * transmit scheduler queues them. Nothing here is shared between callers,
+ * so minithreads may send concurrently.
+ */
+static int
+send_pktv(network_address_t dest_address, struct iovec* iov, int iovcnt) {
+  int pktlen;
+  int i;
 
   /* sanity checks */
-  if (hdr_len < 0 || data_len < 0 || pktlen > MAX_NETWORK_PKT_SIZE)
+  if (iovcnt < 0 || iovcnt > MAX_NETWORK_IOV) {
+    netstats_dropped(NETSTATS_DROP_INVALID);
+    return 0;
+  }
+  pktlen = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if ((int) iov[i].iov_len < 0) {
+      netstats_dropped(NETSTATS_DROP_INVALID);
+      return 0;
+    }
+    pktlen += iov[i].iov_len;
+  }
+  if (pktlen > mtu) {
+    netstats_dropped(NETSTATS_DROP_INVALID);
     return 0;
+  }
 
-  /*
-   * Pull up the headers and data and stuff them into the output
-   * packet with the
-   * field sizes embedded.
-   */
+  if (txsched_active() && !netem_active(dest_address))
+    return txsched_send(dest_address, iov, iovcnt, pktlen);
 
-  bufp = if_info.pkt;
+  return transmit(dest_address, iov, iovcnt, pktlen);
+}
 
-  sz = hdr_len;
-  memcpy(bufp, hdr, sz);
-  bufp += sz;
+/*
+ * Sends a packet the emulator held back. In simulation mode it arrives
+ * right away, the emulator having modeled its latency.
+ */
+static void
+netem_release(network_address_t dest_address, char* buf, int len) {
+  struct iovec iov;
+  network_interrupt_arg_t* packet;
 
-  sz = data_len;
-  memcpy(bufp, data, sz);
-  bufp += sz;
+  if (sim_enabled) {
+    if (dest_address[0] != sim_my_addr[0])
+      return;
+    packet = network_alloc_pkt(len);
+    if (packet == NULL)
+      return;
+    memcpy(packet->buffer, buf, len);
+    packet->size = len;
+    network_address_copy(sim_my_addr, packet->sender);
+    sim_receive(packet);
+    return;
+  }
 
-  network_address_to_sockaddr(dest_address, &sin);
-  cc = sendto(if_info.sock,
-              if_info.pkt,
-              pktlen,
-              0,
-              (struct sockaddr *) &sin,
-              sizeof(sin));
+  if (is_loopback(dest_address)) {
+    ring_deliver(netem_ring, buf, len);
+    return;
+  }
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  socket_send(dest_address, &iov, 1);
+}
+
+static int
+send_pkt(network_address_t dest_address,
+         int hdr_len, char* hdr,
+         int data_len, char* data) {
+  struct iovec iov[2];
+
+  if (hdr_len < 0 || data_len < 0)
+    return 0;
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = hdr_len;
+  iov[1].iov_base = data;
+  iov[1].iov_len = data_len;
+  return send_pktv(dest_address, iov, 2);
+}
+
+/*
+ * Draws whether to lose or duplicate a packet. Interrupts are disabled so
+ * that senders on different minithreads do not interleave on the generator.
+ */
+static void
+synthetic_draw(int* lose, int* duplicate) {
+  interrupt_level_t old_level;
+
+  minithread_use_fp();
+  old_level = set_interrupt_level(DISABLED);
+  *lose = genrand_r(&network_random) < loss_rate;
+  *duplicate = !*lose && genrand_r(&network_random) < duplication_rate;
+  set_interrupt_level(old_level);
+}
 
-  return cc;
+int
+network_send_pktv(network_address_t dest_address, struct iovec* iov,
+                  int iovcnt) {
+  int lose;
+  int duplicate;
+  int i;
+
+  if (synthetic_network) {
+    synthetic_draw(&lose, &duplicate);
+    if (lose) {
+      for (lose = 0, i = 0; i < iovcnt; i++)
+        lose += iov[i].iov_len;
+      return lose;
+    }
+    if (duplicate)
+      send_pktv(dest_address, iov, iovcnt);
+  }
+
+  return send_pktv(dest_address, iov, iovcnt);
 }
 
 int
 network_send_pkt(network_address_t dest_address, int hdr_len,
                  char* hdr, int data_len, char* data) {
+  struct iovec iov[2];
 
-  if (synthetic_network) {
-    if(genrand() < loss_rate)
-      return (hdr_len+data_len);
+  if (hdr_len < 0 || data_len < 0)
+    return 0;
 
-    if(genrand() < duplication_rate)
-      send_pkt(dest_address, hdr_len, hdr, data_len, data);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = hdr_len;
+  iov[1].iov_base = data;
+  iov[1].iov_len = data_len;
+  return network_send_pktv(dest_address, iov, 2);
+}
+
+/*
+ * Sends the segments out of the socket, a batch of them with each call,
+ * every one with the headers in front of it. Returns the data bytes sent,
+ * or -1 if no segment was.
+ */
+static int
+sendmmsg_segments(network_address_t dest_address, struct iovec* hdr,
+                  int hdrcnt, int hdr_len, char* data, int data_len,
+                  int seg_size) {
+  struct mmsghdr msgs[MAX_NETWORK_SEGMENTS];
+  struct iovec iovs[MAX_NETWORK_SEGMENTS][MAX_NETWORK_IOV];
+  struct sockaddr_in sin;
+  int sock = send_queue(dest_address)->sock;
+  int segments;
+  int first; /* first segment of the batch */
+  int count;
+  int off;
+  int len;
+  int n;
+  int i;
+
+  network_address_to_sockaddr(dest_address, &sin);
+  segments = data_len == 0 ? 1 : (data_len + seg_size - 1) / seg_size;
+
+  for (first = 0; first < segments; first += count) {
+    count = segments - first;
+    if (count > MAX_NETWORK_SEGMENTS)
+      count = MAX_NETWORK_SEGMENTS;
+
+    for (i = 0; i < count; i++) {
+      off = (first + i) * seg_size;
+      len = data_len - off < seg_size ? data_len - off : seg_size;
+      memcpy(iovs[i], hdr, hdrcnt * sizeof(struct iovec));
+      iovs[i][hdrcnt].iov_base = data + off;
+      iovs[i][hdrcnt].iov_len = len;
+      memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+      msgs[i].msg_hdr.msg_name = &sin;
+      msgs[i].msg_hdr.msg_namelen = sizeof(sin);
+      msgs[i].msg_hdr.msg_iov = iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = hdrcnt + 1;
+      if (capture_running)
+        capture_packet(CAPTURE_OUT, dest_address, iovs[i], hdrcnt + 1,
+                       hdr_len + len);
+    }
+
+    /* the host may take fewer than a batch */
+    for (i = 0; i < count; i += n) {
+      n = sendmmsg(sock, msgs + i, count - i, 0);
+      if (n <= 0) {
+        if (first + i == 0)
+          return -1;
+        off = (first + i) * seg_size;
+        return off < data_len ? off : data_len;
+      }
+    }
   }
+  return data_len;
+}
+
+int
+network_send_segments(network_address_t dest_address, struct iovec* hdr,
+                      int hdrcnt, char* data, int data_len, int seg_size) {
+  struct iovec iov[MAX_NETWORK_IOV];
+  int hdr_len;
+  int sent;
+  int off;
+  int len;
+  int i;
+
+  /* sanity checks */
+  if (hdrcnt < 0 || hdrcnt > MAX_NETWORK_IOV - 1 || data_len < 0 ||
+      seg_size <= 0 || (data == NULL && data_len > 0)) {
+    netstats_dropped(NETSTATS_DROP_INVALID);
+    return -1;
+  }
+  hdr_len = 0;
+  for (i = 0; i < hdrcnt; i++) {
+    if ((int) hdr[i].iov_len < 0) {
+      netstats_dropped(NETSTATS_DROP_INVALID);
+      return -1;
+    }
+    hdr_len += hdr[i].iov_len;
+  }
+  if (hdr_len + seg_size > mtu) {
+    netstats_dropped(NETSTATS_DROP_INVALID);
+    return -1;
+  }
+
+  if (!synthetic_network && !sim_enabled && !txsched_active() &&
+      !netem_active(dest_address) && !is_loopback(dest_address))
+    return sendmmsg_segments(dest_address, hdr, hdrcnt, hdr_len, data,
+                             data_len, seg_size);
+
+  /* one by one, for whatever stands between us and the socket */
+  memcpy(iov, hdr, hdrcnt * sizeof(struct iovec));
+  off = 0;
+  do {
+    len = data_len - off < seg_size ? data_len - off : seg_size;
+    iov[hdrcnt].iov_base = data + off;
+    iov[hdrcnt].iov_len = len;
+    sent = network_send_pktv(dest_address, iov, hdrcnt + 1);
+    if (sent < 0)
+      return off > 0 ? off : -1;
+    off += len;
+  } while (off < data_len);
+  return data_len;
+}
+
+/*
+ * Resolved names. Lookups happen on the virtual processor, and the table is
+ * only touched with interrupts disabled; the resolver itself runs with
+ * interrupts enabled.
+ */
+#define NAME_CACHE_ENTRIES 64
+#define NAME_CACHE_TTL 60 /* seconds */
+
+typedef struct {
+  char name[BCAST_MAX_NAME_LEN];
+  unsigned int addr;
+  long expires;
+} name_entry_t;
+
+static name_entry_t name_cache[NAME_CACHE_ENTRIES];
+static int name_cache_next; /* entry to replace when the table is full */
+
+static network_address_t my_addr_cache;
+static int my_addr_valid;
+
+static long
+seconds_now() {
+  struct timespec ts;
 
-  return send_pkt(dest_address, hdr_len, hdr, data_len, data);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* Returns 0 and the cached address of hostname, or -1 */
+static int
+name_cache_get(char* hostname, unsigned int* addr) {
+  interrupt_level_t old_level = set_interrupt_level(DISABLED);
+  long now = seconds_now();
+  int found = -1;
+  int i;
+
+  for (i = 0; i < NAME_CACHE_ENTRIES; i++) {
+    if (name_cache[i].expires > now &&
+        strcmp(name_cache[i].name, hostname) == 0) {
+      *addr = name_cache[i].addr;
+      found = 0;
+      break;
+    }
+  }
+  set_interrupt_level(old_level);
+  return found;
+}
+
+static void
+name_cache_put(char* hostname, unsigned int addr) {
+  interrupt_level_t old_level;
+  long now;
+  int slot = -1;
+  int i;
+
+  if (strlen(hostname) >= BCAST_MAX_NAME_LEN)
+    return;
+
+  old_level = set_interrupt_level(DISABLED);
+  now = seconds_now();
+  for (i = 0; i < NAME_CACHE_ENTRIES; i++) {
+    if (strcmp(name_cache[i].name, hostname) == 0) {
+      slot = i;
+      break;
+    }
+    if (slot == -1 && name_cache[i].expires <= now)
+      slot = i;
+  }
+  if (slot == -1) {
+    slot = name_cache_next;
+    name_cache_next = (name_cache_next + 1) % NAME_CACHE_ENTRIES;
+  }
+  strcpy(name_cache[slot].name, hostname);
+  name_cache[slot].addr = addr;
+  name_cache[slot].expires = now + NAME_CACHE_TTL;
+  set_interrupt_level(old_level);
 }
 
 void
-network_get_my_address(network_address_t my_address) {
+network_refresh_my_address() {
   char hostname[64];
+  network_address_t addr;
+
   assert(gethostname(hostname, 64) == 0);
-  network_translate_hostname(hostname, my_address);
+  network_translate_hostname(hostname, addr);
+  network_address_copy(addr, my_addr_cache);
+  my_addr_valid = 1;
+}
+
+void
+network_get_my_address(network_address_t my_address) {
+  if (!my_addr_valid)
+    network_refresh_my_address();
+  my_address[0] = my_addr_cache[0];
   my_address[1] = htons(my_udp_port);
 }
 
@@ -167,12 +903,18 @@ network_translate_hostname(char* hostname, network_address_t address) {
   unsigned int iaddr;
   //printf("resolving name %s\n",hostname);
   if(isalpha(hostname[0])) {
+          if (name_cache_get(hostname, &iaddr) == 0) {
+                address[0] = iaddr;
+                address[1] = htons(other_udp_port);
+                return 0;
+          }
           host = gethostbyname(hostname);
           if (host == NULL)
                 return -1;
           else {
                 address[0] = *((int *) host->h_addr);
                 address[1] = htons(other_udp_port);
+                name_cache_put(hostname, address[0]);
                 //printf("address[0] = %x",address[0]);
                 //printf("address[1] = %x",address[1]);
                 return 0;
@@ -233,157 +975,271 @@ network_udp_ports(short myportnum, short otherportnum) {
   other_udp_port = otherportnum;
 }
 
+int
+network_set_queues(int n) {
+  if (network_initialized)
+    return -1;
+  if (n < 1)
+    n = 1;
+  if (n > MAX_NETWORK_QUEUES)
+    n = MAX_NETWORK_QUEUES;
+  n_queues = n;
+  return 0;
+}
+
+int
+network_set_mtu(int m) {
+  int c;
+
+  /* the spare and pooled receive buffers are already sized */
+  if (network_initialized)
+    return -1;
+  if (m < MIN_NETWORK_MTU)
+    m = MIN_NETWORK_MTU;
+  if (m > MAX_NETWORK_MTU)
+    m = MAX_NETWORK_MTU;
+  mtu = m;
+  class_size[MTU_CLASS] = m;
+  /* a smaller buffer is never larger than the MTU */
+  for (c = MTU_CLASS - 1; c >= 0; c--)
+    if (class_size[c] > class_size[c + 1])
+      class_size[c] = class_size[c + 1];
+  return 0;
+}
+
+int
+network_mtu() {
+  return mtu;
+}
+
+void
+network_set_classifier(network_classifier_t c) {
+  classifier = c;
+}
+
+void
+network_set_control_weight(int weight) {
+  int i;
+
+  control_weight = weight > 0 ? weight : 0;
+  if (loopback_ring != NULL)
+    interrupt_ring_set_weight(loopback_ring, control_weight);
+  if (netem_ring != NULL)
+    interrupt_ring_set_weight(netem_ring, control_weight);
+  if (txsched_ring != NULL)
+    interrupt_ring_set_weight(txsched_ring, control_weight);
+  for (i = 0; i < n_queues; i++)
+    if (queues[i].ring != NULL)
+      interrupt_ring_set_weight(queues[i].ring, control_weight);
+}
+
 void
 network_synthetic_params(double loss, double duplication) {
+  minithread_use_fp();
   synthetic_network = 1;
   loss_rate = loss;
   duplication_rate = duplication;
 }
 
-void
-bcast_initialize(char* configfile, bcast_t* bcast) {
-  FILE* config = fopen(configfile, "r");
-  char line[BCAST_MAX_LINE_LEN];
-  int i = 0;
-  char* rv;
-  network_address_t my_addr;
-  unsigned int my_ip_addr;
+static void
+fanout_release(bcast_fanout_t f) {
+  if (f != NULL && --f->refs == 0)
+    free(f);
+}
 
-  network_get_my_address(my_addr);
-  my_ip_addr = my_addr[0];
+/*
+ * Rebuilds the fanout from our node's links. Called with interrupts
+ * disabled; a fanout that cannot be allocated leaves the old one.
+ */
+static void
+fanout_rebuild() {
+  bcast_fanout_t f;
+  unsigned int* ips;
+  int degree;
+  int i;
 
-  while ((rv = fgets(line, BCAST_MAX_LINE_LEN, config)) != NULL) {
-    if (line[0] == '\r' || line[0] == '\n')
-      break;
-        line[strlen(line)-1] = '\0';
-    strcpy(bcast->entries[i].name, line);
-    bcast->entries[i].n_links = 0;
-    if (network_translate_hostname(line, bcast->entries[i].addr) != 0) {
-      kprintf("Error: could not resolve hostname %s.\n", line);
-      AbortOnCondition(1,"Crashing.");
-    }
-    if (bcast->entries[i].addr[0] == my_ip_addr)
-      bcast->me = i;
-    i++;
+  degree = topology_degree(topology, topology_me);
+  f = (bcast_fanout_t) malloc(sizeof(struct bcast_fanout) +
+                              degree * sizeof(network_address_t));
+  ips = (unsigned int*) malloc((degree > 0 ? degree : 1) * sizeof(unsigned int));
+  if (f == NULL || ips == NULL) {
+    free(f);
+    free(ips);
+    return;
   }
 
-  bcast->n_entries = i;
+  f->refs = 1;
+  f->n = topology_neighbors(topology, topology_me, ips);
+  for (i = 0; i < f->n; i++) {
+    f->neighbors[i][0] = ips[i];
+    f->neighbors[i][1] = htons(other_udp_port);
+  }
+  network_get_my_address(f->self);
+  if (topology_me >= 0) {
+    f->self[0] = topology_node_ip(topology, topology_me);
+    f->self[1] = htons(other_udp_port);
+  }
+  free(ips);
 
+  fanout_release(fanout);
+  fanout = f;
+}
 
-  if (rv != NULL)
-    for (i=0; i<bcast->n_entries; i++) {
-      int j;
-      AbortOnCondition(fgets(line, BCAST_MAX_LINE_LEN, config) == NULL,
-                       "Error: incomplete adjacency matrix.");
+/*
+ * Installs a topology in place of the current one, which is returned.
+ */
+static topology_t
+topology_install(topology_t t) {
+  interrupt_level_t old_level;
+  network_address_t my_addr;
+  topology_t old;
 
-      for (j=0; j<bcast->n_entries; j++)
-        if (i == j)
-          ; /* avoid self-links */
-        else if (line[j] != '.') {
-          bcast->entries[i].links[bcast->entries[i].n_links] = j;
-          bcast->entries[i].n_links++;
-        }
-    }
+  network_get_my_address(my_addr);
+  old_level = set_interrupt_level(DISABLED);
+  old = topology;
+  topology = t;
+  topology_me = topology_find(t, my_addr[0]);
+  if (topology_me == -1 && topology_nodes(t) > 0)
+    topology_me = 0;
+  fanout_rebuild();
+  set_interrupt_level(old_level);
+  return old;
+}
 
-  fclose(config);
+/*
+ * Reads the topology at startup: the binary file, unless the text file
+ * has changed since it was written, otherwise the text file.
+ */
+static void
+bcast_initialize(char* configfile, char* binaryfile) {
+  struct stat text;
+  struct stat binary;
+  topology_t t;
+
+  if (stat(binaryfile, &binary) == 0 &&
+      (stat(configfile, &text) != 0 || binary.st_mtime >= text.st_mtime))
+    configfile = binaryfile;
+  t = topology_load(configfile);
+  AbortOnCondition(t == NULL, "Error: cannot read broadcast topology.");
+  topology_install(t);
 }
 
 int
-hostname_to_entry(bcast_t* bcast, char* hostname) {
+network_load_topology(char* file) {
+  topology_t t = topology_load(file);
+
+  if (t == NULL)
+    return -1;
+  topology_destroy(topology_install(t));
+  return 0;
+}
+
+/*
+ * The address of hostname. Names in the topology are found without
+ * resolving them again; any other name goes to the resolver, so this is
+ * called with interrupts enabled.
+ */
+static unsigned int
+hostname_to_ip(char* hostname) {
+  interrupt_level_t old_level;
   network_address_t addr;
-  unsigned int ipaddr;
-  int entry = -1;
-  int i;
+  int node;
 
-  if (hostname == NULL)
-    return bcast->me;
+  old_level = set_interrupt_level(DISABLED);
+  node = topology_find_name(topology, hostname);
+  addr[0] = node == -1 ? 0 : topology_node_ip(topology, node);
+  set_interrupt_level(old_level);
+  if (node != -1)
+    return addr[0];
 
   if (network_translate_hostname(hostname, addr) != 0) {
     kprintf("Error: could not resolve host name.\n");
       AbortOnCondition(1,"Crashing.");
   }
-
-  ipaddr = addr[0];
-
-  for (i=0; i<bcast->n_entries; i++)
-    if (ipaddr == bcast->entries[i].addr[0])
-      entry = i;
-
-  AbortOnCondition(entry == -1,
-                   "Error: host name not in broadcast table.");
-
-  return entry;
+  return addr[0];
 }
 
-void
-bcast_add_link(bcast_t* bcast, char* src, char* dest) {
-  int srcnum, destnum;
-  int i;
-
-  srcnum = hostname_to_entry(bcast, src);
-  destnum = hostname_to_entry(bcast, dest);
-
-  for (i=0; i<bcast->entries[srcnum].n_links; i++)
-    if (bcast->entries[srcnum].links[i] == destnum)
-      return;
+/*
+ * The node with address ip, or ours for a NULL hostname. Called with
+ * interrupts disabled.
+ */
+static int
+ip_to_node(char* hostname, unsigned int ip) {
+  int node;
 
-  bcast->entries[srcnum].links[bcast->entries[srcnum].n_links++] = destnum;
+  if (hostname == NULL)
+    return topology_me;
+  node = topology_find(topology, ip);
+  AbortOnCondition(node == -1,
+                   "Error: host name not in broadcast table.");
+  return node;
 }
 
-void
-bcast_remove_link(bcast_t* bcast, char* src, char* dest) {
-  int srcnum, destnum;
-  int i;
-
-  srcnum = hostname_to_entry(bcast, src);
-  destnum = hostname_to_entry(bcast, dest);
-
-  for (i=0; i<bcast->entries[srcnum].n_links; i++)
-    if (bcast->entries[srcnum].links[i] == destnum) {
-      if (i < bcast->entries[srcnum].n_links-1) {
-        bcast->entries[srcnum].links[i] =
-          bcast->entries[srcnum].links[--bcast->entries[srcnum].n_links];
-        break;
-      }
-      else
-        bcast->entries[srcnum].n_links--;
-    }
+static void
+bcast_set_link(char* src, char* dest, int on) {
+  interrupt_level_t old_level;
+  unsigned int src_ip = src ? hostname_to_ip(src) : 0;
+  unsigned int dest_ip = dest ? hostname_to_ip(dest) : 0;
+  int srcnum;
+  int destnum;
+
+  old_level = set_interrupt_level(DISABLED);
+  srcnum = ip_to_node(src, src_ip);
+  destnum = ip_to_node(dest, dest_ip);
+  topology_set_link(topology, srcnum, destnum, on);
+  if (srcnum == topology_me)
+    fanout_rebuild();
+  set_interrupt_level(old_level);
 }
 
 int
 network_bcast_pkt(int hdr_len, char* hdr, int data_len, char* data) {
+  interrupt_level_t old_level;
+  bcast_fanout_t f;
+  int result = hdr_len + data_len;
   int i;
-  int me;
 
   AbortOnCondition(!BCAST_ENABLED,
                    "Error: network broadcast not enabled.");
 
   if (BCAST_USE_TOPOLOGY_FILE){
 
-    me = topology.me;
-
-    for (i=0; i<topology.entries[me].n_links; i++) {
-      int dest = topology.entries[me].links[i];
+    old_level = set_interrupt_level(DISABLED);
+    f = fanout;
+    if (f != NULL)
+      f->refs++;
+    set_interrupt_level(old_level);
+    if (f == NULL)
+      return -1;
 
+    for (i = 0; i < f->n; i++) {
       if (synthetic_network) {
-        if(genrand() < loss_rate)
-          continue;
+        int lose, duplicate;
 
-        if(genrand() < duplication_rate)
-          send_pkt(topology.entries[dest].addr, hdr_len, hdr, data_len, data);
+        synthetic_draw(&lose, &duplicate);
+        if (lose)
+          continue;
+        if (duplicate)
+          send_pkt(f->neighbors[i], hdr_len, hdr, data_len, data);
       }
 
-      if (send_pkt(topology.entries[dest].addr,
-                   hdr_len, hdr, data_len, data) != hdr_len + data_len)
-        return -1;
+      if (send_pkt(f->neighbors[i],
+                   hdr_len, hdr, data_len, data) != hdr_len + data_len) {
+        result = -1;
+        break;
+      }
     }
 
-    if (BCAST_LOOPBACK) {
-      if (send_pkt(topology.entries[me].addr,
+    if (result != -1 && BCAST_LOOPBACK) {
+      if (send_pkt(f->self,
                    hdr_len, hdr, data_len, data) != hdr_len + data_len)
-        return -1;
+        result = -1;
     }
 
+    old_level = set_interrupt_level(DISABLED);
+    fanout_release(f);
+    set_interrupt_level(old_level);
+
   } else { /* real broadcast */
 
     /* send the packet using the private network broadcast address */
@@ -392,58 +1248,97 @@ network_bcast_pkt(int hdr_len, char* hdr, int data_len, char* data) {
       return -1;
 
   }
-  return hdr_len+data_len;
+  return result;
 }
 
 void
 network_add_bcast_link(char* src, char* dest) {
-  bcast_add_link(&topology, src, dest);
+  bcast_set_link(src, dest, 1);
 }
 
 void
 network_remove_bcast_link(char* src, char* dest) {
-  bcast_remove_link(&topology, src, dest);
+  bcast_set_link(src, dest, 0);
 }
 
 
-int network_poll(void* arg) {
-  int* s;
-  network_interrupt_arg_t* packet;
-  struct sockaddr_in addr;
-  unsigned int fromlen = sizeof(struct sockaddr_in);
-
-  s = (int *) arg;
-
-  for (;;) {
+/*
+ * Called on the device poller when the socket is readable. Receives up to
+ * a batch of packets with one call, into full size buffers. A packet that
+ * fits a smaller buffer is copied into one, and the full one is kept for
+ * the next call, as are those that were not filled.
+ */
+static void network_readable(int s, void* arg) {
+  struct net_queue* q = (struct net_queue*) arg;
+  network_interrupt_arg_t** recv_pkts = q->recv_pkts;
+  struct mmsghdr msgs[MAX_NETWORK_RECV_BATCH];
+  struct iovec iovs[MAX_NETWORK_RECV_BATCH];
+  struct sockaddr_in addrs[MAX_NETWORK_RECV_BATCH];
+  int batch = recv_batch;
+  int copied = 0;
+  int n;
+  int i;
 
+  for (i = 0; i < batch; i++) {
     /* we rely on run_user_handler to destroy this data structure */
-    if (DEBUG)
-      kprintf("NET:Allocating an incoming packet.\n");
+    if (recv_pkts[i] == NULL) {
+      recv_pkts[i] = network_alloc_pkt(mtu);
+      assert(recv_pkts[i] != NULL);
+    }
+    iovs[i].iov_base = recv_pkts[i]->buffer;
+    iovs[i].iov_len = mtu;
+    memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
 
-    packet =
-      (network_interrupt_arg_t *) malloc(sizeof(network_interrupt_arg_t));
-    assert(packet != NULL);
+  n = recvmmsg(s, msgs, batch, MSG_DONTWAIT, NULL);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (n <= 0) {
+    kprintf("NET:Error, %d.\n", errno);
+    AbortOnCondition(1,"Crashing.");
+  }
 
-    packet->size = recvfrom(*s, packet->buffer, MAX_NETWORK_PKT_SIZE,
-                            0, (struct sockaddr *) &addr, &fromlen);
-    if (packet->size <= 0) {
-      kprintf("NET:Error, %d.\n", errno);
-      AbortOnCondition(1,"Crashing.");
+  for (i = 0; i < n; i++) {
+    network_interrupt_arg_t* packet = recv_pkts[i];
+    int size = msgs[i].msg_len;
+
+    if (size_class(size) != MTU_CLASS) {
+      packet = network_alloc_pkt(size);
+      assert(packet != NULL);
+      memcpy(packet->buffer, recv_pkts[i]->buffer, size);
+      copied++;
+    } else {
+      recv_pkts[i] = NULL;
     }
-    else if (DEBUG)
+    packet->size = size;
+    if (DEBUG)
       kprintf("NET:Received a packet, seqno %d.\n", ntohl(*((int *) packet->buffer)));
 
-    assert(fromlen == sizeof(struct sockaddr_in));
-    sockaddr_to_network_address(&addr, packet->sender);
+    assert(msgs[i].msg_hdr.msg_namelen == sizeof(struct sockaddr_in));
+    sockaddr_to_network_address(&addrs[i], packet->sender);
+    if (capture_running)
+      capture_in(packet);
 
     /*
      * now we have filled in the arg to the network interrupt service routine,
      * so we have to get the user's thread to run it.
      */
-    if (DEBUG)
-      kprintf("NET:packet arrived.\n");
-    send_interrupt(NETWORK_INTERRUPT_TYPE, mini_network_handler, (void*)packet);
+    interrupt_ring_post_class(q->ring, rx_priority(packet), (void*)packet);
   }
+
+  pthread_mutex_lock(&pool_lock);
+  recv_stats.calls++;
+  recv_stats.packets += n;
+  recv_stats.batch_hist[n]++;
+  if (n > recv_stats.max_batch)
+    recv_stats.max_batch = n;
+  recv_stats.copied += copied;
+  recv_stats.queue_packets[q - queues] += n;
+  pthread_mutex_unlock(&pool_lock);
 }
 
 /*
@@ -451,20 +1346,16 @@ int network_poll(void* arg) {
  * can be turned on without network interrupts. however, this function requires
  * that clock_init has been called!
  */
-void start_network_poll(interrupt_handler_t network_handler, int* s) {
-  pthread_t network_thread;
+void start_network_poll(interrupt_handler_t network_handler) {
   sigset_t set;
   sigset_t old_set;
   struct sigaction sa;
+  int i;
   sigemptyset(&set);
   sigaddset(&set,SIGRTMAX-1);
   sigaddset(&set,SIGRTMAX-2);
   sigprocmask(SIG_BLOCK,&set,&old_set);
 
-  /* create clock and return threads, but discard ids */
-  AbortOnCondition(pthread_create(&network_thread, NULL, (void*)network_poll, s),
-      "pthread");
-
   sa.sa_handler = (void*)handle_interrupt;
   sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
   sa.sa_sigaction= (void*)handle_interrupt;
@@ -474,46 +1365,96 @@ void start_network_poll(interrupt_handler_t network_handler, int* s) {
   if (sigaction(SIGRTMAX-2, &sa, NULL) == -1)
       AbortOnError(0);
 
+  loopback_ring = interrupt_ring_new_classes(NETWORK_RING_SIZE,
+      NETWORK_RX_PRIORITIES, network_handler);
+  netem_ring = interrupt_ring_new_classes(NETWORK_RING_SIZE,
+      NETWORK_RX_PRIORITIES, network_handler);
+  txsched_ring = interrupt_ring_new_classes(NETWORK_RING_SIZE,
+      NETWORK_RX_PRIORITIES, network_handler);
+  AbortOnCondition(loopback_ring == NULL || netem_ring == NULL ||
+      txsched_ring == NULL, "interrupt_ring_new");
+  interrupt_ring_set_weight(loopback_ring, control_weight);
+  interrupt_ring_set_weight(netem_ring, control_weight);
+  interrupt_ring_set_weight(txsched_ring, control_weight);
+
+  /* a single queue shares the devices' poller, several get a thread each */
+  for (i = 0; i < n_queues; i++) {
+    struct net_queue* q = &queues[i];
+
+    q->ring = interrupt_ring_new_classes(NETWORK_RING_SIZE,
+        NETWORK_RX_PRIORITIES, network_handler);
+    AbortOnCondition(q->ring == NULL, "interrupt_ring_new");
+    interrupt_ring_set_weight(q->ring, control_weight);
+    q->poller = n_queues == 1 ? devpoll_system() : devpoll_new();
+    AbortOnCondition(q->poller == NULL, "devpoll_new");
+    AbortOnCondition(devpoll_add(q->poller, q->sock, network_readable, q),
+        "devpoll_add");
+  }
+
   pthread_sigmask(SIG_SETMASK,&old_set,NULL);
 }
 
 int
 network_initialize(network_handler_t network_handler) {
   int arg = 1;
+  int i;
   mini_network_handler=(interrupt_handler_t) network_handler;
+  network_initialized = 1;
 
   memset(&if_info, 0, sizeof(if_info));
 
-  if_info.sock = socket(PF_INET, SOCK_DGRAM, 0);
-  if (if_info.sock < 0)  {
-    perror("socket");
-    return -1;
+  sgenrand_r(&network_random, sim_seed(SIM_STREAM_NETWORK, 4357));
+
+  /* in simulation mode there is no socket; see sim_send_pkt */
+  if (sim_enabled) {
+    network_get_my_address(sim_my_addr);
+    if (BCAST_ENABLED)
+      bcast_initialize(BCAST_TOPOLOGY_FILE, BCAST_TOPOLOGY_BINARY);
+    netem_initialize(NETEM_CONFIG_FILE, netem_release);
+    txsched_initialize(txsched_release);
+    return 0;
   }
 
   if_info.sin.sin_family = SOCK_DGRAM;
   if_info.sin.sin_addr.s_addr = htonl(0);
   if_info.sin.sin_port = htons(my_udp_port);
-  if (bind(if_info.sock, (struct sockaddr *) &if_info.sin,
-           sizeof(if_info.sin)) < 0)  {
-    /* kprintf("Error: code %ld.\n", GetLastError());*/
-    AbortOnError(0);
-    perror("bind");
-    return -1;
-  }
 
-  /* set for fast reuse */
-  assert(setsockopt(if_info.sock, SOL_SOCKET, SO_REUSEADDR,
-                    (char *) &arg, sizeof(int)) == 0);
+  for (i = 0; i < n_queues; i++) {
+    queues[i].sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (queues[i].sock < 0)  {
+      perror("socket");
+      return -1;
+    }
+
+    /* set for fast reuse, and to share the port between the queues */
+    assert(setsockopt(queues[i].sock, SOL_SOCKET, SO_REUSEADDR,
+                      (char *) &arg, sizeof(int)) == 0);
+    if (n_queues > 1 &&
+        setsockopt(queues[i].sock, SOL_SOCKET, SO_REUSEPORT,
+                   (char *) &arg, sizeof(int)) < 0) {
+      perror("SO_REUSEPORT");
+      return -1;
+    }
+
+    if (bind(queues[i].sock, (struct sockaddr *) &if_info.sin,
+             sizeof(if_info.sin)) < 0)  {
+      /* kprintf("Error: code %ld.\n", GetLastError());*/
+      AbortOnError(0);
+      perror("bind");
+      return -1;
+    }
+  }
 
   if (BCAST_ENABLED)
-    bcast_initialize(BCAST_TOPOLOGY_FILE, &topology);
+    bcast_initialize(BCAST_TOPOLOGY_FILE, BCAST_TOPOLOGY_BINARY);
+  netem_initialize(NETEM_CONFIG_FILE, netem_release);
+  txsched_initialize(txsched_release);
 
   /*
    * Interrupts are handled through the caller's handler.
    */
 
-  start_network_poll(mini_network_handler, &if_info.sock);
+  start_network_poll(mini_network_handler);
 
   return 0;
 }
-
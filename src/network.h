@@ -10,13 +10,20 @@
  *      same or different hosts.
  */
 
-#define MAX_NETWORK_PKT_SIZE    8192
+#include <sys/uio.h>
+
+#define MAX_NETWORK_PKT_SIZE    8192 /* the default MTU */
+#define MIN_NETWORK_MTU         576
+#define MAX_NETWORK_MTU         65507 /* the most a UDP datagram holds */
+#define MAX_NETWORK_IOV         8 /* pieces per network_send_pktv */
+#define MAX_NETWORK_SEGMENTS    64 /* packets per sendmmsg call */
 
 #define BCAST_ENABLED 1
 #define BCAST_USE_TOPOLOGY_FILE 1
 #define BCAST_ADDRESS "192.168.1.255"
 #define BCAST_LOOPBACK 1
 #define BCAST_TOPOLOGY_FILE "topology.txt"
+#define BCAST_TOPOLOGY_BINARY "topology.bin" /* see mktopo */
 
 /* network_address_t's should be treated as opaque types. See functions below */
 typedef unsigned int network_address_t[2];
@@ -25,17 +32,130 @@ typedef unsigned int network_address_t[2];
 *  Network interrupt handler                                                   *
 *******************************************************************************/
 
-/* the argument to the network interrupt handler */
+/*
+ * the argument to the network interrupt handler. buffer holds at least size
+ * bytes, but not necessarily network_mtu(): packets are kept in the
+ * smallest of a few buffer sizes they fit in.
+ */
 typedef struct {
     network_address_t sender;
-    char buffer[MAX_NETWORK_PKT_SIZE];
     int size;
+    int head; /* start of the unread part of buffer, see network_pkt_pull */
+    int refs; /* private to the network layer */
+    int size_class; /* private to the network layer */
+    char buffer[];
 } network_interrupt_arg_t;
 
 /* the type of an interrupt handler.  These functions are responsible for freeing
- * the argument that is passed in */
+ * the argument that is passed in, with network_free_pkt */
 typedef void (*network_handler_t)(network_interrupt_arg_t *arg);
 
+/*
+ * Drop a reference to a received packet; with the last one, the packet goes
+ * back to the pool it was allocated from. Packets are recycled rather than
+ * freed, so it must not be passed to free().
+ */
+void network_free_pkt(network_interrupt_arg_t *pkt);
+
+/*
+ * Take another reference to a packet, for a second holder that releases it
+ * with network_free_pkt.
+ */
+void network_hold_pkt(network_interrupt_arg_t *pkt);
+
+/*
+ * A packet is consumed front to back without copying: each layer pulls its
+ * header off and passes the packet up. network_pkt_pull returns the pulled
+ * len bytes, or NULL if fewer are left. network_pkt_push puts back len
+ * bytes that were pulled, and returns them, or NULL if fewer were pulled.
+ * network_pkt_data and network_pkt_len give the part not yet pulled.
+ */
+char* network_pkt_pull(network_interrupt_arg_t *pkt, int len);
+char* network_pkt_push(network_interrupt_arg_t *pkt, int len);
+char* network_pkt_data(network_interrupt_arg_t *pkt);
+int network_pkt_len(network_interrupt_arg_t *pkt);
+
+/*
+ * Memory a packet occupies, to account buffered packets against their
+ * port or socket.
+ */
+int network_pkt_bytes(network_interrupt_arg_t *pkt);
+
+/*
+ * Packets the receiver asks the host for in one recvmmsg call, from 1 to
+ * MAX_NETWORK_RECV_BATCH. Takes effect on the next call.
+ */
+#define MAX_NETWORK_RECV_BATCH 64
+void network_set_recv_batch(int batch);
+
+/* packet buffer sizes: small (acks, route replies), medium and full */
+#define NETWORK_PKT_CLASSES 3
+
+/*
+ * Receive queues, from 1 to MAX_NETWORK_QUEUES; call before
+ * network_initialize, after which it returns -1 and changes nothing.
+ * Each queue is a socket bound to the same port with SO_REUSEPORT, read by
+ * a poller thread of its own into an interrupt ring of its own. The kernel
+ * assigns flows to queues by address and port hash, and a destination is
+ * always sent to through the same socket.
+ *
+ * With more than one queue, a second process of the same user binds the
+ * port without error, instead of failing as a single queue does, and the
+ * kernel hands it some of the flows.
+ */
+#define MAX_NETWORK_QUEUES 8
+int network_set_queues(int n);
+
+/*
+ * The largest packet sent or received, from MIN_NETWORK_MTU to
+ * MAX_NETWORK_MTU; call before network_initialize, after which it
+ * returns -1 and changes nothing. Packets to ourselves never leave the
+ * process, so jumbo packets cost nothing there; to other hosts, packets
+ * larger than the link's own MTU are fragmented by IP, and lost whole with
+ * any fragment.
+ */
+int network_set_mtu(int mtu);
+int network_mtu();
+
+/*
+ * Received packets are delivered by priority: control packets (connection
+ * setup and teardown, acknowledgments, route replies) ahead of bulk data
+ * that arrived before them, so that they are not held up behind it. The
+ * classifier, set by the layer above, sorts a packet by its first len
+ * bytes; without one every packet is bulk. Packets of a priority keep
+ * their order.
+ */
+enum { NETWORK_RX_CONTROL = 0, NETWORK_RX_BULK, NETWORK_RX_PRIORITIES };
+typedef int (*network_classifier_t)(char *packet, int len);
+void network_set_classifier(network_classifier_t classifier);
+
+/*
+ * Control packets delivered in a row while bulk data waits, after which
+ * one bulk packet goes, so that a flood of control packets cannot starve
+ * the data; 0 for strict priority. Takes effect at once.
+ */
+#define NETWORK_RX_CONTROL_WEIGHT 16
+void network_set_control_weight(int weight);
+
+/* receive counters, see network_recv_stats */
+typedef struct network_recv_stats {
+    long calls; /* recvmmsg calls */
+    long packets; /* packets received */
+    long max_batch; /* most packets received by one call */
+    long batch_hist[MAX_NETWORK_RECV_BATCH + 1]; /* calls by packets received */
+    long pool_allocs; /* packets allocated from the host */
+    long pool_reuses; /* packets taken from the pool */
+    long copied; /* packets copied down into a smaller buffer */
+    long class_packets[NETWORK_PKT_CLASSES]; /* packets allocated by size */
+    long queue_packets[MAX_NETWORK_QUEUES]; /* packets received by queue */
+    long loopback; /* packets sent to ourselves, not through the socket */
+    long priority_packets[NETWORK_RX_PRIORITIES]; /* packets by priority */
+    long priority_depth[NETWORK_RX_PRIORITIES]; /* packets waiting now */
+    long priority_max_depth[NETWORK_RX_PRIORITIES]; /* most in one queue */
+} network_recv_stats_t;
+
+void network_recv_stats(network_recv_stats_t *stats);
+
 /*
  * network_initialize should be called before clock interrupts start
  * happening (or with clock interrupts disabled).  The initialization
@@ -71,6 +191,30 @@ network_send_pkt(network_address_t dest_address,
                  int hdr_len, char * hdr,
                  int  data_len, char * data);
 
+/*
+ * Sends the iovcnt pieces in iov as one packet, without first copying them
+ * into a contiguous buffer. Like network_send_pkt, it may be called by any
+ * number of minithreads at once.
+ */
+int
+network_send_pktv(network_address_t dest_address,
+                  struct iovec* iov, int iovcnt);
+
+/*
+ * Segmentation offload: sends data_len bytes of data as packets of at most
+ * seg_size data bytes, each behind the same hdrcnt header pieces, at most
+ * MAX_NETWORK_IOV - 1 of them. The headers and a segment must fit in
+ * network_mtu(). Segments to another host go out with one sendmmsg call
+ * per MAX_NETWORK_SEGMENTS; when they go to ourselves or to an emulated
+ * link, or are scheduled, they are sent one by one, as network_send_pktv
+ * would. No data sends one packet of just the headers. Returns the data
+ * bytes sent, or -1 if none were.
+ */
+int
+network_send_segments(network_address_t dest_address,
+                      struct iovec* hdr, int hdrcnt,
+                      char* data, int data_len, int seg_size);
+
 int
 network_bcast_pkt(int hdr_len, char* hdr, int data_len, char* data);
 
@@ -87,8 +231,15 @@ network_bcast_pkt(int hdr_len, char* hdr, int data_len, char* data);
  */
 void network_get_my_address(network_address_t my_address);
 
+/*
+ * The local address is resolved once and cached; this resolves it again,
+ * e.g. after the host's address changed.
+ */
+void network_refresh_my_address();
+
 /* look up the given host and return the corresponding network address.
- * Returns TODO
+ * Returns 0 on success, -1 if the name does not resolve. Resolved names
+ * are cached for a minute.
  */
 int network_translate_hostname(char* hostname, network_address_t address);
 
@@ -120,5 +271,14 @@ network_add_bcast_link(char* src, char* dest);
 void
 network_remove_bcast_link(char* src, char* dest);
 
+/*
+ * Replace the broadcast topology with the one in file, text or binary (see
+ * topology.h), without restarting; links changed since the last load are
+ * lost. Broadcasts already going out finish on the old topology. Returns
+ * 0, or -1 if the file cannot be read, which keeps the current topology.
+ */
+int
+network_load_topology(char* file);
+
 #endif /*__NETWORK_H_*/
 
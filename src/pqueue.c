@@ -5,6 +5,7 @@
 #include "pqueue.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include "slab.h"
 
 #define checkNull(q) if( !(q) ) { return -1; }
 
@@ -20,6 +21,9 @@ struct node
     node_t next; // Pointer to next node
 };
 
+static struct slab_cache node_cache =
+    SLAB_CACHE_INITIALIZER("pqueue node", sizeof(struct node), NULL);
+
 /*
  * Struct representing a priority queue backed by a singly-linked list
  */
@@ -54,7 +58,7 @@ pqueue_enqueue(pqueue_t pqueue, void *data, int priority) {
     checkNull(pqueue);
 
     // Mallocs a new node
-    n = (node_t) malloc (sizeof(struct node));
+    n = (node_t) slab_alloc(&node_cache);
     checkNull(n);
 
     n->data = data;
@@ -111,7 +115,7 @@ pqueue_dequeue(pqueue_t pqueue, void **data) {
 
     // Frees node
     *data = n->data;
-    free(n);
+    slab_free(&node_cache, n);
 
     pqueue->length--;
     return 0;
@@ -153,7 +157,7 @@ pqueue_free (pqueue_t pqueue) {
     // Iterates over queue
     while (n) {
         temp = n->next;
-        free(n); // Frees each node
+        slab_free(&node_cache, n); // Frees each node
 
         n = temp;
     }
@@ -204,7 +208,7 @@ pqueue_delete(pqueue_t pqueue, void *item) {
             }
 
             // Frees the node
-            free(n);
+            slab_free(&node_cache, n);
             pqueue->length--;
             return 0;
         }
@@ -0,0 +1,259 @@
+/*
+ * Statistical sampling profiler driven by the virtual processor's signals.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+
+#include "defs.h"
+#include "interrupts.h"
+#include "minithread.h"
+#include "profiler.h"
+
+#define RBP 10
+#define RSP 15
+#define RIP 16
+
+#define PROFILER_SIGNAL (SIGRTMAX-3)
+
+typedef struct profiler_sample {
+    int thread_id;
+    int depth;
+    uint64_t pc[PROFILER_MAX_DEPTH]; // pc[0] is the interrupted instruction
+} profiler_sample_t;
+
+/*
+ * The ring is filled by the signal handler and drained by profiler_dump.
+ * Both run on the virtual processor, so the handler may interrupt a dump
+ * in progress but never the other way around: only head is written by the
+ * producer and only tail by the consumer.
+ */
+static profiler_sample_t ring[PROFILER_RING_SIZE];
+static volatile unsigned long ring_head;
+static volatile unsigned long ring_tail;
+
+static volatile long samples_taken;
+static volatile long samples_dropped;
+
+volatile int profiler_running = 0;
+
+static timer_t profiler_timer;
+static volatile int profiler_timer_armed = 0;
+
+/*
+ * Record one sample. The two handlers that take samples block each other,
+ * so the ring has a single producer at a time. Walks the saved frame
+ * pointers upwards from the interrupted frame, refusing to follow any
+ * pointer that does not lie inside the running minithread's own stack.
+ * The system thread runs on the process stack, whose bounds we do not
+ * know, so only its pc is kept.
+ */
+static void take_sample(uint64_t rip, uint64_t rbp, uint64_t rsp) {
+    profiler_sample_t *s;
+    minithread_t self;
+    stack_pointer_t base;
+    stack_pointer_t limit;
+    uint64_t fp;
+    uint64_t next;
+
+    if (ring_head - ring_tail >= PROFILER_RING_SIZE) { // Ring is full
+        samples_dropped++;
+        return;
+    }
+
+    s = &ring[ring_head & (PROFILER_RING_SIZE - 1)];
+    self = minithread_self();
+    s->thread_id = self ? minithread_id() : -1;
+    s->pc[0] = rip;
+    s->depth = 1;
+
+    if (minithread_stack_range(self, &base, &limit) == 0) {
+        fp = rbp;
+        while (s->depth < PROFILER_MAX_DEPTH) {
+            if (fp < rsp || fp < (uint64_t) base ||
+                fp + 2 * sizeof(uint64_t) > (uint64_t) limit || (fp & 7) != 0)
+                break;
+            s->pc[s->depth++] = ((uint64_t *) fp)[1]; // Return address
+            next = ((uint64_t *) fp)[0]; // Caller's frame pointer
+            if (next <= fp) break; // Frames must move towards the stack base
+            fp = next;
+        }
+    }
+
+    __sync_synchronize(); // Publish the slot before advancing head
+    ring_head++;
+    samples_taken++;
+}
+
+/*
+ * A clock tick's sample, which the dedicated timer replaces while armed:
+ * taking both would count the ticks twice.
+ */
+void profiler_sample(uint64_t rip, uint64_t rbp, uint64_t rsp) {
+    if (profiler_timer_armed) return;
+    take_sample(rip, rbp, rsp);
+}
+
+/*
+ * Handler for the dedicated profiling timer.
+ */
+static void profiler_signal(int sig, siginfo_t *si, ucontext_t *ucontext) {
+    if (!profiler_running) return;
+    take_sample(ucontext->uc_mcontext.gregs[RIP],
+                    ucontext->uc_mcontext.gregs[RBP],
+                    ucontext->uc_mcontext.gregs[RSP]);
+}
+
+/*
+ * Arms a CPU-time timer that signals the calling (virtual processor)
+ * thread every [period] nanoseconds.
+ */
+static int start_profiler_timer(int period) {
+    struct sigevent sev;
+    struct itimerspec its;
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = (void *) profiler_signal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    /*
+     * This handler lives between start and end, so an interrupt taken
+     * inside it would be mistaken for a preemptible minithread.
+     */
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGRTMAX-1);
+    sigaddset(&sa.sa_mask, SIGRTMAX-2);
+    if (sigaction(PROFILER_SIGNAL, &sa, NULL) == -1)
+        return -1;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = PROFILER_SIGNAL;
+    sev._sigev_un._tid = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &profiler_timer) == -1)
+        return -1;
+
+    its.it_value.tv_sec = period / SECOND;
+    its.it_value.tv_nsec = period % SECOND;
+    its.it_interval = its.it_value;
+    if (timer_settime(profiler_timer, 0, &its, NULL) == -1) {
+        timer_delete(profiler_timer);
+        return -1;
+    }
+    profiler_timer_armed = 1;
+    return 0;
+}
+
+/*
+ * Start sampling. A period of 0 samples on clock interrupts only.
+ */
+int profiler_start(int period) {
+    if (profiler_running) return -1;
+
+    samples_taken = 0;
+    samples_dropped = 0;
+
+    if (period > 0 && start_profiler_timer(period) == -1)
+        return -1;
+
+    profiler_running = 1;
+    return 0;
+}
+
+/*
+ * Stop sampling
+ */
+void profiler_stop() {
+    profiler_running = 0;
+    if (profiler_timer_armed) {
+        timer_delete(profiler_timer);
+        profiler_timer_armed = 0;
+    }
+}
+
+void profiler_stats(long *taken, long *dropped) {
+    if (taken) *taken = samples_taken;
+    if (dropped) *dropped = samples_dropped;
+}
+
+/*
+ * Orders samples by thread, then by stack, so that identical stacks are
+ * adjacent after sorting.
+ */
+static int compare_samples(const void *a, const void *b) {
+    const profiler_sample_t *x = (const profiler_sample_t *) a;
+    const profiler_sample_t *y = (const profiler_sample_t *) b;
+    int i;
+
+    if (x->thread_id != y->thread_id)
+        return x->thread_id < y->thread_id ? -1 : 1;
+    if (x->depth != y->depth)
+        return x->depth < y->depth ? -1 : 1;
+    for (i = x->depth - 1; i >= 0; i--) {
+        if (x->pc[i] != y->pc[i])
+            return x->pc[i] < y->pc[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static void write_folded(FILE *out, profiler_sample_t *s, int count) {
+    int i;
+
+    fprintf(out, "thread_%d", s->thread_id);
+    for (i = s->depth - 1; i >= 0; i--) { // Outermost frame first
+        fprintf(out, ";0x%" PRIx64, s->pc[i]);
+    }
+    fprintf(out, " %d\n", count);
+}
+
+/*
+ * Drain the ring into a folded stacks file. Returns the number of samples
+ * written, or -1 on failure.
+ */
+int profiler_dump(char *filename) {
+    profiler_sample_t *samples;
+    unsigned long head;
+    unsigned long tail;
+    FILE *out;
+    int n;
+    int i;
+    int run;
+
+    out = fopen(filename, "w");
+    if (!out) return -1;
+
+    head = ring_head;
+    tail = ring_tail;
+    n = head - tail;
+
+    samples = (profiler_sample_t *) malloc (sizeof(profiler_sample_t) *
+                                            (n ? n : 1));
+    if (!samples) {
+        fclose(out);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        samples[i] = ring[(tail + i) & (PROFILER_RING_SIZE - 1)];
+    }
+    ring_tail = head; // Hand the slots back to the producer
+
+    qsort(samples, n, sizeof(profiler_sample_t), compare_samples);
+
+    run = 0;
+    for (i = 0; i < n; i++) {
+        run++;
+        if (i == n - 1 || compare_samples(&samples[i], &samples[i + 1]) != 0) {
+            write_folded(out, &samples[i], run);
+            run = 0;
+        }
+    }
+
+    free(samples);
+    fclose(out);
+    return n;
+}
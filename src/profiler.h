@@ -0,0 +1,61 @@
+/*
+ * Statistical sampling profiler.
+ *
+ * Samples are taken from the signal handler that drives the virtual
+ * processor: either on every clock interrupt, or on a dedicated profiling
+ * timer that ticks much faster than the scheduler quantum.  Each sample
+ * records the interrupted instruction pointer, the id of the running
+ * minithread (-1 for the idle/system thread) and a short frame pointer
+ * walk of the interrupted stack (the library is built with
+ * -fno-omit-frame-pointer).
+ *
+ * Samples are kept in a single-producer/single-consumer ring that the
+ * signal handler fills without taking any locks.  profiler_dump() drains
+ * the ring into a "folded stacks" file that can be fed straight to
+ * flamegraph.pl.  Frames are written as raw addresses; symbolize them with
+ * addr2line -f -e <binary> before rendering.
+ */
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <inttypes.h>
+
+#define PROFILER_MAX_DEPTH 16
+#define PROFILER_RING_SIZE 4096 /* must be a power of 2 */
+
+/*
+ * Start sampling.  If period is 0, a sample is taken on every clock
+ * interrupt.  Otherwise a separate CPU-time timer fires every [period]
+ * nanoseconds (see interrupts.h for the time units).
+ * Returns 0 on success, -1 on failure.
+ */
+extern int profiler_start(int period);
+
+/*
+ * Stop sampling.  Samples still in the ring are kept until the next dump.
+ */
+extern void profiler_stop();
+
+/*
+ * Drain the sample ring into [filename] in folded stacks format, one line
+ * per distinct (thread, stack) pair:
+ *     thread_<id>;0x<outermost>;...;0x<interrupted pc> <count>
+ * Returns the number of samples written, or -1 on failure.
+ */
+extern int profiler_dump(char *filename);
+
+/*
+ * Number of samples taken and dropped (ring full) since profiler_start.
+ */
+extern void profiler_stats(long *taken, long *dropped);
+
+/*
+ * Record one sample on a clock tick, unless the profiler has a timer of
+ * its own.  Called from the interrupt layer's signal handler with the
+ * interrupted register state; must stay async-signal-safe.
+ */
+extern void profiler_sample(uint64_t rip, uint64_t rbp, uint64_t rsp);
+
+extern volatile int profiler_running;
+
+#endif /*__PROFILER_H__*/
@@ -5,6 +5,7 @@
 #include "queue.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include "slab.h"
 
 #define checkNull(q) if( !(q) ) { return -1; }
 
@@ -16,6 +17,9 @@ struct node
     node_t next;
 };
 
+static struct slab_cache node_cache =
+    SLAB_CACHE_INITIALIZER("queue node", sizeof(struct node), NULL);
+
 /*
  * Struct representing a queue backed by a singly-linked list
  */
@@ -50,7 +54,7 @@ queue_prepend(queue_t queue, void* item) {
     checkNull(queue);
 
     // Mallocs a new node
-    n = (node_t) malloc (sizeof(struct node));
+    n = (node_t) slab_alloc(&node_cache);
     checkNull(n);
 
     n->data = item;
@@ -75,7 +79,7 @@ queue_append(queue_t queue, void* item) {
     checkNull(queue);
 
     // Mallocs a new node
-    n = (node_t) malloc (sizeof(struct node));
+    n = (node_t) slab_alloc(&node_cache);
     checkNull(n);
 
     n->data = item;
@@ -120,7 +124,7 @@ queue_dequeue(queue_t queue, void** item) {
 
     // Frees node
     *item = n->data;
-    free(n);
+    slab_free(&node_cache, n);
 
     queue->length--;
     return 0;
@@ -187,7 +191,7 @@ queue_free (queue_t queue) {
     // Iterates over queue
     while (n) {
         temp = n->next;
-        free(n); // Frees each node
+        slab_free(&node_cache, n); // Frees each node
 
         n = temp;
     }
@@ -243,7 +247,7 @@ queue_delete(queue_t queue, void* item) {
             }
 
             // Frees the node
-            free(n);
+            slab_free(&node_cache, n);
             queue->length--;
             return 0;
         }
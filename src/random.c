@@ -28,9 +28,10 @@
 /* matumoto@math.keio.ac.jp                                        */
 
 #include<stdio.h>
+#include "random.h"
 
 /* Period parameters */
-#define N 624
+#define N RANDOM_STATE_WORDS
 #define M 397
 #define MATRIX_A 0x9908b0df   /* constant vector a */
 #define UPPER_MASK 0x80000000 /* most significant w-r bits */
@@ -44,14 +45,18 @@
 #define TEMPERING_SHIFT_T(y)  (y << 15)
 #define TEMPERING_SHIFT_L(y)  (y >> 18)
 
-static unsigned long mt[N]; /* the array for the state vector  */
-static int mti=N+1; /* mti==N+1 means mt[N] is not initialized */
+/* the default generator; mti==N+1 means mt[N] is not initialized */
+static random_state_t default_state = { {0}, N+1 };
 
 /* initializing the array with a NONZERO seed */
 void
-sgenrand(seed)
+sgenrand_r(state, seed)
+    random_state_t *state;
     unsigned long seed;
 {
+    unsigned long *mt = state->mt;
+    int mti;
+
     /* setting initial seeds to mt[N] using         */
     /* the generator Line 25 of Table 1 in          */
     /* [KNUTH 1981, The Art of Computer Programming */
@@ -59,21 +64,24 @@ sgenrand(seed)
     mt[0]= seed & 0xffffffff;
     for (mti=1; mti<N; mti++)
         mt[mti] = (69069 * mt[mti-1]) & 0xffffffff;
+    state->mti = mti;
 }
 
 double /* generating reals */
 /* unsigned long */ /* for integer generation */
-genrand()
+genrand_r(state)
+    random_state_t *state;
 {
+    unsigned long *mt = state->mt;
     unsigned long y;
     static unsigned long mag01[2]={0x0, MATRIX_A};
     /* mag01[x] = x * MATRIX_A  for x=0,1 */
 
-    if (mti >= N) { /* generate N words at one time */
+    if (state->mti >= N) { /* generate N words at one time */
         int kk;
 
-        if (mti == N+1)   /* if sgenrand() has not been called, */
-            sgenrand(4357); /* a default initial seed is used   */
+        if (state->mti == N+1)   /* if sgenrand() has not been called, */
+            sgenrand_r(state, 4357); /* a default initial seed is used   */
 
         for (kk=0;kk<N-M;kk++) {
             y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
@@ -86,10 +94,10 @@ genrand()
         y = (mt[N-1]&UPPER_MASK)|(mt[0]&LOWER_MASK);
         mt[N-1] = mt[M-1] ^ (y >> 1) ^ mag01[y & 0x1];
 
-        mti = 0;
+        state->mti = 0;
     }
 
-    y = mt[mti++];
+    y = mt[state->mti++];
     y ^= TEMPERING_SHIFT_U(y);
     y ^= TEMPERING_SHIFT_S(y) & TEMPERING_MASK_B;
     y ^= TEMPERING_SHIFT_T(y) & TEMPERING_MASK_C;
@@ -99,7 +107,24 @@ genrand()
     /* return y; */ /* for integer generation */
 }
 
-unsigned int genintrand(unsigned int maxval){
+unsigned int genintrand_r(random_state_t *state, unsigned int maxval){
   return (unsigned long)
-    (genrand()* (unsigned long)0xffffffff ) % maxval +1;
+    (genrand_r(state)* (unsigned long)0xffffffff ) % maxval +1;
+}
+
+void
+sgenrand(seed)
+    unsigned long seed;
+{
+    sgenrand_r(&default_state, seed);
+}
+
+double
+genrand()
+{
+    return genrand_r(&default_state);
+}
+
+unsigned int genintrand(unsigned int maxval){
+  return genintrand_r(&default_state, maxval);
 }
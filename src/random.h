@@ -31,9 +31,24 @@
 #ifndef __RANDOM_H__
 #define __RANDOM_H__
 
+#define RANDOM_STATE_WORDS 624
+
+/*
+ * An independent generator. Seed it with sgenrand_r before drawing from it,
+ * so that separate modules get separate, reproducible streams.
+ */
+typedef struct random_state {
+    unsigned long mt[RANDOM_STATE_WORDS];
+    int mti;
+} random_state_t;
+
 void   sgenrand(unsigned long);
 double genrand();
 unsigned int genintrand(unsigned int);
 
+void   sgenrand_r(random_state_t *, unsigned long);
+double genrand_r(random_state_t *);
+unsigned int genintrand_r(random_state_t *, unsigned int);
+
 #endif
 
@@ -1,16 +1,22 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 #include "read.h"
 #include "read_private.h"
 #include "minithread.h"
 #include "synch.h"
 #include "interrupts.h"
+#include "interrupts_private.h"
+#include "devpoll.h"
 #include  <signal.h>
 
 
 #define MAX_LINE_LENGTH 512
 #define READ_INTERRUPT_TYPE 3
+#define READ_RING_SIZE 16
 
 struct kb_line {
 	struct kb_line* next;
@@ -22,6 +28,8 @@ struct kb_line* kb_tail;
 
 semaphore_t new_data;
 
+static interrupt_ring_t read_ring;
+
 void read_handler(void* arg) {
 	struct kb_line* node = (struct kb_line*) arg;
 	set_interrupt_level(DISABLED);
@@ -38,17 +46,71 @@ void read_handler(void* arg) {
 	semaphore_V(new_data);
 }
 
+/* The line being assembled from stdin by the device poller */
+static struct kb_line* partial;
+static int partial_len;
+
+/*
+ * Called on the device poller when stdin is readable. Splits the input
+ * into lines the way fgets does: after each newline, or when a line
+ * fills the buffer. Posting waits while the ring is full, holding up the
+ * other devices on the poller until the virtual processor drains it;
+ * the handler only queues the line, so that is never long.
+ */
+static void stdin_readable(int fd, void* arg) {
+	char buf[MAX_LINE_LENGTH];
+	int n;
+	int i;
+
+	n = read(fd, buf, sizeof(buf));
+	if (n < 0 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		/* end of input; fgets would return a last line without a newline */
+		if (partial != NULL) {
+			partial->buf[partial_len] = 0;
+			interrupt_ring_post(read_ring, partial);
+			partial = NULL;
+		}
+		devpoll_remove(devpoll_system(), fd);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (partial == NULL) {
+			partial = (struct kb_line*) malloc(sizeof(struct kb_line));
+			AbortOnCondition(partial == NULL, "malloc");
+			partial->next = NULL;
+			partial_len = 0;
+		}
+		partial->buf[partial_len++] = buf[i];
+		if (buf[i] == '\n' || partial_len == MAX_LINE_LENGTH - 1) {
+			partial->buf[partial_len] = 0;
+			interrupt_ring_post(read_ring, partial);
+			partial = NULL;
+		}
+	}
+}
+
+/*
+ * Reads stdin on a thread of its own when it is a regular file, which
+ * epoll cannot watch.
+ */
 int read_poll(void* arg) {
 
 	struct kb_line* new_node;
 
 	while (1) {
 		new_node = (struct kb_line*) malloc(sizeof(struct kb_line));
+		AbortOnCondition(new_node == NULL, "malloc");
 		new_node->next = NULL;
 
-		fgets(new_node->buf, MAX_LINE_LENGTH, stdin);
+		if (fgets(new_node->buf, MAX_LINE_LENGTH, stdin) == NULL) {
+			free(new_node);
+			return 0;
+		}
 
-		send_interrupt(READ_INTERRUPT_TYPE, read_handler, new_node);
+		interrupt_ring_post(read_ring, new_node);
 	}
 }
 
@@ -70,8 +132,13 @@ int miniterm_initialize() {
 	new_data = semaphore_create();
 	semaphore_initialize(new_data, 0);
 
-    AbortOnCondition(pthread_create(&read_thread, NULL, (void*)read_poll, NULL)!=0,
-      "pthread");
+	read_ring = interrupt_ring_new(READ_RING_SIZE, read_handler);
+	AbortOnCondition(read_ring == NULL, "interrupt_ring_new");
+
+	if (devpoll_add(devpoll_system(), fileno(stdin), stdin_readable, NULL) == -1) {
+		AbortOnCondition(pthread_create(&read_thread, NULL, (void*)read_poll, NULL)!=0,
+		  "pthread");
+	}
 
     sigdelset(&old_set,SIGRTMAX-2);
     sigdelset(&old_set,SIGRTMAX-1);
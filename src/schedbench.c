@@ -0,0 +1,335 @@
+/* schedbench
+
+    Scheduling latency and fairness benchmark. Runs a mix of thread classes
+    under the scheduler for a fixed time and reports, per class, wakeup
+    latency percentiles, share of the CPU and starvation incidents.
+
+    USAGE: ./schedbench <spinners> <sleepers> <pairs> <forkers>
+                        [<seconds> [<sleep_ms> [<starve_ms>]]]
+
+    spinners  = CPU-bound threads that never block.
+    sleepers  = threads that do a little work, then sleep for sleep_ms.
+    pairs     = pairs of threads that ping-pong over two semaphores.
+    forkers   = threads that fork a burst of short-lived workers, then
+                sleep for sleep_ms.
+    seconds   = length of the run (default 10).
+    sleep_ms  = sleep period of sleepers and forkers (default 200).
+    starve_ms = a thread that waits this long to run after waking, or a
+                spinner that makes no progress in this long, counts as a
+                starvation incident (default 2000).
+
+    Wakeup latency is the time between a thread being made runnable and
+    it running, as recorded by the scheduler. CPU share is measured in
+    clock ticks charged to the running thread.
+*/
+
+#include "defs.h"
+#include "minithread.h"
+#include "synch.h"
+#include "disk.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_THREADS 256
+#define MAX_SAMPLES 100000
+#define WORK 200000 // Iterations of one unit of work
+#define BURST 4 // Workers forked per forker burst
+
+typedef enum { SPINNER = 0, SLEEPER, PAIR, FORKER, CLASSES } class_t;
+
+static char *class_names[CLASSES] = { "spinner", "sleeper", "pair", "forker" };
+
+typedef struct class_stats {
+    int threads;
+    long samples[MAX_SAMPLES]; // Wakeup latencies in nanoseconds
+    int n_samples;
+    long dropped; // Samples that did not fit
+    long run_ticks; // Ticks of threads that have exited
+    long work; // Units of work done
+    long starved;
+} class_stats_t;
+
+static class_stats_t stats[CLASSES];
+
+static minithread_t threads[MAX_THREADS];
+static class_t thread_class[MAX_THREADS];
+static int n_threads;
+
+static volatile long progress[MAX_THREADS]; // Work done by each spinner
+
+static int seconds = 10;
+static int sleep_ms = 200;
+static int starve_ms = 2000;
+static volatile int stop = 0;
+
+static volatile long sink;
+
+static void work() {
+    long i;
+    for (i = 0; i < WORK; i++) {
+        sink += i;
+    }
+}
+
+/*
+ * Counters are shared between preemptible threads
+ */
+static void count(long *c, long n) {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    *c += n;
+    set_interrupt_level(old_level);
+}
+
+/*
+ * Record the latency of the last wakeup, if the thread was woken since
+ * [*wakeups] was read.
+ */
+static void record(class_t c, long *wakeups) {
+    minithread_stats_t s;
+    class_stats_t *cs = &stats[c];
+    interrupt_level_t old_level;
+
+    minithread_sched_stats(minithread_self(), &s);
+    if (s.wakeups == *wakeups) return;
+    *wakeups = s.wakeups;
+
+    old_level = set_interrupt_level(DISABLED);
+    if (s.wakeup_latency >= (long) starve_ms * MILLISECOND) {
+        cs->starved++;
+    }
+    if (cs->n_samples < MAX_SAMPLES) {
+        cs->samples[cs->n_samples++] = s.wakeup_latency;
+    } else {
+        cs->dropped++;
+    }
+    set_interrupt_level(old_level);
+}
+
+static void add_thread(minithread_t t, class_t c) {
+    AbortOnCondition(n_threads == MAX_THREADS, "Too many threads.");
+    threads[n_threads] = t;
+    thread_class[n_threads] = c;
+    n_threads++;
+    stats[c].threads++;
+}
+
+int spinner(int *arg) {
+    int i = *arg;
+
+    while (!stop) {
+        work();
+        progress[i]++;
+    }
+    return 0;
+}
+
+int sleeper(int *arg) {
+    long wakeups = 0;
+
+    while (!stop) {
+        work();
+        count(&stats[SLEEPER].work, 1);
+        minithread_sleep_with_timeout(sleep_ms);
+        record(SLEEPER, &wakeups);
+    }
+    return 0;
+}
+
+typedef struct pair {
+    semaphore_t mine;
+    semaphore_t other;
+} pair_t;
+
+int pinger(int *arg) {
+    pair_t *p = (pair_t *) arg;
+    long wakeups = 0;
+
+    while (!stop) {
+        semaphore_P(p->mine);
+        record(PAIR, &wakeups);
+        work();
+        count(&stats[PAIR].work, 1);
+        semaphore_V(p->other);
+    }
+    semaphore_V(p->other);
+    return 0;
+}
+
+int worker(int *arg) {
+    long wakeups = 0;
+    minithread_stats_t s;
+
+    record(FORKER, &wakeups); // Latency from fork to first run
+    work();
+    count(&stats[FORKER].work, 1);
+
+    minithread_sched_stats(minithread_self(), &s);
+    count(&stats[FORKER].run_ticks, s.run_ticks);
+    return 0;
+}
+
+int forker(int *arg) {
+    long wakeups = 0;
+    int i;
+
+    while (!stop) {
+        for (i = 0; i < BURST; i++) {
+            minithread_fork(worker, NULL);
+        }
+        minithread_sleep_with_timeout(sleep_ms);
+        record(FORKER, &wakeups);
+    }
+    return 0;
+}
+
+/*
+ * Counts spinners that made no progress over a starvation period.
+ */
+int monitor(int *arg) {
+    long last[MAX_THREADS];
+    int i;
+
+    for (i = 0; i < n_threads; i++) {
+        last[i] = progress[i];
+    }
+    while (!stop) {
+        minithread_sleep_with_timeout(starve_ms);
+        for (i = 0; i < n_threads; i++) {
+            if (thread_class[i] != SPINNER) continue;
+            if (progress[i] == last[i] && !stop) {
+                count(&stats[SPINNER].starved, 1);
+            }
+            last[i] = progress[i];
+        }
+    }
+    return 0;
+}
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static long percentile(class_stats_t *cs, int p) {
+    int i;
+    if (cs->n_samples == 0) return 0;
+    i = (cs->n_samples - 1) * p / 100;
+    return cs->samples[i];
+}
+
+static void report() {
+    minithread_stats_t s;
+    interrupt_latch_stats_t latch;
+    long ticks[CLASSES];
+    long total = 0;
+    class_stats_t *cs;
+    int i;
+
+    for (i = 0; i < CLASSES; i++) {
+        ticks[i] = stats[i].run_ticks;
+    }
+    for (i = 0; i < n_threads; i++) {
+        minithread_sched_stats(threads[i], &s);
+        ticks[thread_class[i]] += s.run_ticks;
+        if (thread_class[i] == SPINNER) {
+            stats[SPINNER].work += progress[i];
+        }
+    }
+    for (i = 0; i < CLASSES; i++) {
+        total += ticks[i];
+    }
+
+    printf("%-8s %7s %7s %9s %9s %9s %9s %9s %8s\n", "class", "threads",
+           "cpu%", "work", "p50(us)", "p90(us)", "p99(us)", "max(us)",
+           "starved");
+    for (i = 0; i < CLASSES; i++) {
+        cs = &stats[i];
+        if (cs->threads == 0) continue;
+        qsort(cs->samples, cs->n_samples, sizeof(long), compare_longs);
+        printf("%-8s %7d %6.1f%% %9ld %9ld %9ld %9ld %9ld %8ld\n",
+               class_names[i], cs->threads,
+               total ? 100.0 * ticks[i] / total : 0.0, cs->work,
+               percentile(cs, 50) / MICROSECOND,
+               percentile(cs, 90) / MICROSECOND,
+               percentile(cs, 99) / MICROSECOND,
+               percentile(cs, 100) / MICROSECOND,
+               cs->starved);
+        if (cs->dropped) {
+            printf("%-8s %ld latency samples dropped\n", "", cs->dropped);
+        }
+    }
+
+    interrupt_latch_stats(&latch);
+    printf("\ninterrupts latched %ld, max depth %d, delay avg %ld us, "
+           "max %ld us\n", latch.latched, latch.max_depth,
+           latch.delivered ? latch.total_delay / latch.delivered / MICROSECOND : 0,
+           latch.max_delay / MICROSECOND);
+}
+
+int run(int *arg) {
+    int *counts = arg;
+    int *ids;
+    pair_t *pairs;
+    int i;
+
+    ids = (int *) malloc (sizeof(int) * (counts[SPINNER] + 1));
+    pairs = (pair_t *) malloc (sizeof(pair_t) * (counts[PAIR] + 1));
+
+    for (i = 0; i < counts[SPINNER]; i++) {
+        ids[i] = n_threads;
+        add_thread(minithread_fork(spinner, &ids[i]), SPINNER);
+    }
+    for (i = 0; i < counts[SLEEPER]; i++) {
+        add_thread(minithread_fork(sleeper, NULL), SLEEPER);
+    }
+    for (i = 0; i < counts[PAIR]; i++) {
+        pair_t *back = (pair_t *) malloc (sizeof(pair_t));
+        pairs[i].mine = semaphore_create();
+        pairs[i].other = semaphore_create();
+        semaphore_initialize(pairs[i].mine, 1);
+        semaphore_initialize(pairs[i].other, 0);
+        back->mine = pairs[i].other;
+        back->other = pairs[i].mine;
+        add_thread(minithread_fork(pinger, (int *) &pairs[i]), PAIR);
+        add_thread(minithread_fork(pinger, (int *) back), PAIR);
+    }
+    for (i = 0; i < counts[FORKER]; i++) {
+        add_thread(minithread_fork(forker, NULL), FORKER);
+    }
+    minithread_fork(monitor, NULL);
+
+    minithread_sleep_with_timeout(seconds * 1000);
+    stop = 1;
+    report();
+    exit(0);
+    return 0;
+}
+
+int
+main(int argc, char** argv) {
+    static int counts[CLASSES];
+    int i;
+
+    if (argc < 5) {
+        printf("usage: schedbench <spinners> <sleepers> <pairs> <forkers> "
+               "[<seconds> [<sleep_ms> [<starve_ms>]]]\n");
+        return -1;
+    }
+    for (i = 0; i < CLASSES; i++) {
+        counts[i] = atoi(argv[i + 1]);
+    }
+    if (argc > 5) seconds = atoi(argv[5]);
+    if (argc > 6) sleep_ms = atoi(argv[6]);
+    if (argc > 7) starve_ms = atoi(argv[7]);
+
+    use_existing_disk = 0;
+    disk_name = "SCHEDBENCHDISK";
+    disk_flags = DISK_READWRITE;
+    disk_size = 100;
+
+    minithread_system_initialize(run, counts);
+    return -1;
+}
@@ -0,0 +1,105 @@
+/*
+ * Deterministic virtual-time simulation mode.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "interrupts.h"
+#include "minithread.h"
+#include "pqueue.h"
+#include "sim.h"
+
+typedef struct sim_event {
+    interrupt_handler_t handler; // Device handler to run
+    void *arg; // Argument to the handler
+    long tick; // Tick at which the event is delivered
+} *sim_event_t;
+
+int sim_enabled = 0;
+
+static unsigned long seed;
+static int disk_delay = SIM_DISK_DELAY;
+static int network_delay = SIM_NETWORK_DELAY;
+
+static pqueue_t events; // Pending events, ordered by tick
+
+/*
+ * Turn on simulation mode
+ */
+void sim_initialize(unsigned long s) {
+    seed = s;
+    events = pqueue_new();
+    sim_enabled = 1;
+}
+
+void sim_set_latency(int disk, int network) {
+    disk_delay = disk;
+    network_delay = network;
+}
+
+int sim_disk_delay() {
+    return disk_delay;
+}
+
+int sim_network_delay() {
+    return network_delay;
+}
+
+/*
+ * Streams get well separated seeds; the generator rejects a seed of 0.
+ */
+unsigned long sim_seed(int stream, unsigned long fallback) {
+    unsigned long s;
+
+    if (!sim_enabled) return fallback;
+
+    s = (seed + stream * 0x9e3779b9UL) & 0xffffffff;
+    return s ? s : 4357;
+}
+
+/*
+ * Schedule a device completion in virtual time
+ */
+int sim_schedule(int delay, interrupt_handler_t handler, void *arg) {
+    interrupt_level_t old_level;
+    sim_event_t e;
+    long ticks;
+
+    if (!sim_enabled || delay < 0) return -1;
+
+    e = (sim_event_t) malloc (sizeof(struct sim_event));
+    if ( !e ) return -1;
+
+    // Round up to a whole tick; an event never fires on the current tick
+    ticks = (delay + PERIOD - 1) / PERIOD;
+    if (ticks == 0) ticks = 1;
+
+    e->handler = handler;
+    e->arg = arg;
+
+    old_level = set_interrupt_level(DISABLED);
+    e->tick = time_ticks + ticks;
+    if (pqueue_enqueue(events, e, e->tick) == -1) {
+        set_interrupt_level(old_level);
+        free(e);
+        return -1;
+    }
+    set_interrupt_level(old_level);
+    return 0;
+}
+
+/*
+ * Deliver due events in order
+ */
+void sim_deliver(long tick) {
+    void *item;
+    sim_event_t e;
+
+    while (pqueue_peek(events, &item) == 0) {
+        e = (sim_event_t) item;
+        if (e->tick > tick) break;
+        pqueue_dequeue(events, &item);
+        e->handler(e->arg);
+        free(e);
+    }
+}
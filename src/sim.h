@@ -0,0 +1,71 @@
+/*
+ * sim.h:
+ *      Deterministic virtual-time simulation mode.
+ *
+ *      In simulation mode there is no clock interrupt and no device threads.
+ *      Virtual time only advances while no minithread is ready to run: the
+ *      idle loop then moves time_ticks forward one tick at a time, firing
+ *      alarms and delivering the device completions scheduled for that
+ *      tick. Disk requests and packets a host sends to itself complete
+ *      after modeled latencies, and every random decision (scheduling,
+ *      synthetic network loss, disk faults) is drawn from a stream derived
+ *      from a single seed. A run with the same seed and program therefore
+ *      replays exactly.
+ *
+ *      Since nothing preempts a running thread, computation takes no virtual
+ *      time and a thread that never blocks or yields stalls the simulation.
+ *      Packets addressed to other hosts are dropped.
+ */
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include "interrupts.h"
+
+/* random streams, one per subsystem */
+#define SIM_STREAM_SCHEDULER 1
+#define SIM_STREAM_NETWORK 2
+#define SIM_STREAM_DISK 3
+#define SIM_STREAM_NETEM 4
+
+/* default modeled latencies, in milliseconds */
+#define SIM_DISK_DELAY 10
+#define SIM_NETWORK_DELAY 1
+
+extern int sim_enabled;
+
+/*
+ * Turn on simulation mode with the given seed. Must be called before
+ * minithread_system_initialize.
+ */
+extern void sim_initialize(unsigned long seed);
+
+/*
+ * Set the modeled latency of a disk request and of a packet delivery, in
+ * milliseconds. Latencies are rounded up to whole clock ticks.
+ */
+extern void sim_set_latency(int disk_delay, int network_delay);
+
+extern int sim_disk_delay();
+extern int sim_network_delay();
+
+/*
+ * Seed for the given random stream: derived from the simulation seed in
+ * simulation mode, [fallback] otherwise.
+ */
+extern unsigned long sim_seed(int stream, unsigned long fallback);
+
+/*
+ * Run handler(arg) [delay] milliseconds of virtual time from now, with
+ * interrupts disabled, as if a device had raised an interrupt. Events due
+ * on the same tick run in the order they were scheduled.
+ * Returns 0 on success, -1 on failure.
+ */
+extern int sim_schedule(int delay, interrupt_handler_t handler, void *arg);
+
+/*
+ * Run every event due at or before [tick]. Called by the idle loop with
+ * interrupts disabled.
+ */
+extern void sim_deliver(long tick);
+
+#endif /*__SIM_H__*/
@@ -0,0 +1,119 @@
+/*
+ * Slab allocator for fixed-size kernel objects.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "interrupts.h"
+#include "slab.h"
+
+#define SLAB_SIZE (16 * 1024) // Bytes mapped per slab
+#define SLAB_MIN_OBJECTS 8 // Larger objects get larger slabs
+
+/*
+ * Each object is followed by the link that chains it on the free list, so
+ * that a free object keeps its constructed contents intact.
+ */
+#define ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define SLOT(cache) (ALIGN((cache)->size) + sizeof(void *))
+#define LINK(cache, obj) (*(void **) ((char *) (obj) + ALIGN((cache)->size)))
+
+static slab_cache_t caches = NULL; // Every cache that has a slab
+
+/*
+ * Map a new slab for the cache.
+ * invariant: called with interrupts disabled
+ */
+static int grow(slab_cache_t cache) {
+    long bytes = SLAB_SIZE;
+    void *slab;
+
+    if (bytes < SLAB_MIN_OBJECTS * SLOT(cache)) {
+        bytes = SLAB_MIN_OBJECTS * SLOT(cache);
+    }
+    slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) return -1;
+
+    if (cache->slabs++ == 0) {
+        cache->next = caches;
+        caches = cache;
+    }
+    cache->carve = (char *) slab;
+    cache->carve_end = (char *) slab + bytes;
+    return 0;
+}
+
+/*
+ * Allocate an object, constructing it if it is new
+ */
+void *slab_alloc(slab_cache_t cache) {
+    interrupt_level_t old_level;
+    void *obj;
+    int fresh = 0;
+
+    old_level = set_interrupt_level(DISABLED);
+    if (cache->free_list) {
+        obj = cache->free_list;
+        cache->free_list = LINK(cache, obj);
+        cache->free--;
+    } else {
+        if (cache->carve + SLOT(cache) > cache->carve_end && grow(cache) == -1) {
+            set_interrupt_level(old_level);
+            return NULL;
+        }
+        obj = cache->carve;
+        cache->carve += SLOT(cache);
+        fresh = 1;
+    }
+    cache->in_use++;
+    cache->allocs++;
+    set_interrupt_level(old_level);
+
+    // The object is private now, so construct it with interrupts restored
+    if (fresh && cache->ctor) {
+        cache->ctor(obj);
+    }
+    return obj;
+}
+
+/*
+ * Return an object to its cache
+ */
+void slab_free(slab_cache_t cache, void *obj) {
+    interrupt_level_t old_level;
+
+    if ( !obj ) return;
+
+    old_level = set_interrupt_level(DISABLED);
+    LINK(cache, obj) = cache->free_list;
+    cache->free_list = obj;
+    cache->in_use--;
+    cache->free++;
+    set_interrupt_level(old_level);
+}
+
+void slab_counts(slab_cache_t cache, long *in_use, long *free, long *slabs) {
+    interrupt_level_t old_level;
+
+    old_level = set_interrupt_level(DISABLED);
+    if (in_use) *in_use = cache->in_use;
+    if (free) *free = cache->free;
+    if (slabs) *slabs = cache->slabs;
+    set_interrupt_level(old_level);
+}
+
+/*
+ * Print the counts of every cache
+ */
+void slab_report(FILE *out) {
+    slab_cache_t c;
+
+    fprintf(out, "%-20s %6s %10s %10s %8s %12s\n", "cache", "size",
+            "in use", "free", "slabs", "allocs");
+    for (c = caches; c != NULL; c = c->next) {
+        fprintf(out, "%-20s %6d %10ld %10ld %8ld %12ld\n", c->name, c->size,
+                c->in_use, c->free, c->slabs, c->allocs);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * slab.h:
+ *      Object caches for fixed-size kernel objects.
+ *
+ *      Each cache hands out objects of one size, carved from slabs of
+ *      memory that are mapped directly from the OS and never returned.
+ *      Allocation and freeing are a few pointer operations done with
+ *      interrupts disabled, so they are safe from interrupt handlers.
+ *
+ *      A cache may have a constructor. It runs once, when an object is
+ *      first carved out of a slab; freed objects keep their constructed
+ *      state and are handed out again as they are. Objects must therefore
+ *      be returned to the cache in their constructed state.
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdio.h>
+
+typedef void (*slab_ctor_t)(void *obj);
+
+/*
+ * Treat the fields as private; declare caches with SLAB_CACHE_INITIALIZER
+ * so they need no initialization call, e.g.
+ *
+ *     static struct slab_cache node_cache =
+ *         SLAB_CACHE_INITIALIZER("queue node", sizeof(struct node), NULL);
+ */
+struct slab_cache {
+    char *name;
+    int size; // Object size
+    slab_ctor_t ctor;
+    void *free_list; // Constructed objects ready for reuse
+    char *carve; // Unused part of the newest slab
+    char *carve_end;
+    long slabs;
+    long in_use;
+    long free;
+    long allocs;
+    struct slab_cache *next; // Caches that have a slab, for reports
+};
+
+typedef struct slab_cache *slab_cache_t;
+
+#define SLAB_CACHE_INITIALIZER(name, size, ctor) \
+    { name, size, ctor, NULL, NULL, NULL, 0, 0, 0, 0, NULL }
+
+/*
+ * Allocate an object from the cache. Returns NULL on failure.
+ */
+extern void *slab_alloc(slab_cache_t cache);
+
+/*
+ * Return an object to the cache it was allocated from.
+ */
+extern void slab_free(slab_cache_t cache, void *obj);
+
+/*
+ * Object counts of a cache: allocated, free for reuse, slabs mapped.
+ */
+extern void slab_counts(slab_cache_t cache, long *in_use, long *free,
+                        long *slabs);
+
+/*
+ * Print the counts of every cache in use.
+ */
+extern void slab_report(FILE *out);
+
+#endif /*__SLAB_H__*/
@@ -0,0 +1,135 @@
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MANY 10000
+
+typedef struct object {
+    int constructed;
+    char payload[20];
+} object_t;
+
+int constructions = 0;
+
+void construct(void *obj) {
+    ((object_t *) obj)->constructed = 1;
+    constructions++;
+}
+
+struct slab_cache plain_cache =
+    SLAB_CACHE_INITIALIZER("plain", sizeof(object_t), NULL);
+struct slab_cache ctor_cache =
+    SLAB_CACHE_INITIALIZER("constructed", sizeof(object_t), construct);
+struct slab_cache big_cache =
+    SLAB_CACHE_INITIALIZER("big", 10000, NULL);
+
+void test_alloc_free() {
+    object_t *a;
+    object_t *b;
+    long in_use;
+    long free;
+    long slabs;
+
+    slab_counts(&plain_cache, &in_use, &free, &slabs);
+    assert(in_use == 0 && free == 0 && slabs == 0);
+
+    a = (object_t *) slab_alloc(&plain_cache);
+    b = (object_t *) slab_alloc(&plain_cache);
+    assert(a != NULL && b != NULL && a != b);
+    memset(a, 1, sizeof(object_t));
+    memset(b, 2, sizeof(object_t));
+    assert(a->payload[19] == 1); // Objects do not overlap
+    slab_counts(&plain_cache, &in_use, &free, &slabs);
+    assert(in_use == 2 && free == 0 && slabs == 1);
+
+    // Freed objects are reused, most recent first
+    slab_free(&plain_cache, a);
+    slab_counts(&plain_cache, &in_use, &free, &slabs);
+    assert(in_use == 1 && free == 1);
+    assert(slab_alloc(&plain_cache) == a);
+    slab_free(&plain_cache, a);
+    slab_free(&plain_cache, b);
+    slab_free(&plain_cache, NULL);
+    slab_counts(&plain_cache, &in_use, &free, &slabs);
+    assert(in_use == 0 && free == 2);
+}
+
+void test_many() {
+    object_t *objs[MANY];
+    long in_use;
+    long slabs;
+    long after;
+    int i;
+
+    for (i = 0; i < MANY; i++) {
+        objs[i] = (object_t *) slab_alloc(&plain_cache);
+        assert(objs[i] != NULL);
+        objs[i]->constructed = i;
+    }
+    slab_counts(&plain_cache, &in_use, NULL, &slabs);
+    assert(in_use == MANY && slabs > 1);
+    for (i = 0; i < MANY; i++) {
+        assert(objs[i]->constructed == i);
+    }
+    for (i = 0; i < MANY; i += 2) {
+        slab_free(&plain_cache, objs[i]);
+    }
+    for (i = 0; i < MANY; i += 2) {
+        objs[i] = (object_t *) slab_alloc(&plain_cache);
+        objs[i]->constructed = i;
+    }
+    // No slabs were added to satisfy reallocation
+    slab_counts(&plain_cache, &in_use, NULL, &after);
+    assert(in_use == MANY && after == slabs);
+    for (i = 0; i < MANY; i++) {
+        assert(objs[i]->constructed == i);
+        slab_free(&plain_cache, objs[i]);
+    }
+}
+
+void test_constructor() {
+    object_t *a;
+    object_t *b;
+
+    a = (object_t *) slab_alloc(&ctor_cache);
+    assert(a->constructed == 1 && constructions == 1);
+    b = (object_t *) slab_alloc(&ctor_cache);
+    assert(b->constructed == 1 && constructions == 2);
+
+    // Reused objects are not constructed again and keep their state
+    a->payload[0] = 'x';
+    slab_free(&ctor_cache, a);
+    a = (object_t *) slab_alloc(&ctor_cache);
+    assert(constructions == 2);
+    assert(a->constructed == 1 && a->payload[0] == 'x');
+    slab_free(&ctor_cache, a);
+    slab_free(&ctor_cache, b);
+}
+
+void test_big() {
+    char *a;
+    char *b;
+
+    a = (char *) slab_alloc(&big_cache);
+    b = (char *) slab_alloc(&big_cache);
+    assert(a != NULL && b != NULL);
+    assert(b >= a + 10000 || a >= b + 10000);
+    memset(a, 1, 10000);
+    memset(b, 2, 10000);
+    assert(a[9999] == 1 && b[0] == 2);
+    slab_free(&big_cache, a);
+    slab_free(&big_cache, b);
+}
+
+int main(void) {
+    test_alloc_free();
+    test_many();
+    test_constructor();
+    test_big();
+
+    printf("All Tests Pass!!!\n");
+    return 0;
+}
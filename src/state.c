@@ -39,11 +39,6 @@ void transition_to(state_t state, int new_state) {
     transition(state);
 }
 
-void transition_timer(void * state) {
-    state_t s = (state_t) state;
-    transition(s);
-}
-
 void set_state(state_t state, int new_state) {
     state->cur_state = new_state;
 }
@@ -57,6 +52,18 @@ void wait_for_transition(state_t state) {
     state->transitioned = 0;
 }
 
+/*
+ * Waits for a transition for at most timeout milliseconds.
+ * Returns 0 if the state transitioned, -1 on timeout.
+ */
+int wait_for_transition_timeout(state_t state, int timeout) {
+    if (semaphore_P_timeout(state->transition, timeout) == -1) {
+        return -1;
+    }
+    state->transitioned = 0;
+    return 0;
+}
+
 void state_destroy(state_t state) {
     if ( !state ) return;
 
@@ -12,14 +12,14 @@ extern void transition(state_t);
 
 extern void transition_to(state_t, int);
 
-extern void transition_timer(void *);
-
 extern void set_state(state_t, int);
 
 extern int get_state(state_t);
 
 extern void wait_for_transition(state_t);
 
+extern int wait_for_transition_timeout(state_t, int timeout);
+
 extern void state_destroy(state_t);
 
 #endif /*__STATE_H__*/
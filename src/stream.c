@@ -7,12 +7,10 @@
 #include "queue.h"
 #include "stream.h"
 #include "synch.h"
-#include "miniheader.h"
-#include "miniroute.h"
 
 struct stream
 {
-    int index; //index at current message
+    int bytes; // Packet memory held by the stream
     queue_t data;
     semaphore_t lock;
     //TO DO: maybe add num waiting 
@@ -34,7 +32,7 @@ struct stream
         return NULL;
     }
     semaphore_initialize(s->lock, 1);
-    s->index = 0;
+    s->bytes = 0;
     return s;
  }
 
@@ -60,6 +58,7 @@ int stream_add(stream_t stream, network_interrupt_arg_t* next) {
     if (!stream || !next) return -1;
     semaphore_P(stream->lock);
     if (queue_append(stream->data, next) == 0) {
+        stream->bytes += network_pkt_bytes(next);
         semaphore_V(stream->lock);
         return 0;
     }
@@ -74,7 +73,6 @@ int stream_add(stream_t stream, network_interrupt_arg_t* next) {
  * or -1 (failure)
  */
 int stream_take(stream_t stream, int request, char * output) {
-    int start_read;
     void *node;
     int request_left;
     int size_current_node;
@@ -90,28 +88,27 @@ int stream_take(stream_t stream, int request, char * output) {
     while (request_left != 0 && stream_is_empty(stream) == 0) {
 
         semaphore_P(stream->lock);
-        start_read = sizeof(struct routing_header) + sizeof(struct mini_header_reliable) + stream->index;
         queue_peek(stream->data, &node);
         semaphore_V(stream->lock);
         current_chunk = (network_interrupt_arg_t *) node;
-        size_current_node = current_chunk->size - start_read;
+        size_current_node = network_pkt_len(current_chunk);
 
         // if request is larger than this node's data size, we take all of the data
         // else we only take what we need
         if (request_left >= size_current_node) {
-            memcpy(output + message_iterator, current_chunk->buffer + start_read, size_current_node);
+            memcpy(output + message_iterator, network_pkt_data(current_chunk), size_current_node);
             message_iterator = message_iterator + size_current_node;
             request_left = request_left - size_current_node;
             semaphore_P(stream->lock);
-            stream->index = 0;
             queue_dequeue(stream->data, &node);
+            stream->bytes -= network_pkt_bytes(current_chunk);
             semaphore_V(stream->lock);
-            free(current_chunk);
+            network_free_pkt(current_chunk);
         } else {
-            memcpy(output + message_iterator, current_chunk->buffer + start_read, request_left);
+            memcpy(output + message_iterator, network_pkt_data(current_chunk), request_left);
             message_iterator = message_iterator + request_left;
             semaphore_P(stream->lock);
-            stream->index = stream->index + request_left;
+            network_pkt_pull(current_chunk, request_left);
             semaphore_V(stream->lock);
             request_left = 0;
         }
@@ -120,6 +117,41 @@ int stream_take(stream_t stream, int request, char * output) {
     return message_iterator;
 }
 
+/*
+ * take the next packet from the stream without copying,
+ * its unread data is at network_pkt_data
+ * Returns the packet (success) or NULL if the stream is empty
+ */
+network_interrupt_arg_t* stream_take_pkt(stream_t stream) {
+    void *node;
+    network_interrupt_arg_t *chunk;
+
+    if (!stream) return NULL;
+
+    semaphore_P(stream->lock);
+    if (queue_dequeue(stream->data, &node) != 0) {
+        semaphore_V(stream->lock);
+        return NULL;
+    }
+    chunk = (network_interrupt_arg_t *) node;
+    stream->bytes -= network_pkt_bytes(chunk);
+    semaphore_V(stream->lock);
+    return chunk;
+}
+
+/*
+ * Returns the packet memory held by the stream, or -1 for error
+ */
+int stream_bytes(stream_t stream) {
+    int bytes;
+
+    if (!stream) return -1;
+    semaphore_P(stream->lock);
+    bytes = stream->bytes;
+    semaphore_V(stream->lock);
+    return bytes;
+}
+
 /*
  * destroy and free the stream
  */
@@ -132,7 +164,7 @@ int stream_destroy(stream_t stream) {
     while (stream_is_empty(stream) == 0) {
         queue_dequeue(stream->data, &node);
         next = (network_interrupt_arg_t *) node;
-        free(next);
+        network_free_pkt(next);
     }
     semaphore_destroy(stream->lock);
     queue_free(stream->data);
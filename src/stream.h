@@ -31,6 +31,19 @@ extern int stream_add(stream_t, network_interrupt_arg_t*);
  */
 extern int stream_take(stream_t, int, char *);
 
+/*
+ * take the next packet from the stream without copying,
+ * its unread data is at network_pkt_data
+ * Returns the packet (success) or NULL if the stream is empty
+ */
+extern network_interrupt_arg_t* stream_take_pkt(stream_t);
+
+/*
+ * Returns the memory held by the packets in the stream,
+ * or -1 for error
+ */
+extern int stream_bytes(stream_t);
+
 /*
  * destroy and free the stream
  */
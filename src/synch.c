@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "interrupts.h"
 #include "defs.h"
@@ -8,6 +9,8 @@
 #include "queue.h"
 #include "minithread.h"
 #include "machineprimitives.h"
+#include "uthash.h"
+#include "slab.h"
 
 /*
  *      You must implement the procedures and types defined in this interface.
@@ -18,21 +21,338 @@
  * Semaphores.
  */
 struct semaphore {
-    queue_t waiting; // Waiting queue for the semaphore
-    int count;
+    queue_t waiting; // Waiters blocked on the semaphore
+    int count; // Available units, never negative
+    int lock; // Initialized to 1, so P to V is a hold
+    void *site; // Where the semaphore was created
+    char *name;
+    struct semaphore_site *stats; // Profile of the site, once looked up
+    long acquired_at; // When a lock was last acquired, -1 if not held
 };
 
+/*
+ * Contention profile of every semaphore created at one call site.
+ * Times are in nanoseconds.
+ */
+typedef struct semaphore_site {
+    void *site; // key
+    char *name;
+    long acquisitions;
+    long contended; // Acquisitions that had to block
+    long total_wait;
+    long max_wait;
+    long holds;
+    long total_hold;
+    long max_hold;
+    UT_hash_handle hh;
+}* semaphore_site_t;
+
+static semaphore_site_t sites = NULL;
+int semaphore_profiling = 0;
+
+/*
+ * A blocked thread. Waiters live on the blocked thread's stack and may be
+ * queued on several semaphores at once; the first semaphore to hand it a
+ * unit (or the deadline) removes it from all of them.
+ */
+typedef struct waiter *waiter_t;
+struct waiter {
+    minithread_t thread;
+    semaphore_t *sems; // Semaphores being waited on
+    int n;
+    int index; // Index of the semaphore acquired, -1 if none yet
+    long deadline; // Time (ms) to give up at, -1 to wait forever
+    waiter_t prev; // Deadline list links
+    waiter_t next;
+};
+
+static waiter_t deadlines = NULL; // Waiters with a deadline, earliest first
+
+/*
+ * Insert a waiter in the deadline list
+ */
+static void add_deadline(waiter_t w) {
+    waiter_t cur = deadlines;
+    waiter_t prev = NULL;
+
+    while (cur && cur->deadline <= w->deadline) {
+        prev = cur;
+        cur = cur->next;
+    }
+    w->prev = prev;
+    w->next = cur;
+    if (prev) {
+        prev->next = w;
+    } else {
+        deadlines = w;
+    }
+    if (cur) {
+        cur->prev = w;
+    }
+}
+
+static void remove_deadline(waiter_t w) {
+    if (w->deadline == -1) return;
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        deadlines = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    }
+    w->deadline = -1;
+}
+
+/* ---------------------Contention Profiling------------------------------- */
+
+/*
+ * Find the profile of the semaphore's creation site.
+ * invariant: called with interrupts disabled
+ */
+static semaphore_site_t site_stats(semaphore_t sem) {
+    semaphore_site_t s;
+
+    if (sem->stats) return sem->stats;
+
+    HASH_FIND_PTR( sites, &sem->site, s );
+    if (!s) {
+        s = (semaphore_site_t) malloc (sizeof(struct semaphore_site));
+        if (!s) return NULL;
+        memset(s, 0, sizeof(struct semaphore_site));
+        s->site = sem->site;
+        HASH_ADD_PTR( sites, site, s );
+    }
+    if (!s->name) {
+        s->name = sem->name;
+    }
+    sem->stats = s;
+    return s;
+}
+
+/*
+ * Account an acquisition that waited [wait] nanoseconds, -1 if it did
+ * not block.
+ */
+static void profile_acquire(semaphore_t sem, long wait) {
+    interrupt_level_t old_level;
+    semaphore_site_t s;
+
+    old_level = set_interrupt_level(DISABLED);
+    s = site_stats(sem);
+    if (s) {
+        s->acquisitions++;
+        if (wait >= 0) {
+            s->contended++;
+            s->total_wait += wait;
+            if (wait > s->max_wait) s->max_wait = wait;
+        }
+        if (sem->lock) {
+            sem->acquired_at = sched_clock();
+        }
+    }
+    set_interrupt_level(old_level);
+}
+
+/*
+ * Account the release of a lock.
+ * invariant: called with interrupts disabled
+ */
+static void profile_release(semaphore_t sem) {
+    semaphore_site_t s;
+    long hold;
+
+    if (!sem->lock || sem->acquired_at == -1) return;
+    s = site_stats(sem);
+    if (s) {
+        hold = sched_clock() - sem->acquired_at;
+        s->holds++;
+        s->total_hold += hold;
+        if (hold > s->max_hold) s->max_hold = hold;
+    }
+    sem->acquired_at = -1;
+}
+
+/*
+ * semaphore_name(semaphore_t sem, char *name)
+ *      Name a semaphore (and its creation site) in profile reports.
+ */
+void semaphore_name(semaphore_t sem, char *name) {
+    interrupt_level_t old_level;
+
+    if ( !sem ) return;
+
+    old_level = set_interrupt_level(DISABLED);
+    sem->name = name;
+    if (sem->stats && !sem->stats->name) {
+        sem->stats->name = name;
+    }
+    set_interrupt_level(old_level);
+}
+
+/*
+ * semaphore_profile_enable(int on)
+ *      Turn contention profiling on or off.
+ */
+void semaphore_profile_enable(int on) {
+    semaphore_profiling = on;
+}
+
+/*
+ * semaphore_profile_reset()
+ *      Zero the profile of every site.
+ */
+void semaphore_profile_reset() {
+    interrupt_level_t old_level;
+    semaphore_site_t s;
+
+    old_level = set_interrupt_level(DISABLED);
+    for (s = sites; s != NULL; s = s->hh.next) {
+        s->acquisitions = s->contended = 0;
+        s->total_wait = s->max_wait = 0;
+        s->holds = s->total_hold = s->max_hold = 0;
+    }
+    set_interrupt_level(old_level);
+}
+
+/*
+ * Orders sites by total wait, most contended first
+ */
+static int compare_sites(const void *a, const void *b) {
+    const struct semaphore_site *x = (const struct semaphore_site *) a;
+    const struct semaphore_site *y = (const struct semaphore_site *) b;
+
+    if (x->total_wait != y->total_wait)
+        return x->total_wait > y->total_wait ? -1 : 1;
+    if (x->acquisitions != y->acquisitions)
+        return x->acquisitions > y->acquisitions ? -1 : 1;
+    return 0;
+}
+
+/*
+ * semaphore_profile_report(FILE *out)
+ *      Print the profile of every site that was used.
+ */
+void semaphore_profile_report(FILE *out) {
+    interrupt_level_t old_level;
+    struct semaphore_site *list;
+    semaphore_site_t s;
+    int n;
+    int i;
+
+    // Snapshot the counters so the report is consistent
+    old_level = set_interrupt_level(DISABLED);
+    n = HASH_COUNT(sites);
+    list = (struct semaphore_site *) malloc (sizeof(struct semaphore_site) * (n ? n : 1));
+    if (!list) {
+        set_interrupt_level(old_level);
+        return;
+    }
+    n = 0;
+    for (s = sites; s != NULL; s = s->hh.next) {
+        if (s->acquisitions) list[n++] = *s;
+    }
+    set_interrupt_level(old_level);
+
+    qsort(list, n, sizeof(struct semaphore_site), compare_sites);
+
+    fprintf(out, "%-18s %-18s %10s %10s %12s %12s %12s %12s\n",
+            "name", "site", "acquired", "contended", "wait(us)",
+            "max wait", "hold(us)", "max hold");
+    for (i = 0; i < n; i++) {
+        s = &list[i];
+        fprintf(out, "%-18s %-18p %10ld %10ld %12ld %12ld %12ld %12ld\n",
+                s->name ? s->name : "-", s->site, s->acquisitions,
+                s->contended, s->total_wait / MICROSECOND,
+                s->max_wait / MICROSECOND, s->total_hold / MICROSECOND,
+                s->max_hold / MICROSECOND);
+    }
+    free(list);
+}
+
+/* ---------------------------Allocation----------------------------------- */
+
+static void construct_semaphore(void *obj) {
+    semaphore_t sem = (semaphore_t) obj;
+    sem->waiting = queue_new();
+}
+
+static struct slab_cache semaphore_cache =
+    SLAB_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore),
+                           construct_semaphore);
+
+/* ---------------------------Waiting--------------------------------------- */
+
+/*
+ * Take a waiter off every semaphore and the deadline list, and run it.
+ * invariant: called with interrupts disabled
+ */
+static void wake(waiter_t w, int index) {
+    int i;
+
+    w->index = index;
+    for (i = 0; i < w->n; i++) {
+        if (i != index) {
+            queue_delete(w->sems[i]->waiting, w);
+        }
+    }
+    remove_deadline(w);
+    minithread_start(w->thread);
+}
+
+/*
+ * Block on sems until one of them is V'ed or timeout (ms) passes. A
+ * negative timeout waits forever. Returns the index of the semaphore
+ * acquired, or -1 on timeout.
+ * invariant: called with interrupts disabled, none of sems available
+ */
+static int block(semaphore_t *sems, int n, int timeout) {
+    struct waiter w;
+    long start = 0;
+    int i;
+
+    w.thread = minithread_self();
+    w.sems = sems;
+    w.n = n;
+    w.index = -1;
+    w.deadline = -1;
+    for (i = 0; i < n; i++) {
+        queue_append(sems[i]->waiting, &w);
+    }
+    if (timeout >= 0) {
+        w.deadline = time_ticks * PERIOD + timeout;
+        add_deadline(&w);
+    }
+    if (semaphore_profiling) start = sched_clock();
+    minithread_stop();
+    if (semaphore_profiling && w.index != -1) {
+        profile_acquire(sems[w.index], sched_clock() - start);
+    }
+    return w.index;
+}
 
 /*
  * semaphore_t semaphore_create()
  *      Allocate a new semaphore. Return NULL on failure
  */
 semaphore_t semaphore_create() {
-    semaphore_t sem = (semaphore_t) malloc (sizeof (struct semaphore));
+    semaphore_t sem = (semaphore_t) slab_alloc(&semaphore_cache);
     if ( !sem ) return NULL;
 
-    sem->waiting = queue_new();
+    // Cached semaphores keep their (empty) waiting queue
+    if ( !sem->waiting ) {
+        sem->waiting = queue_new();
+        if ( !sem->waiting ) {
+            slab_free(&semaphore_cache, sem);
+            return NULL;
+        }
+    }
     sem->count = 0;
+    sem->lock = 0;
+    sem->site = __builtin_return_address(0);
+    sem->name = NULL;
+    sem->stats = NULL;
+    sem->acquired_at = -1;
     return sem;
 }
 
@@ -42,10 +362,9 @@ semaphore_t semaphore_create() {
  */
 void semaphore_destroy(semaphore_t sem) {
     if ( !sem ) return;
-    queue_free(sem->waiting);
-    free(sem);
-}
 
+    slab_free(&semaphore_cache, sem);
+}
 
 /*
  * semaphore_initialize(semaphore_t sem, int cnt)
@@ -54,6 +373,7 @@ void semaphore_destroy(semaphore_t sem) {
  */
 void semaphore_initialize(semaphore_t sem, int cnt) {
     sem->count = cnt;
+    sem->lock = (cnt == 1);
 }
 
 /*
@@ -64,13 +384,53 @@ void semaphore_P(semaphore_t sem) {
     interrupt_level_t old_level;
 
     old_level = set_interrupt_level(DISABLED);
-
-    if (--sem->count < 0) { // No more resources; block until V
-        queue_append(sem->waiting, minithread_self());
-        minithread_stop();
+    if (sem->count > 0) {
+        sem->count--;
+        if (semaphore_profiling) profile_acquire(sem, -1);
+    } else { // No more resources; block until V
+        block(&sem, 1, -1);
     }
+    set_interrupt_level(old_level);
+}
+
+/*
+ * semaphore_P_timeout(semaphore_t sem, int timeout)
+ *      P on the semaphore, giving up after timeout milliseconds.
+ */
+int semaphore_P_timeout(semaphore_t sem, int timeout) {
+    return semaphore_wait_any(&sem, 1, timeout) == 0 ? 0 : -1;
+}
+
+/*
+ * semaphore_try_P(semaphore_t sem)
+ *      P on the semaphore only if it would not block.
+ */
+int semaphore_try_P(semaphore_t sem) {
+    return semaphore_wait_any(&sem, 1, 0) == 0 ? 0 : -1;
+}
 
+/*
+ * semaphore_wait_any(semaphore_t sems[], int n, int timeout)
+ *      P on the first of sems to become available.
+ */
+int semaphore_wait_any(semaphore_t sems[], int n, int timeout) {
+    interrupt_level_t old_level;
+    int i;
+
+    if (n <= 0) return -1;
+
+    old_level = set_interrupt_level(DISABLED);
+    for (i = 0; i < n; i++) {
+        if (sems[i]->count > 0) {
+            sems[i]->count--;
+            if (semaphore_profiling) profile_acquire(sems[i], -1);
+            set_interrupt_level(old_level);
+            return i;
+        }
+    }
+    i = timeout == 0 ? -1 : block(sems, n, timeout);
     set_interrupt_level(old_level);
+    return i;
 }
 
 /*
@@ -79,16 +439,31 @@ void semaphore_P(semaphore_t sem) {
  */
 void semaphore_V(semaphore_t sem) {
     void *next;
-    minithread_t next_thread;
+    waiter_t w;
+    int i;
     interrupt_level_t old_level;
 
     old_level = set_interrupt_level(DISABLED);
-
-    if (++sem->count <= 0) { // Unblocks one element in the queue
-        queue_dequeue(sem->waiting, &next);
-        next_thread = (minithread_t) next;
-        minithread_start(next_thread);
+    if (semaphore_profiling) profile_release(sem);
+    if (queue_dequeue(sem->waiting, &next) == 0) { // Hand the unit to a waiter
+        w = (waiter_t) next;
+        for (i = 0; w->sems[i] != sem; i++);
+        wake(w, i);
+    } else {
+        sem->count++;
     }
-
     set_interrupt_level(old_level);
 }
+
+/*
+ * semaphore_check_timeouts()
+ *      Wake the waiters whose deadline has passed.
+ */
+void semaphore_check_timeouts() {
+    waiter_t w;
+
+    while (deadlines && time_ticks * PERIOD >= deadlines->deadline) {
+        w = deadlines;
+        wake(w, -1);
+    }
+}
@@ -6,6 +6,8 @@
 #ifndef __SYNCH_H__
 #define __SYNCH_H__
 
+#include <stdio.h>
+
 
 typedef struct semaphore *semaphore_t;
 
@@ -46,5 +48,72 @@ extern void semaphore_P(semaphore_t sem);
  */
 extern void semaphore_V(semaphore_t sem);
 
+/*
+ * int semaphore_P_timeout(semaphore_t sem, int timeout)
+ *  P on the semaphore, waiting at most timeout milliseconds (forever if
+ *  timeout is negative). Returns 0 if the semaphore was acquired, -1 if
+ *  the wait timed out.
+ */
+extern int semaphore_P_timeout(semaphore_t sem, int timeout);
+
+/*
+ * int semaphore_try_P(semaphore_t sem)
+ *  P on the semaphore if that would not block. Returns 0 if the semaphore
+ *  was acquired, -1 otherwise.
+ */
+extern int semaphore_try_P(semaphore_t sem);
+
+/*
+ * int semaphore_wait_any(semaphore_t sems[], int n, int timeout)
+ *  P on exactly one of the n semaphores, whichever is available first,
+ *  waiting at most timeout milliseconds (forever if negative, not at all
+ *  if 0). Returns the index of the semaphore acquired, or -1 if the wait
+ *  timed out.
+ */
+extern int semaphore_wait_any(semaphore_t sems[], int n, int timeout);
+
+/*
+ * Contention profiling.
+ *
+ *  When enabled, every acquisition of a semaphore is accounted to the call
+ *  site that created it: how many acquisitions had to block and for how
+ *  long, and, for semaphores initialized to 1, how long they were held
+ *  from P to the next V. Sites are reported by name if one of their
+ *  semaphores was named, by return address otherwise (resolve it with
+ *  addr2line).
+ */
+
+/*
+ * semaphore_name(semaphore_t sem, char *name)
+ *  Name the semaphore in profile reports. The string is not copied.
+ */
+extern void semaphore_name(semaphore_t sem, char *name);
+
+/*
+ * semaphore_profile_enable(int on)
+ *  Turn profiling on (1) or off (0). It is off by default.
+ */
+extern void semaphore_profile_enable(int on);
+
+/*
+ * semaphore_profile_reset()
+ *  Clear the profile of every site.
+ */
+extern void semaphore_profile_reset();
+
+/*
+ * semaphore_profile_report(FILE *out)
+ *  Print one line per site to out, most waited on first. Times are in
+ *  microseconds.
+ */
+extern void semaphore_profile_report(FILE *out);
+
+/*
+ * semaphore_check_timeouts()
+ *  Wake up the timed waits that have expired. Called on every clock tick
+ *  with interrupts disabled.
+ */
+extern void semaphore_check_timeouts();
+
 
 #endif /*__SYNCH_H__*/
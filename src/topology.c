@@ -0,0 +1,395 @@
+/*
+ * Broadcast topology: nodes in an array, hash tables from address and name
+ * to node, and a bitset of links for each node.
+ */
+#define _GNU_SOURCE /* getline */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "topology.h"
+#include "network.h"
+#include "miniheader.h"
+#include "uthash.h"
+
+#define WORD_BITS (8 * (int) sizeof(unsigned long))
+#define ROW(t, node) ((t)->links + (long) (node) * (t)->words)
+
+typedef struct ip_entry {
+    unsigned int ip;
+    int node;
+    UT_hash_handle hh;
+}* ip_entry_t;
+
+typedef struct name_entry {
+    char name[TOPOLOGY_MAX_NAME_LEN];
+    int node;
+    UT_hash_handle hh;
+}* name_entry_t;
+
+typedef struct node {
+    char name[TOPOLOGY_MAX_NAME_LEN];
+    unsigned int ip;
+} node_t;
+
+struct topology {
+    node_t *nodes;
+    int n_nodes;
+    int capacity; // Nodes there is room for, a multiple of WORD_BITS
+    int words; // Per bitset, capacity / WORD_BITS
+    unsigned long *links; // capacity bitsets
+    ip_entry_t by_ip;
+    name_entry_t by_name;
+};
+
+topology_t topology_new() {
+    topology_t t = (topology_t) malloc(sizeof(struct topology));
+
+    if ( !t ) return NULL;
+    memset(t, 0, sizeof(struct topology));
+    return t;
+}
+
+void topology_destroy(topology_t t) {
+    ip_entry_t ie;
+    ip_entry_t ie_tmp;
+    name_entry_t ne;
+    name_entry_t ne_tmp;
+
+    if ( !t ) return;
+    HASH_ITER(hh, t->by_ip, ie, ie_tmp) {
+        HASH_DEL(t->by_ip, ie);
+        free(ie);
+    }
+    HASH_ITER(hh, t->by_name, ne, ne_tmp) {
+        HASH_DEL(t->by_name, ne);
+        free(ne);
+    }
+    free(t->nodes);
+    free(t->links);
+    free(t);
+}
+
+/*
+ * Makes room for one more node, doubling the nodes and the bitsets.
+ */
+static int grow(topology_t t) {
+    node_t *nodes;
+    unsigned long *links;
+    int capacity;
+    int words;
+    int i;
+
+    if (t->n_nodes < t->capacity) return 0;
+
+    capacity = t->capacity ? t->capacity * 2 : WORD_BITS;
+    words = capacity / WORD_BITS;
+    nodes = (node_t *) realloc(t->nodes, capacity * sizeof(node_t));
+    if ( !nodes ) return -1;
+    t->nodes = nodes;
+    links = (unsigned long *) calloc((long) capacity * words,
+                                     sizeof(unsigned long));
+    if ( !links ) return -1;
+
+    for (i = 0; i < t->n_nodes; i++)
+        memcpy(links + (long) i * words, ROW(t, i),
+               t->words * sizeof(unsigned long));
+    free(t->links);
+    t->links = links;
+    t->capacity = capacity;
+    t->words = words;
+    return 0;
+}
+
+int topology_add_node(topology_t t, char *name, unsigned int ip) {
+    ip_entry_t ie;
+    name_entry_t ne;
+    int node;
+
+    if (strlen(name) >= TOPOLOGY_MAX_NAME_LEN || grow(t) == -1) return -1;
+
+    node = t->n_nodes;
+    strcpy(t->nodes[node].name, name);
+    t->nodes[node].ip = ip;
+
+    HASH_FIND_INT( t->by_ip, &ip, ie );
+    if ( !ie ) {
+        ie = (ip_entry_t) malloc(sizeof(struct ip_entry));
+        if ( !ie ) return -1;
+        ie->ip = ip;
+        HASH_ADD_INT( t->by_ip, ip, ie );
+    }
+    ie->node = node;
+
+    HASH_FIND_STR( t->by_name, name, ne );
+    if ( !ne ) {
+        ne = (name_entry_t) malloc(sizeof(struct name_entry));
+        if ( !ne ) return -1;
+        strcpy(ne->name, name);
+        HASH_ADD_STR( t->by_name, name, ne );
+    }
+    ne->node = node;
+
+    t->n_nodes++;
+    return node;
+}
+
+int topology_nodes(topology_t t) {
+    return t->n_nodes;
+}
+
+int topology_find(topology_t t, unsigned int ip) {
+    ip_entry_t ie;
+
+    HASH_FIND_INT( t->by_ip, &ip, ie );
+    return ie ? ie->node : -1;
+}
+
+int topology_find_name(topology_t t, char *name) {
+    name_entry_t ne;
+
+    HASH_FIND_STR( t->by_name, name, ne );
+    return ne ? ne->node : -1;
+}
+
+unsigned int topology_node_ip(topology_t t, int node) {
+    return t->nodes[node].ip;
+}
+
+char* topology_node_name(topology_t t, int node) {
+    return t->nodes[node].name;
+}
+
+int topology_set_link(topology_t t, int src, int dest, int on) {
+    unsigned long bit;
+
+    if (src < 0 || src >= t->n_nodes || dest < 0 || dest >= t->n_nodes)
+        return -1;
+    if (src == dest) return 0;
+
+    bit = 1UL << (dest % WORD_BITS);
+    if (on)
+        ROW(t, src)[dest / WORD_BITS] |= bit;
+    else
+        ROW(t, src)[dest / WORD_BITS] &= ~bit;
+    return 0;
+}
+
+int topology_linked(topology_t t, int src, int dest) {
+    if (src < 0 || src >= t->n_nodes || dest < 0 || dest >= t->n_nodes)
+        return 0;
+    return (ROW(t, src)[dest / WORD_BITS] >> (dest % WORD_BITS)) & 1;
+}
+
+int topology_degree(topology_t t, int node) {
+    int degree = 0;
+    int w;
+
+    if (node < 0 || node >= t->n_nodes) return 0;
+    for (w = 0; w < t->words; w++)
+        degree += __builtin_popcountl(ROW(t, node)[w]);
+    return degree;
+}
+
+int topology_neighbors(topology_t t, int node, unsigned int *ips) {
+    unsigned long bits;
+    int n = 0;
+    int w;
+
+    if (node < 0 || node >= t->n_nodes) return 0;
+    for (w = 0; w < t->words; w++) {
+        for (bits = ROW(t, node)[w]; bits; bits &= bits - 1)
+            ips[n++] = t->nodes[w * WORD_BITS + __builtin_ctzl(bits)].ip;
+    }
+    return n;
+}
+
+/* Strips the line end, returns the length left */
+static int chomp(char *line) {
+    int len = strlen(line);
+
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+        line[--len] = '\0';
+    return len;
+}
+
+/*
+ * The text format: names, resolved one by one, a blank line and the link
+ * matrix, which is left out if the file ends first.
+ */
+static topology_t load_text(FILE *f, char *file) {
+    topology_t t = topology_new();
+    network_address_t addr;
+    char *line = NULL;
+    size_t size = 0;
+    int len;
+    int i;
+    int j;
+
+    if ( !t ) return NULL;
+
+    while (getline(&line, &size, f) != -1) {
+        if (chomp(line) == 0) break;
+        if (network_translate_hostname(line, addr) != 0) {
+            kprintf("Error: could not resolve hostname %s.\n", line);
+            goto fail;
+        }
+        if (topology_add_node(t, line, addr[0]) == -1) {
+            kprintf("Error: bad host %s in %s.\n", line, file);
+            goto fail;
+        }
+    }
+
+    if ( !feof(f) ) {
+        for (i = 0; i < t->n_nodes; i++) {
+            if (getline(&line, &size, f) == -1) {
+                kprintf("Error: incomplete adjacency matrix in %s.\n", file);
+                goto fail;
+            }
+            len = chomp(line);
+            for (j = 0; j < len && j < t->n_nodes; j++)
+                if (line[j] != '.')
+                    topology_set_link(t, i, j, 1);
+        }
+    }
+
+    free(line);
+    return t;
+
+fail:
+    free(line);
+    topology_destroy(t);
+    return NULL;
+}
+
+/*
+ * The binary format, read whole.
+ */
+static topology_t load_binary(FILE *f, char *file) {
+    topology_t t = NULL;
+    char name[TOPOLOGY_MAX_NAME_LEN];
+    unsigned char *row;
+    unsigned int ip;
+    char *buf;
+    long size;
+    long pos;
+    int row_bytes;
+    int n;
+    int len;
+    int i;
+    int j;
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    buf = (char *) malloc(size > 0 ? size : 1);
+    if ( !buf || fread(buf, 1, size, f) != (size_t) size || size < 12 )
+        goto bad;
+
+    if (unpack_unsigned_int(buf + 4) != TOPOLOGY_VERSION) {
+        kprintf("Error: %s is topology version %u, not %d.\n", file,
+                unpack_unsigned_int(buf + 4), TOPOLOGY_VERSION);
+        free(buf);
+        return NULL;
+    }
+    n = unpack_unsigned_int(buf + 8);
+    pos = 12;
+
+    t = topology_new();
+    if ( !t || n < 0 ) goto bad;
+    for (i = 0; i < n; i++) {
+        if (pos + 5 > size) goto bad;
+        memcpy(&ip, buf + pos, 4);
+        len = (unsigned char) buf[pos + 4];
+        pos += 5;
+        if (len >= TOPOLOGY_MAX_NAME_LEN || pos + len > size) goto bad;
+        memcpy(name, buf + pos, len);
+        name[len] = '\0';
+        pos += len;
+        if (topology_add_node(t, name, ip) == -1) goto bad;
+    }
+
+    row_bytes = (n + 7) / 8;
+    if (pos + (long) row_bytes * n > size) goto bad;
+    for (i = 0; i < n; i++) {
+        row = (unsigned char *) buf + pos + (long) i * row_bytes;
+        for (j = 0; j < row_bytes; j++)
+            ROW(t, i)[j * 8 / WORD_BITS] |=
+                (unsigned long) row[j] << (j * 8 % WORD_BITS);
+        // Nor to the padding, nor to itself
+        if (n % WORD_BITS)
+            ROW(t, i)[n / WORD_BITS] &= (1UL << (n % WORD_BITS)) - 1;
+        topology_set_link(t, i, i, 0);
+    }
+
+    free(buf);
+    return t;
+
+bad:
+    kprintf("Error: %s is not a valid topology.\n", file);
+    free(buf);
+    topology_destroy(t);
+    return NULL;
+}
+
+topology_t topology_load(char *file) {
+    FILE *f = fopen(file, "r");
+    char magic[4];
+    topology_t t;
+
+    if ( !f ) {
+        kprintf("Error: cannot open topology %s.\n", file);
+        return NULL;
+    }
+    if (fread(magic, 1, 4, f) == 4 && memcmp(magic, TOPOLOGY_MAGIC, 4) == 0) {
+        t = load_binary(f, file);
+    } else {
+        rewind(f);
+        t = load_text(f, file);
+    }
+    fclose(f);
+    return t;
+}
+
+int topology_save(topology_t t, char *file) {
+    FILE *f = fopen(file, "w");
+    unsigned char *row;
+    char buf[12];
+    unsigned char len;
+    int row_bytes;
+    int i;
+    int j;
+
+    if ( !f ) return -1;
+
+    memcpy(buf, TOPOLOGY_MAGIC, 4);
+    pack_unsigned_int(buf + 4, TOPOLOGY_VERSION);
+    pack_unsigned_int(buf + 8, t->n_nodes);
+    fwrite(buf, 1, 12, f);
+    for (i = 0; i < t->n_nodes; i++) {
+        len = strlen(t->nodes[i].name);
+        fwrite(&t->nodes[i].ip, 1, 4, f);
+        fwrite(&len, 1, 1, f);
+        fwrite(t->nodes[i].name, 1, len, f);
+    }
+
+    row_bytes = (t->n_nodes + 7) / 8;
+    row = (unsigned char *) malloc(row_bytes > 0 ? row_bytes : 1);
+    if ( !row ) {
+        fclose(f);
+        return -1;
+    }
+    for (i = 0; i < t->n_nodes; i++) {
+        for (j = 0; j < row_bytes; j++)
+            row[j] = ROW(t, i)[j * 8 / WORD_BITS] >> (j * 8 % WORD_BITS);
+        fwrite(row, 1, row_bytes, f);
+    }
+    free(row);
+
+    if (ferror(f)) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
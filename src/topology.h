@@ -0,0 +1,94 @@
+/*
+ * topology.h:
+ *      Broadcast topology.
+ *
+ *      The hosts a broadcast reaches, and the links between them. A node is
+ *      a host name and the IP address it resolved to, kept in network byte
+ *      order; nodes are numbered in the order they were added. Nodes are
+ *      found by address or name through hash tables, where a later node
+ *      with the same key hides an earlier one. The links of a node are a
+ *      bitset of the nodes it sends to, so a topology of n nodes takes n^2
+ *      bits, and grows as nodes are added.
+ *
+ *      A topology is read from a text file, the format of topology.txt:
+ *      host names one per line, a blank line, then one line per node with
+ *      a character per node, '.' for no link and anything else for a link
+ *      to it. Loading it resolves every name. The binary format keeps the
+ *      resolved addresses, so it loads without resolving anything:
+ *
+ *          "TOPO", version, nodes           (4 bytes each, big endian)
+ *          per node: address, name length   (4 bytes, 1 byte)
+ *                    name                   (no terminator)
+ *          per node: links                  ((nodes + 7) / 8 bytes, node
+ *                                            j in bit j % 8 of byte j / 8)
+ *
+ *      topology_load tells the formats apart by the magic number. A
+ *      topology is not synchronized: the caller keeps its own users apart.
+ */
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#define TOPOLOGY_MAX_NAME_LEN 64 /* with the terminator */
+#define TOPOLOGY_MAGIC "TOPO"
+#define TOPOLOGY_VERSION 1
+
+typedef struct topology* topology_t;
+
+/*
+ * Returns an empty topology, or NULL on error.
+ */
+extern topology_t topology_new();
+
+extern void topology_destroy(topology_t topology);
+
+/*
+ * Read a topology from file, in either format. Returns NULL, with a
+ * message, if the file cannot be read or a name cannot be resolved.
+ */
+extern topology_t topology_load(char *file);
+
+/*
+ * Write a topology to file in the binary format. Returns 0 or -1.
+ */
+extern int topology_save(topology_t topology, char *file);
+
+/*
+ * Add a node without links. Returns its number, or -1 if the name is too
+ * long or memory runs out.
+ */
+extern int topology_add_node(topology_t topology, char *name, unsigned int ip);
+
+extern int topology_nodes(topology_t topology);
+
+/*
+ * The last node added with the address or name, or -1.
+ */
+extern int topology_find(topology_t topology, unsigned int ip);
+extern int topology_find_name(topology_t topology, char *name);
+
+extern unsigned int topology_node_ip(topology_t topology, int node);
+extern char* topology_node_name(topology_t topology, int node);
+
+/*
+ * Add or remove the link from src to dest. Links are one way, and a node
+ * has no link to itself. Returns 0, or -1 for a node that does not exist.
+ */
+extern int topology_set_link(topology_t topology, int src, int dest, int on);
+
+/*
+ * Returns 1 if src links to dest.
+ */
+extern int topology_linked(topology_t topology, int src, int dest);
+
+/*
+ * Returns the number of nodes a node links to.
+ */
+extern int topology_degree(topology_t topology, int node);
+
+/*
+ * Fill ips, which holds topology_degree entries, with the addresses of the
+ * nodes a node links to, in node order. Returns how many there are.
+ */
+extern int topology_neighbors(topology_t topology, int node, unsigned int *ips);
+
+#endif /*__TOPOLOGY_H__*/
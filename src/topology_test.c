@@ -0,0 +1,167 @@
+#include "topology.h"
+#include "network.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define TEXT_FILE "topology_test.txt"
+#define BINARY_FILE "topology_test.bin"
+#define NODES 3000
+
+unsigned int ip_of(int i) {
+    return htonl(0x0a000000 | i); // 10.0.x.y
+}
+
+void test_nodes() {
+    topology_t t = topology_new();
+    char name[TOPOLOGY_MAX_NAME_LEN + 1];
+
+    assert(t != NULL);
+    assert(topology_nodes(t) == 0);
+    assert(topology_find(t, ip_of(1)) == -1);
+    assert(topology_find_name(t, "a") == -1);
+
+    assert(topology_add_node(t, "a", ip_of(1)) == 0);
+    assert(topology_add_node(t, "b", ip_of(2)) == 1);
+    assert(topology_find(t, ip_of(2)) == 1);
+    assert(topology_find_name(t, "a") == 0);
+    assert(strcmp(topology_node_name(t, 1), "b") == 0);
+    assert(topology_node_ip(t, 0) == ip_of(1));
+
+    // A later node with the same address or name hides the earlier one
+    assert(topology_add_node(t, "a", ip_of(3)) == 2);
+    assert(topology_add_node(t, "c", ip_of(1)) == 3);
+    assert(topology_find_name(t, "a") == 2);
+    assert(topology_find(t, ip_of(1)) == 3);
+
+    memset(name, 'n', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    assert(topology_add_node(t, name, ip_of(4)) == -1);
+    assert(topology_nodes(t) == 4);
+    topology_destroy(t);
+}
+
+void test_links() {
+    topology_t t = topology_new();
+    unsigned int ips[NODES];
+    int i;
+
+    for (i = 0; i < NODES; i++) {
+        assert(topology_add_node(t, "n", ip_of(i)) == i);
+    }
+    assert(topology_find(t, ip_of(NODES - 1)) == NODES - 1);
+
+    assert(topology_set_link(t, 5, 2999, 1) == 0);
+    assert(topology_set_link(t, 5, 64, 1) == 0);
+    assert(topology_set_link(t, 5, 63, 1) == 0);
+    assert(topology_set_link(t, 5, 5, 1) == 0); // Ignored
+    assert(topology_set_link(t, 5, NODES, 1) == -1);
+    assert(topology_linked(t, 5, 64));
+    assert(!topology_linked(t, 64, 5));
+    assert(!topology_linked(t, 5, 5));
+    assert(topology_degree(t, 5) == 3);
+
+    assert(topology_neighbors(t, 5, ips) == 3);
+    assert(ips[0] == ip_of(63) && ips[1] == ip_of(64) && ips[2] == ip_of(2999));
+
+    assert(topology_set_link(t, 5, 64, 0) == 0);
+    assert(topology_degree(t, 5) == 2);
+    assert(topology_degree(t, 6) == 0);
+
+    // Links survive the bitsets growing
+    assert(topology_add_node(t, "last", ip_of(NODES)) == NODES);
+    assert(topology_linked(t, 5, 2999) && topology_linked(t, 5, 63));
+    assert(topology_degree(t, 5) == 2);
+    topology_destroy(t);
+}
+
+void test_text() {
+    FILE *f = fopen(TEXT_FILE, "w");
+    topology_t t;
+
+    assert(f != NULL);
+    fprintf(f, "10.0.0.1\r\n10.0.0.2\n10.0.0.3\n\n.x.\nx.x\n..\n");
+    fclose(f);
+
+    t = topology_load(TEXT_FILE);
+    assert(t != NULL);
+    assert(topology_nodes(t) == 3);
+    assert(topology_find_name(t, "10.0.0.1") == 0);
+    assert(topology_find(t, inet_addr("10.0.0.3")) == 2);
+    assert(topology_linked(t, 0, 1) && !topology_linked(t, 0, 2));
+    assert(topology_linked(t, 1, 0) && topology_linked(t, 1, 2));
+    assert(topology_degree(t, 2) == 0); // A short line has no more links
+    topology_destroy(t);
+
+    // No matrix at all
+    f = fopen(TEXT_FILE, "w");
+    fprintf(f, "10.0.0.1\n10.0.0.2\n");
+    fclose(f);
+    t = topology_load(TEXT_FILE);
+    assert(t != NULL && topology_nodes(t) == 2 && topology_degree(t, 0) == 0);
+    topology_destroy(t);
+
+    // An incomplete one
+    f = fopen(TEXT_FILE, "w");
+    fprintf(f, "10.0.0.1\n10.0.0.2\n\n.x\n");
+    fclose(f);
+    assert(topology_load(TEXT_FILE) == NULL);
+    assert(topology_load("no such file") == NULL);
+    remove(TEXT_FILE);
+}
+
+void test_binary() {
+    topology_t t = topology_new();
+    topology_t loaded;
+    FILE *f;
+    char name[16];
+    int i;
+    int j;
+
+    for (i = 0; i < NODES; i++) {
+        sprintf(name, "host%d", i);
+        assert(topology_add_node(t, name, ip_of(i)) == i);
+    }
+    for (i = 0; i < NODES; i++) {
+        for (j = 1; j <= 3; j++) {
+            assert(topology_set_link(t, i, (i * 7 + j * 131) % NODES, 1) == 0);
+        }
+    }
+    assert(topology_save(t, BINARY_FILE) == 0);
+
+    loaded = topology_load(BINARY_FILE);
+    assert(loaded != NULL);
+    assert(topology_nodes(loaded) == NODES);
+    for (i = 0; i < NODES; i++) {
+        assert(topology_node_ip(loaded, i) == ip_of(i));
+        assert(strcmp(topology_node_name(loaded, i), topology_node_name(t, i)) == 0);
+        assert(topology_degree(loaded, i) == topology_degree(t, i));
+        for (j = 1; j <= 3; j++) {
+            assert(topology_linked(loaded, i, (i * 7 + j * 131) % NODES));
+        }
+    }
+    assert(topology_find_name(loaded, "host1234") == 1234);
+    topology_destroy(loaded);
+    topology_destroy(t);
+
+    // Cut short
+    f = fopen(BINARY_FILE, "r+");
+    assert(ftruncate(fileno(f), 100) == 0);
+    fclose(f);
+    assert(topology_load(BINARY_FILE) == NULL);
+    remove(BINARY_FILE);
+}
+
+int main(void) {
+    test_nodes();
+    test_links();
+    test_text();
+    test_binary();
+
+    printf("All Tests Pass!!!\n");
+    return 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * Transmit scheduling: deficit round robin over per-flow queues, with
+ * token buckets for flows that have a rate limit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "defs.h"
+#include "txsched.h"
+#include "interrupts.h"
+#include "minithread.h"
+#include "sim.h"
+
+#define FLOW_BUCKETS 256
+
+typedef struct txpkt {
+    struct txpkt *next;
+    long queued; // ns
+    network_address_t dest;
+    int len;
+    char buf[];
+} *txpkt_t;
+
+struct flow {
+    int id;
+    struct flow *hash_next;
+    struct flow *next; // In the round while it has packets queued
+    struct flow *prev;
+    txsched_flow_t cfg;
+    txpkt_t head;
+    txpkt_t tail;
+    long deficit; // Bytes the flow may still send this turn
+    double tokens; // Bucket contents at tb_time
+    long tb_time;
+    txsched_flow_stats_t stats;
+};
+
+/*
+ * Senders queue packets on the virtual processor, with interrupts
+ * disabled, and the transmit thread sends them, so all of this is under a
+ * lock.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready;
+static struct flow *flows[FLOW_BUCKETS];
+static struct flow *cursor; // Next flow in the round to take a turn
+static int n_round; // Flows in the round
+
+static volatile int fair;
+static volatile int n_limited; // Flows with a rate limit
+static volatile int unsent; // Packets queued, or taken and not yet released
+
+static network_classifier_t classify;
+static txsched_release_t release_fn;
+static int thread_started;
+static int sim_pending; // A simulated interrupt will run the scheduler
+
+/* Current time in ns, virtual in simulation mode */
+static long now() {
+    struct timespec ts;
+
+    if (sim_enabled)
+        return time_ticks * PERIOD * MILLISECOND;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * SECOND + ts.tv_nsec;
+}
+
+static struct flow *find_flow(int id, int create) {
+    struct flow **bucket = &flows[(unsigned int) id % FLOW_BUCKETS];
+    struct flow *f;
+
+    for (f = *bucket; f != NULL; f = f->hash_next)
+        if (f->id == id)
+            return f;
+    if ( !create ) return NULL;
+
+    f = (struct flow *) malloc(sizeof(struct flow));
+    if ( !f ) return NULL;
+    memset(f, 0, sizeof(struct flow));
+    f->id = id;
+    f->cfg.weight = 1;
+    f->hash_next = *bucket;
+    *bucket = f;
+    return f;
+}
+
+static void round_add(struct flow *f) {
+    if (cursor == NULL) {
+        f->next = f->prev = f;
+        cursor = f;
+    } else { // Last in the round
+        f->next = cursor;
+        f->prev = cursor->prev;
+        cursor->prev->next = f;
+        cursor->prev = f;
+    }
+    n_round++;
+}
+
+static void round_remove(struct flow *f) {
+    if (f->next == f) {
+        cursor = NULL;
+    } else {
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+        if (cursor == f) cursor = f->next;
+    }
+    f->next = f->prev = NULL;
+    n_round--;
+}
+
+/*
+ * In simulation mode the scheduler only wakes on clock ticks, so the
+ * bucket holds at least a tick's worth of tokens, or the flow would fall
+ * short of its rate.
+ */
+static void refill(struct flow *f, long t) {
+    double cap = f->cfg.burst;
+
+    if (f->cfg.rate <= 0 || t <= f->tb_time) return;
+
+    if (sim_enabled && cap < (double) f->cfg.rate * PERIOD)
+        cap = (double) f->cfg.rate * PERIOD;
+    f->tokens += (t - f->tb_time) * (f->cfg.rate * 1000.0 / SECOND);
+    if (f->tokens > cap) f->tokens = cap;
+    f->tb_time = t;
+}
+
+/*
+ * Tokens needed before a packet of len bytes may go: all of them, or a
+ * full bucket if it is smaller than the packet.
+ */
+static double needed(struct flow *f, int len) {
+    return len < f->cfg.burst ? len : f->cfg.burst;
+}
+
+static int can_send(struct flow *f, int len) {
+    return f->cfg.rate <= 0 || f->tokens >= needed(f, len);
+}
+
+/*
+ * Gives the next flow in the round that may send its turn: its weight in
+ * quanta more credit, spent on the packets at the head of its queue while
+ * its bucket allows. The packets are chained onto batch. Returns 0 if a
+ * flow took its turn, otherwise the time the first throttled flow may
+ * send, or -1 if nothing is queued. Called with the lock held.
+ */
+static long serve(long t, txpkt_t *batch) {
+    struct flow *f;
+    txpkt_t p;
+    long wake = -1;
+    long w;
+    int n;
+
+    *batch = NULL;
+    for (n = n_round; n > 0; n--) {
+        f = cursor;
+        cursor = f->next;
+        refill(f, t);
+        if ( !can_send(f, f->head->len) ) {
+            w = t + (long) ((needed(f, f->head->len) - f->tokens) /
+                            (f->cfg.rate * 1000.0 / SECOND)) + 1;
+            if (wake == -1 || w < wake) wake = w;
+            f->stats.throttled++;
+            continue;
+        }
+
+        f->deficit += (long) TXSCHED_QUANTUM * f->cfg.weight;
+        while (f->head && f->head->len <= f->deficit &&
+               can_send(f, f->head->len)) {
+            p = f->head;
+            f->head = p->next;
+            f->deficit -= p->len;
+            if (f->cfg.rate > 0) f->tokens -= p->len;
+            f->stats.packets++;
+            f->stats.bytes += p->len;
+            f->stats.wait += t - p->queued;
+            f->stats.depth--;
+            p->next = *batch;
+            *batch = p;
+        }
+        if (f->head == NULL) {
+            f->tail = NULL;
+            f->deficit = 0;
+            round_remove(f);
+        }
+        return 0;
+    }
+    return wake;
+}
+
+/*
+ * Sends a batch taken by serve, which chained it newest first. Called
+ * without the lock.
+ */
+static void release_batch(txpkt_t batch) {
+    txpkt_t order = NULL;
+    txpkt_t p;
+    int n = 0;
+
+    while (batch) {
+        p = batch;
+        batch = p->next;
+        p->next = order;
+        order = p;
+    }
+    while (order) {
+        p = order;
+        order = p->next;
+        release_fn(p->dest, p->buf, p->len);
+        free(p);
+        n++;
+    }
+
+    pthread_mutex_lock(&lock);
+    unsent -= n;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The transmit thread: sends whatever the flows may send, then sleeps
+ * until a packet is queued or a throttled flow has its tokens.
+ */
+static void *transmit_loop(void *arg) {
+    struct timespec until;
+    txpkt_t batch;
+    long wake;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        wake = serve(now(), &batch);
+        if (batch) {
+            pthread_mutex_unlock(&lock);
+            release_batch(batch);
+            pthread_mutex_lock(&lock);
+        } else if (wake == -1) {
+            pthread_cond_wait(&ready, &lock);
+        } else if (wake > 0) {
+            until.tv_sec = wake / SECOND;
+            until.tv_nsec = wake % SECOND;
+            pthread_cond_timedwait(&ready, &lock, &until);
+        }
+    }
+    return NULL;
+}
+
+static void sim_wake(void *arg);
+
+/*
+ * Simulation mode: runs the scheduler on the virtual processor, and
+ * schedules it again for the first throttled flow.
+ */
+static void sim_transmit() {
+    txpkt_t batch;
+    long wake;
+    long t;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        t = now();
+        wake = serve(t, &batch);
+        pthread_mutex_unlock(&lock);
+        if (batch) {
+            release_batch(batch);
+        } else if (wake != 0) {
+            break;
+        }
+    }
+    if (wake > 0 && !sim_pending &&
+        sim_schedule((int) ((wake - t + MILLISECOND - 1) / MILLISECOND),
+                     sim_wake, NULL) == 0)
+        sim_pending = 1;
+}
+
+static void sim_wake(void *arg) {
+    sim_pending = 0;
+    sim_transmit();
+}
+
+/* Called with the lock held */
+static void start_thread() {
+    pthread_condattr_t attr;
+    pthread_t thread;
+    sigset_t set;
+    sigset_t old_set;
+    int error;
+
+    if (thread_started || sim_enabled || !release_fn) return;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ready, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // The thread inherits a mask that keeps interrupts on the main thread
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    error = pthread_create(&thread, NULL, transmit_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    AbortOnCondition(error != 0, "pthread_create");
+    pthread_detach(thread);
+    thread_started = 1;
+}
+
+void txsched_initialize(txsched_release_t release) {
+    release_fn = release;
+}
+
+void txsched_set_classifier(network_classifier_t classifier) {
+    classify = classifier;
+}
+
+void txsched_set_flow(int flow, txsched_flow_t *cfg) {
+    interrupt_level_t old_level;
+    struct flow *f;
+
+    minithread_use_fp(); // Token buckets are doubles
+    old_level = set_interrupt_level(DISABLED);
+    pthread_mutex_lock(&lock);
+    f = find_flow(flow, cfg != NULL);
+    if (f) {
+        if (f->cfg.rate > 0) n_limited--;
+        if (cfg) {
+            f->cfg = *cfg;
+            if (f->cfg.weight < 1) f->cfg.weight = 1;
+            if (f->cfg.burst < 0) f->cfg.burst = 0;
+        } else {
+            memset(&f->cfg, 0, sizeof(f->cfg));
+            f->cfg.weight = 1;
+        }
+        f->tokens = f->cfg.burst;
+        f->tb_time = now();
+        if (f->cfg.rate > 0) n_limited++;
+    }
+    pthread_mutex_unlock(&lock);
+    set_interrupt_level(old_level);
+}
+
+void txsched_set_fair(int on) {
+    fair = on;
+}
+
+int txsched_active() {
+    return fair || n_limited > 0 || unsent > 0;
+}
+
+int txsched_send(network_address_t dest, struct iovec *iov, int iovcnt,
+                 int len) {
+    interrupt_level_t old_level;
+    struct flow *f;
+    txpkt_t p;
+    int limit;
+    int id;
+    int off;
+    int i;
+
+    minithread_use_fp(); // Simulation mode schedules on this thread
+    p = (txpkt_t) malloc(sizeof(struct txpkt) + len);
+    if ( !p ) return -1;
+    for (off = 0, i = 0; i < iovcnt; i++) {
+        memcpy(p->buf + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    p->len = len;
+    p->next = NULL;
+    network_address_copy(dest, p->dest);
+    id = classify ? classify(p->buf, len) : TXSCHED_DEFAULT_FLOW;
+
+    old_level = set_interrupt_level(DISABLED);
+    pthread_mutex_lock(&lock);
+
+    f = find_flow(id, 1);
+    if ( !f ) {
+        pthread_mutex_unlock(&lock);
+        set_interrupt_level(old_level);
+        free(p);
+        return -1;
+    }
+
+    // Tail drop
+    limit = f->cfg.limit > 0 ? f->cfg.limit : TXSCHED_LIMIT;
+    if (f->stats.depth >= limit) {
+        f->stats.dropped++;
+        pthread_mutex_unlock(&lock);
+        set_interrupt_level(old_level);
+        free(p);
+        return len;
+    }
+
+    p->queued = now();
+    if (f->tail) {
+        f->tail->next = p;
+    } else {
+        f->head = p;
+        round_add(f);
+    }
+    f->tail = p;
+    unsent++;
+    if (++f->stats.depth > f->stats.max_depth)
+        f->stats.max_depth = f->stats.depth;
+
+    start_thread();
+    if (thread_started) pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+
+    if (sim_enabled) sim_transmit();
+    set_interrupt_level(old_level);
+    return len;
+}
+
+int txsched_flow_stats(int flow, txsched_flow_stats_t *stats) {
+    interrupt_level_t old_level;
+    struct flow *f;
+
+    old_level = set_interrupt_level(DISABLED);
+    pthread_mutex_lock(&lock);
+    f = find_flow(flow, 0);
+    if (f) *stats = f->stats;
+    pthread_mutex_unlock(&lock);
+    set_interrupt_level(old_level);
+    return f ? 0 : -1;
+}
@@ -0,0 +1,103 @@
+/*
+ * txsched.h:
+ *      Transmit scheduling.
+ *
+ *      Without scheduling, packets leave in the order they are sent, so a
+ *      port sending flat out can take the whole link. Once fair queuing is
+ *      on, or some flow has a rate limit, every packet is queued by flow
+ *      and a transmit thread sends them. Flows take turns by deficit round
+ *      robin: each turn a flow may send up to its weight in full packets'
+ *      worth of bytes. A flow with a rate limit also has a token bucket,
+ *      and skips its turns until the bucket holds the packet at its head,
+ *      or is full. A flow's queue is limited, beyond which packets are
+ *      tail dropped.
+ *
+ *      A flow is the minimsg or minisocket traffic from one local port,
+ *      see miniport_set_tx_flow and minisocket_set_tx_flow. Everything
+ *      else (route discovery, replies, packets forwarded for other hosts)
+ *      is the default flow. Packets to emulated links go to the emulator
+ *      directly, which has its own bandwidth cap.
+ *
+ *      In simulation mode the scheduler runs on simulated interrupts and
+ *      waits for tokens in whole clock ticks.
+ */
+#ifndef __TXSCHED_H__
+#define __TXSCHED_H__
+
+#include <sys/uio.h>
+#include "network.h"
+
+#define TXSCHED_DEFAULT_FLOW 0
+#define TXSCHED_FLOW(protocol, port) (((protocol) << 16) | (port))
+
+#define TXSCHED_QUANTUM network_mtu() /* bytes per turn and weight */
+#define TXSCHED_LIMIT 256 /* packets queued per flow by default */
+
+typedef struct txsched_flow {
+    int rate; /* kilobytes per second, 0 for no cap */
+    int burst; /* bytes */
+    int weight; /* quanta per turn, 1 if less */
+    int limit; /* packets queued, TXSCHED_LIMIT if 0 */
+} txsched_flow_t;
+
+typedef struct txsched_flow_stats {
+    long packets; /* packets sent */
+    long bytes;
+    long dropped; /* packets tail dropped */
+    long throttled; /* turns skipped waiting for tokens */
+    long wait; /* ns the packets sent spent queued */
+    int depth; /* packets queued now */
+    int max_depth;
+} txsched_flow_stats_t;
+
+/*
+ * Sends a packet the scheduler let go. Runs on the transmit thread in real
+ * mode, and on the virtual processor in simulation mode.
+ */
+typedef void (*txsched_release_t)(network_address_t dest, char *buf, int len);
+
+/*
+ * Start scheduling through release when there is something to schedule.
+ * Called by network_initialize.
+ */
+extern void txsched_initialize(txsched_release_t release);
+
+/*
+ * Set the function that gives the flow of a packet from its first len
+ * bytes; without one every packet is in the default flow.
+ */
+extern void txsched_set_classifier(network_classifier_t classifier);
+
+/*
+ * Configure a flow, or put it back to an uncapped flow of weight 1 if cfg
+ * is NULL.
+ */
+extern void txsched_set_flow(int flow, txsched_flow_t *cfg);
+
+/*
+ * Turn fair queuing of all flows on or off. Flows with a rate limit are
+ * scheduled either way.
+ */
+extern void txsched_set_fair(int on);
+
+/*
+ * Returns 1 if packets are scheduled: fair queuing is on, a flow has a rate
+ * limit, or packets queued earlier have yet to be sent, which later packets
+ * must not overtake.
+ */
+extern int txsched_active();
+
+/*
+ * Queue a packet to dest. Returns the bytes sent, which includes packets
+ * the flow drops, or -1 on failure.
+ */
+extern int txsched_send(network_address_t dest, struct iovec *iov, int iovcnt,
+                        int len);
+
+/*
+ * Copy a flow's counters into stats. Returns 0, or -1 if the flow has
+ * never been configured or sent a scheduled packet.
+ */
+extern int txsched_flow_stats(int flow, txsched_flow_stats_t *stats);
+
+#endif /*__TXSCHED_H__*/